@@ -1,578 +1,4226 @@
 #define FUSE_USE_VERSION 26
 
 #include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>          /* clock_gettime() */
+#include <netinet/tcp.h>   /* TCP_NODELAY */
+#include <sys/ipc.h>
+#include <sys/shm.h>
 
 #include "samfs_common.h"
 
 /* SERVER_IP and SERVER_URL are local to this file */
 static char SERVER_IP[80];
-static char SERVER_URL[80];
+static char SERVER_URL[PATH_MAX];
+
+/* connections to server, shared by all callers.
+   every request gets an id and many requests can be in flight on a connection.
+   a receiver thread of each connection reads response frames and hands them
+   to the caller waiting for that id, straight into buffer the caller has posted.
+   connections are opened as callers need them, up to '-conns' of them.
+ */
+#define CONN_POOL_MAX   64
+#define CONN_POOL_DEF   8
+
+struct conn_t {
+   int                  fd;
+   int                  dead;       /* broken, its calls fail and new calls go elsewhere */
+   int                  refs;       /* slot, receiver and calls in flight */
+   int                  calls;      /* calls in flight */
+   uint64_t             next_id;
+   struct call_t        *waiting;   /* calls in flight */
+   struct call_t        *receiving; /* call whose response frame receiver is reading, it is not failed by others */
+   pthread_cond_t       posted;     /* receiver waits here for caller to post a buffer */
+   pthread_mutex_t      tx_lock;    /* a request frame (and its bulk data) goes out whole */
+};
+
+/* request in flight, lives on stack of its caller */
+struct call_t {
+   struct call_t        *next;
+   struct conn_t        *conn;
+   uint64_t             id;
+   struct rsp_t         *rsp;       /* where next response frame goes */
+   int                  posted;     /* rsp is ready to take next frame */
+   int                  filled;     /* a frame has been placed in rsp */
+   int                  failed;     /* connection broke before response was complete */
+   pthread_cond_t       done;
+   int                  msg;        /* msg_type_t of request, for statistics */
+   uint64_t             start_ns;   /* when it was sent */
+};
+
+static struct conn_t    *conns[CONN_POOL_MAX];
+static int              conn_pool_size = CONN_POOL_DEF; /* max connections, set by '-conns' */
+static pthread_mutex_t  conn_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* largest data payload server accepts in one frame, learnt by HELLO */
+static size_t           server_max_payload = SAMFS_MIN_PAYLOAD;
+static uint32_t         server_features;            /* SAMFS_FEAT_* accepted by server */
+static uint32_t         zip_want;                   /* SAMFS_FEAT_* codec asked for by '-compress' */
+static int              zip_codec;                  /* FRAME_* codec agreed with server, 0 if none */
+static int              zip_req;                    /* REQ_* option asking for compressed READ data */
+
+#define BULK_WRITE_MIN  SAMFS_MIN_PAYLOAD   /* smaller writes go inline in WRITE frames */
+
+/* large reads and writes are split in stripes moved over several connections at once.
+   one tcp stream moves at most its window per round trip, several streams (served by
+   several server workers) fill a link one stream cannot.
+   a stripe is never smaller than what one stream moves in a round trip, as measured,
+   and number of stripes keeps moving up or down while that raises throughput of
+   large transfers, up to '-stripes'.
+ */
+#define STRIPE_MIN      (128 * 1024)  /* smallest stripe, smaller transfers are not split */
+#define STRIPE_MAX_DEF  4
+#define STRIPE_LIMIT    16            /* largest '-stripes' */
+#define STRIPE_PROBE    16            /* large transfers timed before number of stripes is reconsidered */
+#define RTT_MAX_DATA    4096          /* requests moving less data are timed as round trips */
+
+/* stripe of a large write, lives on stack of the writer */
+struct stripe_t {
+   struct stripe_t      *next;      /* next stripe waiting for a worker */
+   const char           *path;
+   uint64_t             fh;
+   const char           *buf;
+   size_t               sz;
+   off_t                of;
+   int                  slot;       /* connection it goes on */
+   int                  taken;      /* being written by a worker or by the writer itself */
+   int                  done;
+   int                  rv;
+};
+
+static int              stripe_max = STRIPE_MAX_DEF;   /* '-stripes', 1 never splits */
+static int              stripe_width;                  /* stripes large transfers are split in now */
+static int              stripe_step = -1;              /* width moves by this after a probe */
+static int              stripe_slot;                   /* connection first stripe of next transfer goes on */
+static double           stripe_rate;                   /* bytes/s of large transfers during last probe */
+static double           probe_bytes;
+static double           probe_time;
+static int              probe_count;
+static double           rtt_avg;                       /* seconds */
+static double           stream_rate;                   /* bytes/s one stripe moves */
+static struct stripe_t  *stripe_head;                  /* write stripes waiting for a worker */
+static struct stripe_t  *stripe_tail;
+static pthread_mutex_t  stripe_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   stripe_ready = PTHREAD_COND_INITIALIZER;   /* stripe queued */
+static pthread_cond_t   stripe_done = PTHREAD_COND_INITIALIZER;    /* stripe written */
+static pthread_once_t   stripe_once = PTHREAD_ONCE_INIT;
+
+/* attributes and failed lookups (ENOENT) of recently seen paths,
+   saves a round trip for repeated stats of the same path.
+ */
+#define ATTR_CACHE_BUCKETS 4096
+#define ATTR_CACHE_MAX     65536     /* max cached paths */
+#define ATTR_TIMEOUT_DEF   1.0       /* seconds */
+#define NEG_TIMEOUT_DEF    1.0
+
+struct attr_entry_t {
+   struct attr_entry_t  *next;      /* next entry of hash bucket */
+   double               expire;     /* entry is valid till this time, see now_sec() */
+   int                  err;        /* 0 if st is valid, ENOENT for negative entry */
+   struct stat          st;
+   char                 path[];
+};
+
+static struct attr_entry_t *attr_cache[ATTR_CACHE_BUCKETS];
+static int              attr_cache_count;
+static pthread_mutex_t  attr_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static double           attr_timeout = ATTR_TIMEOUT_DEF;  /* '-attr_timeout', 0 disables cache */
+static double           neg_timeout = NEG_TIMEOUT_DEF;    /* '-neg_timeout', 0 disables negative entries */
+
+/* what kernel is told at mount. timeouts above apply to kernel's own attribute and
+   lookup caches too, page cache of a file is kept across opens as long as its size
+   and modification time stay the same.
+ */
+#define ENTRY_TIMEOUT_DEF  1.0       /* seconds kernel may keep name to file lookups */
+#define MAX_IO_DEF         1024      /* KB, largest read/write kernel sends in one request */
+
+static double           entry_timeout = ENTRY_TIMEOUT_DEF; /* '-entry_timeout' */
+static unsigned int     max_io = MAX_IO_DEF * 1024;        /* '-max_io', libfuse may lower it */
+static int              kernel_cache = TRUE;               /* '-no_kernel_cache' drops page cache on open */
+static int              raw_reads = FALSE;                 /* '-raw_reads' takes read data unchecksummed */
+
+/* blocks of file data read from server, shared by all opens of a file.
+   a block is tagged with size and modification time file had when it was opened,
+   so that changes made by other clients are seen on next open.
+ */
+#define BLOCK_SIZE         (128 * 1024)
+#define BLOCK_BUCKETS      4096
+#define CACHE_SIZE_DEF     64        /* MB */
+#define RA_MIN_BLOCKS      2         /* readahead window once reads turn sequential */
+#define RA_MAX_BLOCKS      32        /* window doubles with each sequential read up to this */
+#define RA_QUEUE_MAX       256       /* max blocks waiting to be read ahead */
+#define RA_THREADS         4
+
+enum {
+   BLOCK_LOADING,
+   BLOCK_READY,
+   BLOCK_FAILED,
+};
+
+/* file having blocks in cache */
+struct cfile_t {
+   struct cfile_t       *next;      /* next file of hash bucket */
+   struct block_t       *blocks;    /* its blocks */
+   char                 path[];
+};
+
+struct block_t {
+   struct block_t       *hnext;     /* next block of hash bucket */
+   struct block_t       *prev;      /* LRU list (most recently used first) */
+   struct block_t       *next;
+   struct block_t       *fprev;     /* blocks of same file */
+   struct block_t       *fnext;
+   struct cfile_t       *file;      /* NULL once block is dropped from cache */
+   off_t                index;      /* offset in file / BLOCK_SIZE */
+   int                  state;
+   int                  err;        /* errno of BLOCK_FAILED */
+   int                  refs;       /* readers and readahead holding block */
+   size_t               len;        /* valid bytes, less than BLOCK_SIZE at end of file */
+   struct timespec      mtime;      /* attributes of file block was read for */
+   off_t                size;
+   char                 data[];
+};
+
+/* block queued for readahead, 'path' is copied as file may go away meanwhile */
+struct ra_item_t {
+   struct ra_item_t     *next;
+   struct block_t       *blk;
+   uint64_t             fh;
+   char                 path[];
+};
+
+static struct cfile_t   *cfiles[ATTR_CACHE_BUCKETS];
+static struct block_t   *blocks[BLOCK_BUCKETS];
+static struct block_t   *block_lru_head;
+static struct block_t   *block_lru_tail;
+static int              block_count;
+static int              block_max = CACHE_SIZE_DEF * (1024 * 1024 / BLOCK_SIZE); /* '-cache_size', 0 disables cache */
+static pthread_mutex_t  block_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   block_loaded = PTHREAD_COND_INITIALIZER;  /* some block left BLOCK_LOADING */
+static struct ra_item_t *ra_head;
+static struct ra_item_t *ra_tail;
+static int              ra_count;
+static pthread_cond_t   ra_ready = PTHREAD_COND_INITIALIZER;
+static pthread_once_t   ra_once = PTHREAD_ONCE_INIT;
+
+/* file opened through fuse, fuse keeps pointer to it in fh */
+struct open_file_t {
+   uint64_t             fh;         /* server handle, 0 if server did not keep file open */
+   struct timespec      mtime;      /* attributes at open, cached blocks must match them */
+   off_t                size;
+   off_t                next_off;   /* offset following last read, a read here is sequential */
+   int                  ra_window;  /* blocks kept read ahead, 0 while reads are random */
+   off_t                ra_next;    /* first block not read ahead yet */
+};
+
+#define OPEN_FILE(finfo)   ((struct open_file_t *)(uintptr_t)(finfo)->fh)
+
+/* write-back ('-writeback <sec>'): writes are kept as dirty ranges of their file,
+   adjacent and overlapping ones merged, and sent to server by a flusher thread once
+   they are that many seconds old or file has WB_FILE_FLUSH bytes dirty. fsync, flush
+   and release wait for dirty data of file to reach server.
+ */
+#define WB_FILE_FLUSH      (4 * 1024 * 1024)
+#define WB_MAX_DIRTY       (64 * 1024 * 1024)   /* above this writers flush their file themselves */
+#define WB_BUCKETS         256
+
+/* dirty range, ranges of a file are sorted by offset and neither overlap nor touch */
+struct dirty_t {
+   struct dirty_t       *next;
+   off_t                of;
+   size_t               len;
+   size_t               cap;        /* allocated size of data */
+   char                 *data;
+};
+
+/* file having dirty data */
+struct wfile_t {
+   struct wfile_t       *next;      /* next file of hash bucket */
+   struct dirty_t       *ranges;    /* waiting for flush */
+   struct dirty_t       *flushing;  /* being sent to server, still seen by readers */
+   pthread_rwlock_t     sent_lock;  /* readers hold it shared, so flushed data is not dropped
+                                       between their server read and overlay */
+   size_t               dirty;      /* bytes in ranges */
+   double               since;      /* time ranges got dirty */
+   uint64_t             fh;         /* server handle of a writer, 0 goes by path */
+   int                  busy;       /* a flush is in progress */
+   int                  err;        /* errno of failed flush, reported by next fsync/flush/release */
+   int                  refs;
+   char                 path[];
+};
+
+static struct wfile_t   *wfiles[WB_BUCKETS];
+static size_t           wb_dirty;                  /* dirty bytes of all files */
+static double           wb_delay;                  /* '-writeback', 0 if writes go straight to server */
+static pthread_mutex_t  wb_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   wb_flushed = PTHREAD_COND_INITIALIZER;   /* a flush has ended */
+static pthread_cond_t   wb_kick = PTHREAD_COND_INITIALIZER;      /* flusher has work */
+static pthread_once_t   wb_once = PTHREAD_ONCE_INIT;
+
+/* low-level mode ('-lowlevel'): kernel names files by inode number.
+   server knows files by path only, so every inode handed to kernel stands for the path
+   it was looked up by, until kernel forgets it. unlinked inodes keep their path for
+   opens still using them but are no longer found by it, a rename moves the path of
+   inode and of everything below it.
+ */
+struct inode_t {
+   struct inode_t       *next;      /* next inode of ino hash bucket */
+   struct inode_t       *pnext;     /* next inode of path hash bucket, while hashed */
+   fuse_ino_t           ino;
+   uint64_t             nlookup;    /* lookups not forgotten by kernel yet */
+   int                  hashed;     /* TRUE while path leads to this inode */
+   int                  opened;     /* size and mtime below are from last open */
+   off_t                size;
+   struct timespec      mtime;
+   char                 *path;
+};
+
+/* directory opened in low-level mode, listing is fetched once and handed out in pieces */
+struct ll_dir_t {
+   fuse_req_t           req;        /* request filling the listing */
+   char                 *buf;       /* entries packed by fuse_add_direntry() */
+   size_t               len;
+   size_t               cap;
+   int                  filled;
+};
+
+static struct inode_t   *inodes[ATTR_CACHE_BUCKETS];
+static struct inode_t   *inode_paths[ATTR_CACHE_BUCKETS];
+static fuse_ino_t       inode_next = FUSE_ROOT_ID + 1;
+static pthread_mutex_t  inode_lock = PTHREAD_MUTEX_INITIALIZER;
+static int              lowlevel;                  /* '-lowlevel' */
+
+/* statistics live in shared memory, 'masd -status <mount_point>' reads them from another
+   process. counters are kept apart for each thread, in slots of their own cache lines,
+   so that counting is one uncontended atomic add. reader sums slots up.
+   fuse operations, calls to server and connects are timed in latency histograms,
+   see samfs_lat_bucket().
+ */
+#define STAT_SLOTS         64        /* last one is shared by threads finding no free slot */
+#define STAT_MSGS          (READDIRPLUS + 1)
+
+#define STAT_ADD(counter, n)  __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+#define STAT_SUB(counter, n)  __atomic_fetch_sub(&(counter), (n), __ATOMIC_RELAXED)
+#define STAT_GET(counter)     __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+/* fuse operations, as counted in statistics */
+enum {
+   OP_GETATTR,
+   OP_ACCESS,
+   OP_MKDIR,
+   OP_OPENDIR,
+   OP_READDIR,
+   OP_RELEASEDIR,
+   OP_RMDIR,
+   OP_CREATE,
+   OP_OPEN,
+   OP_READ,
+   OP_WRITE,
+   OP_TRUNCATE,
+   OP_FLUSH,
+   OP_FSYNC,
+   OP_RELEASE,
+   OP_UNLINK,
+   OP_RENAME,
+   OP_CHMOD,
+   OP_UTIME,
+   OP_STATFS,
+   OP_COUNT
+};
+
+static const char *op_names[OP_COUNT] = {
+   "getattr",
+   "access",
+   "mkdir",
+   "opendir",
+   "readdir",
+   "releasedir",
+   "rmdir",
+   "create",
+   "open",
+   "read",
+   "write",
+   "truncate",
+   "flush",
+   "fsync",
+   "release",
+   "unlink",
+   "rename",
+   "chmod",
+   "utime",
+   "statfs",
+};
+
+/* names of server calls, by msg_type_t */
+static const char *msg_names[STAT_MSGS] = {
+   "unknown",
+   "getattr",
+   "access",
+   "mkdir",
+   "opendir",
+   "readdir",
+   "releasedir",
+   "rmdir",
+   "create",
+   "open",
+   "read",
+   "write",
+   "truncate",
+   "release",
+   "unlink",
+   "rename",
+   "chmod",
+   "utime",
+   "statfs",
+   "hello",
+   "readdirplus",
+};
+
+struct stat_slot_t {
+   int            busy;                   /* claimed by a thread, counters stay when it ends */
+   uint64_t       connects;               /* connections opened to server */
+   uint64_t       connect_fails;          /* connects that failed */
+   uint64_t       call_fails;             /* calls lost with their connection, never retried */
+   uint64_t       attr_hits;              /* getattr answered by attribute cache */
+   uint64_t       attr_misses;
+   uint64_t       block_hits;             /* block found in cache (maybe still being read ahead) */
+   uint64_t       block_misses;
+   uint64_t       ra_blocks;              /* blocks read ahead */
+   uint64_t       ops[OP_COUNT];          /* fuse operations served */
+   uint64_t       op_errors[OP_COUNT];    /* those that failed */
+   uint64_t       calls[STAT_MSGS];       /* calls to server, by msg_type_t */
+   uint32_t       connect_lat[SAMFS_LAT_BUCKETS];
+   uint32_t       op_lat[OP_COUNT][SAMFS_LAT_BUCKETS];
+   uint32_t       call_lat[STAT_MSGS][SAMFS_LAT_BUCKETS];   /* from sending request to its last response frame */
+} __attribute__((aligned(64)));
+
+struct masd_status_t {
+   int            pid;                    /* pid of masd serving the mount */
+   char           mount_point[PATH_MAX];
+   char           server[PATH_MAX + 80];  /* ip:url mounted */
+   int            conns;                  /* connections open to server */
+   struct stat_slot_t slots[STAT_SLOTS];
+} *masd_stat;
+
+static int              stat_shmid = -1;
+static pthread_key_t    stat_key;         /* slot of calling thread */
+static pthread_once_t   stat_once = PTHREAD_ONCE_INIT;
+
+static int say_hello(int sock_fd);
+static int write_server (const char *path, uint64_t fh, const char *buf, size_t sz, off_t of);
+
+/* a thread that ends gives its slot back, counters stay in it for next owner */
+static void stat_slot_release(void *data)
+{
+   struct stat_slot_t *slot;
+
+   slot = data;
+   if(slot != &masd_stat->slots[STAT_SLOTS - 1]) {
+      __atomic_store_n(&slot->busy, FALSE, __ATOMIC_RELEASE);
+   }
+}
+
+static void stat_key_init(void)
+{
+   pthread_key_create(&stat_key, stat_slot_release);
+}
+
+/* counters of calling thread, a free slot is claimed on first use */
+static struct stat_slot_t *stat_slot(void)
+{
+   struct stat_slot_t   *slot;
+   int                  busy;
+   int                  i;
+
+   pthread_once(&stat_once, stat_key_init);
+   slot = pthread_getspecific(stat_key);
+   if(slot) {
+      return slot;
+   }
+
+   for(i = 0; i < STAT_SLOTS - 1; i++) {
+      busy = FALSE;
+      if(!STAT_GET(masd_stat->slots[i].busy) &&
+            __atomic_compare_exchange_n(&masd_stat->slots[i].busy, &busy, TRUE, FALSE, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+         break;
+      }
+   }
+   slot = &masd_stat->slots[i];
+   pthread_setspecific(stat_key, slot);
+
+   return slot;
+}
+
+/* shared memory key of statistics of 'mount_point', trailing slashes do not count */
+static key_t stat_shm_key(const char *mount_point)
+{
+   char     path[PATH_MAX];
+   size_t   len;
+   uint64_t h;
+
+   snprintf(path, sizeof(path), "%s", mount_point);
+   len = strlen(path);
+   while(len > 1 && path[len - 1] == '/') {
+      path[--len] = '\0';
+   }
+
+   /* kept clear of pids samd uses as keys */
+   h = samfs_hash(SAMFS_HASH_INIT, path);
+   h ^= h >> 32;
+
+   return (key_t) ((h & 0x3fffffff) | 0x40000000);
+}
+
+/* attaches statistics of 'mount_point', creating them if 'create' (by masd serving it).
+   returns NULL if they do not exist or can not be created.
+ */
+static struct masd_status_t *stat_attach(const char *mount_point, int create)
+{
+   key_t key;
+   int   shmid;
+   void  *shm;
+
+   key = stat_shm_key(mount_point);
+   shmid = shmget(key, sizeof(struct masd_status_t), (create)? IPC_CREAT | 0644: 0);
+   if(shmid < 0 && create && EINVAL == errno) {
+      /* left behind by a masd of another size, replace it */
+      shmid = shmget(key, 0, 0);
+      if(shmid >= 0) {
+         shmctl(shmid, IPC_RMID, NULL);
+      }
+      shmid = shmget(key, sizeof(struct masd_status_t), IPC_CREAT | 0644);
+   }
+   if(shmid < 0) {
+      return NULL;
+   }
+   shm = shmat(shmid, NULL, (create)? 0: SHM_RDONLY);
+   if(shm == ((void *) -1)) {
+      return NULL;
+   }
+   if(create) {
+      stat_shmid = shmid;
+   }
+
+   return shm;
+}
+
+/* counts 'ns' nanoseconds in histogram 'hist' */
+static void stat_lat(uint32_t *hist, uint64_t ns)
+{
+   STAT_ADD(hist[samfs_lat_bucket(ns)], 1);
+}
+
+static int connect_to_server()
+{
+   struct sockaddr_in   sock;
+   int                  sock_fd;
+   int                  ret;
+   int                  optval;
+   uint64_t             start;
+   struct stat_slot_t   *slot;
+
+   start = samfs_now_ns();
+   slot = stat_slot();
+   STAT_ADD(slot->connects, 1);
+
+   /* create a socket for TCP connection */
+   sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+   if(-1 == sock_fd) {
+      STAT_ADD(slot->connect_fails, 1);
+      return sock_fd;
+   }
+
+   /* connect to server */
+   sock.sin_family = AF_INET;
+   sock.sin_addr.s_addr = inet_addr(SERVER_IP);
+   sock.sin_port = htons(SERVER_PORT);
+   ret = connect(sock_fd, (struct sockaddr *)&sock, sizeof(struct sockaddr));
+   if(-1 == ret) {
+      ret = errno;
+      close(sock_fd);
+      STAT_ADD(slot->connect_fails, 1);
+      errno = ret;
+      return -1;
+   }
+
+   /* requests are small and latency bound, do not let nagle hold them back */
+   optval = 1;
+   setsockopt(sock_fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+
+   if(say_hello(sock_fd) < 0) {
+      ret = errno;
+      close(sock_fd);
+      STAT_ADD(slot->connect_fails, 1);
+      errno = ret;
+      return -1;
+   }
+   stat_lat(slot->connect_lat, samfs_now_ns() - start);
+
+   return sock_fd;
+}
+
+/* time in seconds, from a clock not affected by date changes */
+static double now_sec(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned int attr_hash(const char *path)
+{
+   uint64_t h;
+
+   h = samfs_hash(SAMFS_HASH_INIT, path);
+
+   return (unsigned int)((h ^ (h >> 32)) % ATTR_CACHE_BUCKETS);
+}
+
+/* unlinks and frees entry '*pentry' of bucket list, caller holds attr_cache_lock */
+static void attr_cache_drop(struct attr_entry_t **pentry)
+{
+   struct attr_entry_t *entry;
+
+   entry = *pentry;
+   *pentry = entry->next;
+   free(entry);
+   attr_cache_count--;
+}
+
+/* returns TRUE if 'path' has a live entry, its attributes are copied to 'st'
+   or, for a negative entry, its error to '*err'.
+ */
+static int attr_cache_lookup(const char *path, struct stat *st, int *err)
+{
+   struct attr_entry_t  **pentry;
+   int                  found;
+
+   if(attr_timeout <= 0 && neg_timeout <= 0) {
+      return FALSE;
+   }
+
+   found = FALSE;
+   pthread_mutex_lock(&attr_cache_lock);
+   for(pentry = &attr_cache[attr_hash(path)]; *pentry; pentry = &(*pentry)->next) {
+      if(strcmp((*pentry)->path, path) == 0) {
+         if((*pentry)->expire < now_sec()) {
+            attr_cache_drop(pentry);
+            break;
+         }
+         *st = (*pentry)->st;
+         *err = (*pentry)->err;
+         found = TRUE;
+         break;
+      }
+   }
+   pthread_mutex_unlock(&attr_cache_lock);
+   if(found) {
+      STAT_ADD(stat_slot()->attr_hits, 1);
+   }
+   else {
+      STAT_ADD(stat_slot()->attr_misses, 1);
+   }
+
+   return found;
+}
+
+/* remembers result of getattr of 'path', 'err' is 0 for attributes in 'st' or ENOENT */
+static void attr_cache_store(const char *path, const struct stat *st, int err)
+{
+   struct attr_entry_t  **pentry;
+   struct attr_entry_t  *entry;
+   double               timeout;
+   double               now;
+   int                  i;
+
+   timeout = (err)? neg_timeout: attr_timeout;
+   if(timeout <= 0) {
+      return;
+   }
+   now = now_sec();
+
+   pthread_mutex_lock(&attr_cache_lock);
+   pentry = &attr_cache[attr_hash(path)];
+   for(entry = *pentry; entry; entry = entry->next) {
+      if(strcmp(entry->path, path) == 0) {
+         break;
+      }
+   }
+   if(NULL == entry) {
+      if(attr_cache_count >= ATTR_CACHE_MAX) {
+         /* make room by dropping expired entries, stop caching if all are live */
+         for(i = 0; i < ATTR_CACHE_BUCKETS; i++) {
+            for(pentry = &attr_cache[i]; *pentry; ) {
+               if((*pentry)->expire < now) {
+                  attr_cache_drop(pentry);
+               }
+               else {
+                  pentry = &(*pentry)->next;
+               }
+            }
+         }
+         if(attr_cache_count >= ATTR_CACHE_MAX) {
+            pthread_mutex_unlock(&attr_cache_lock);
+            return;
+         }
+         pentry = &attr_cache[attr_hash(path)];
+      }
+      entry = malloc(sizeof(struct attr_entry_t) + strlen(path) + 1);
+      if(NULL == entry) {
+         pthread_mutex_unlock(&attr_cache_lock);
+         return;
+      }
+      strcpy(entry->path, path);
+      entry->next = *pentry;
+      *pentry = entry;
+      attr_cache_count++;
+   }
+   if(st) {
+      entry->st = *st;
+   }
+   entry->err = err;
+   entry->expire = now + timeout;
+   pthread_mutex_unlock(&attr_cache_lock);
+}
+
+/* forgets 'path' and, if 'tree' is TRUE, everything below it */
+static void attr_cache_forget(const char *path, int tree)
+{
+   struct attr_entry_t  **pentry;
+   size_t               len;
+   int                  i;
+
+   pthread_mutex_lock(&attr_cache_lock);
+   if(tree) {
+      len = strlen(path);
+      for(i = 0; i < ATTR_CACHE_BUCKETS; i++) {
+         for(pentry = &attr_cache[i]; *pentry; ) {
+            if(strncmp((*pentry)->path, path, len) == 0 &&
+                  ((*pentry)->path[len] == '\0' || (*pentry)->path[len] == '/')) {
+               attr_cache_drop(pentry);
+            }
+            else {
+               pentry = &(*pentry)->next;
+            }
+         }
+      }
+   }
+   else {
+      for(pentry = &attr_cache[attr_hash(path)]; *pentry; pentry = &(*pentry)->next) {
+         if(strcmp((*pentry)->path, path) == 0) {
+            attr_cache_drop(pentry);
+            break;
+         }
+      }
+   }
+   pthread_mutex_unlock(&attr_cache_lock);
+}
+
+/* 'path' was created, removed or renamed: forget it and its parent dir,
+   whose size, link count and times have changed.
+ */
+static void attr_cache_forget_entry(const char *path)
+{
+   char  parent[PATH_MAX];
+   char  *slash;
+
+   attr_cache_forget(path, FALSE);
+
+   strncpy(parent, path, sizeof(parent) - 1);
+   parent[sizeof(parent) - 1] = '\0';
+   slash = strrchr(parent, '/');
+   if(slash) {
+      slash[(slash == parent)? 1: 0] = '\0';
+      attr_cache_forget(parent, FALSE);
+   }
+}
+
+static int create_req_pkt(struct req_t *req, int msg, const char *path, mode_t mode, int flags, const char *npath, size_t size, off_t offset)
+{
+   memset(req, 0, sizeof(struct req_t));
+   req->msg = msg;
+   req->url = SERVER_URL;
+   req->uri = (char *) path;
+   req->npath = (char *) npath;
+   req->mode = mode;
+   req->flags = flags;
+   req->size = size;
+   req->offset = offset;
+
+   return 0;
+}
+
+static int send_req(int sock_fd, struct req_t *req)
+{
+   int                  rv;
+   struct frame_hdr_t   hdr;
+   struct req_hdr_t     rhdr;
+   struct iovec         iov[7];
+   uint32_t             trailer;
+   int                  iovcnt;
+   int                  bulk;
+
+   memset(&rhdr, 0, sizeof(rhdr));
+   rhdr.mode = req->mode;
+   rhdr.flags = req->flags;
+   rhdr.size = req->size;
+   rhdr.offset = req->offset;
+   rhdr.url_len = strlen(req->url) + 1;
+   rhdr.uri_len = strlen(req->uri) + 1;
+   rhdr.npath_len = (req->npath)? strlen(req->npath) + 1: 0;
+   rhdr.opts = req->opts;
+   rhdr.fh = req->fh;
+
+   hdr.magic = SAMFS_MAGIC;
+   hdr.msg = req->msg;
+   hdr.id = req->id;
+   hdr.flags = req->zip;
+   hdr.len = sizeof(rhdr) + rhdr.url_len + rhdr.uri_len + rhdr.npath_len;
+   hdr.csum = 0;
+
+   /* bulk data is not part of frame, it follows it with its own checksum */
+   bulk = (req->opts & REQ_BULK)? TRUE: FALSE;
+   if(!bulk) {
+      hdr.len += req->data_len;
+   }
+
+   iov[0].iov_base = &hdr;
+   iov[0].iov_len = sizeof(hdr);
+   iov[1].iov_base = &rhdr;
+   iov[1].iov_len = sizeof(rhdr);
+   iov[2].iov_base = req->url;
+   iov[2].iov_len = rhdr.url_len;
+   iov[3].iov_base = req->uri;
+   iov[3].iov_len = rhdr.uri_len;
+   iov[4].iov_base = req->npath;
+   iov[4].iov_len = rhdr.npath_len;
+   iov[5].iov_base = req->data;
+   iov[5].iov_len = req->data_len;
+   if(bulk) {
+      hdr.csum = samfs_csum_iov(iov, 5);
+      trailer = samfs_csum(SAMFS_CSUM_INIT, req->data, req->data_len);
+      iov[6].iov_base = &trailer;
+      iov[6].iov_len = sizeof(trailer);
+      iovcnt = 7;
+   }
+   else {
+      hdr.csum = samfs_csum_iov(iov, 6);
+      iovcnt = 6;
+   }
+
+   /* whole frame goes out in one syscall, no need to wait for any ack */
+   rv = samfs_writev_full(sock_fd, iov, iovcnt);
+   if(rv <= 0) {
+      return -1;
+   }
+   return rv;
+}
+
+/* read rest of response frame whose header 'hdr' has been read,
+   its data is placed at rsp->data which has room for rsp->data_cap bytes.
+   compressed data never takes more room than it unpacks to, it is received
+   aside and unpacked into place.
+ */
+static int read_rsp_body(int sock_fd, struct frame_hdr_t *phdr, struct rsp_t *rsp)
+{
+   struct frame_hdr_t   hdr;
+   struct rsp_hdr_t     rhdr;
+   struct iovec         iov[3];
+   uint32_t             csum;
+   size_t               data_len;
+   char                 *data;
+   int                  rv;
+
+   hdr = *phdr;
+   if(hdr.magic != SAMFS_MAGIC || hdr.len < sizeof(rhdr) || hdr.len - sizeof(rhdr) > rsp->data_cap) {
+      printf("ERROR IN READ: INVALID FRAME HEADER!\n");
+      return -1;
+   }
+   data_len = hdr.len - sizeof(rhdr);
+
+   data = rsp->data;
+   if(hdr.flags & FRAME_ZIP) {
+      data = malloc(data_len? data_len: 1);
+      if(NULL == data) {
+         return -1;
+      }
+   }
+
+   rv = -1;
+   if(samfs_read_full(sock_fd, &rhdr, sizeof(rhdr)) <= 0) {
+      goto out;
+   }
+   if(data_len && samfs_read_full(sock_fd, data, data_len) <= 0) {
+      goto out;
+   }
+
+   csum = hdr.csum;
+   hdr.csum = 0;
+   iov[0].iov_base = &hdr;
+   iov[0].iov_len = sizeof(hdr);
+   iov[1].iov_base = &rhdr;
+   iov[1].iov_len = sizeof(rhdr);
+   iov[2].iov_base = data;
+   iov[2].iov_len = data_len;
+   /* raw file data ('-raw_reads') is protected by tcp checksum only */
+   if(csum != samfs_csum_iov(iov, (hdr.flags & FRAME_RAW)? 2: 3)) {
+      printf("ERROR IN READ: CHECKSUM MISMATCH!\n");
+      goto out;
+   }
+
+   if(hdr.flags & FRAME_ZIP) {
+      rv = samfs_unzip(hdr.flags & FRAME_ZIP, data, data_len, rsp->data, rsp->data_cap);
+      if(rv < 0) {
+         printf("ERROR IN READ: BAD COMPRESSED DATA!\n");
+         goto out;
+      }
+      data_len = rv;
+   }
+   rv = 0;
+
+out:
+   if(data != rsp->data) {
+      free(data);
+   }
+   if(rv < 0) {
+      return -1;
+   }
+
+   rsp->status = rhdr.status;
+   rsp->errcode = rhdr.errcode;
+   rsp->size = rhdr.size;
+   rsp->endofdata = (hdr.flags & FRAME_EOD)? TRUE: FALSE;
+   rsp->data_len = data_len;
+
+   return sizeof(hdr) + hdr.len;
+}
+
+/* read one response frame, used before connection has its receiver */
+static int read_rsp(int sock_fd, struct rsp_t *rsp)
+{
+   struct frame_hdr_t   hdr;
+
+   if(samfs_read_full(sock_fd, &hdr, sizeof(hdr)) <= 0) {
+      return -1;
+   }
+
+   return read_rsp_body(sock_fd, &hdr, rsp);
+}
+
+/* first exchange on every new connection, agrees on protocol version and frame payload size */
+static int say_hello(int sock_fd)
+{
+   struct req_t   req;
+   struct rsp_t   rsp;
+   struct hello_t hello;
+
+   hello.version = SAMFS_VERSION;
+   hello.max_payload = SAMFS_MAX_PAYLOAD;
+   hello.features = SAMFS_FEAT_BULK_WRITE | SAMFS_FEAT_READDIRPLUS | zip_want;
+
+   create_req_pkt(&req, HELLO, "", 0, 0, NULL, 0, 0);
+   req.data = (char *) &hello;
+   req.data_len = sizeof(hello);
+
+   memset(&rsp, 0, sizeof(rsp));
+   rsp.data = (char *) &hello;
+   rsp.data_cap = sizeof(hello);
+
+   if(send_req(sock_fd, &req) < 0) {
+      errno = ECONNRESET;
+      return -1;
+   }
+   hello.features = 0; /* older servers answer without features */
+   if(read_rsp(sock_fd, &rsp) < 0) {
+      errno = ECONNRESET;
+      return -1;
+   }
+   if(SUCCESS != rsp.status) {
+      errno = rsp.errcode;
+      return -1;
+   }
+   if(rsp.data_len < offsetof(struct hello_t, features) || hello.max_payload < SAMFS_MIN_PAYLOAD) {
+      errno = EPROTO;
+      return -1;
+   }
+
+   server_max_payload = (hello.max_payload < SAMFS_MAX_PAYLOAD)? hello.max_payload: SAMFS_MAX_PAYLOAD;
+   server_features = hello.features;
+   if(server_features & SAMFS_FEAT_LZ4) {
+      zip_codec = FRAME_LZ4;
+      zip_req = REQ_LZ4;
+   }
+   else if(server_features & SAMFS_FEAT_ZSTD) {
+      zip_codec = FRAME_ZSTD;
+      zip_req = REQ_ZSTD;
+   }
+
+   return 0;
+}
+
+/* drop a reference to connection, caller holds conn_lock */
+static void put_conn_locked(struct conn_t *conn)
+{
+   if(--conn->refs == 0) {
+      STAT_SUB(masd_stat->conns, 1);
+      close(conn->fd);
+      pthread_cond_destroy(&conn->posted);
+      pthread_mutex_destroy(&conn->tx_lock);
+      free(conn);
+   }
+}
+
+/* mark connection broken and fail its calls, caller holds conn_lock.
+   socket is shut down so that receiver wakes up, it is closed with last reference.
+   call receiver is filling is left to receiver, its caller must not return and
+   free the buffer meanwhile. receiver fails it when it is done.
+ */
+static void kill_conn_locked(struct conn_t *conn)
+{
+   struct call_t *call;
+
+   if(!conn->dead) {
+      conn->dead = TRUE;
+      shutdown(conn->fd, SHUT_RDWR);
+   }
+   for(call = conn->waiting; call; call = call->next) {
+      if(call != conn->receiving && !call->failed) {
+         call->failed = TRUE;
+         pthread_cond_signal(&call->done);
+      }
+   }
+   pthread_cond_broadcast(&conn->posted);
+}
+
+/* reads response frames of connection and hands each to its call */
+static void *conn_receiver(void *data)
+{
+   struct conn_t        *conn;
+   struct call_t        *call;
+   struct frame_hdr_t   hdr;
+   int                  dead;
+   int                  rv;
+
+   conn = data;
+   while(samfs_read_full(conn->fd, &hdr, sizeof(hdr)) > 0) {
+      pthread_mutex_lock(&conn_lock);
+      for(call = conn->waiting; call && call->id != hdr.id; call = call->next);
+      /* caller is still busy with previous frame of its response */
+      while(call && !call->posted && !conn->dead) {
+         pthread_cond_wait(&conn->posted, &conn_lock);
+      }
+      if(NULL == call || conn->dead) {
+         pthread_mutex_unlock(&conn_lock);
+         break;   /* response to nobody, stream is out of sync */
+      }
+      conn->receiving = call;
+      pthread_mutex_unlock(&conn_lock);
+
+      rv = read_rsp_body(conn->fd, &hdr, call->rsp);
+
+      pthread_mutex_lock(&conn_lock);
+      conn->receiving = NULL;
+      if(rv >= 0) {
+         call->posted = FALSE;
+         call->filled = TRUE;
+         pthread_cond_signal(&call->done);
+      }
+      /* connection killed meanwhile, call is failed below along with the rest */
+      dead = (rv < 0 || conn->dead);
+      pthread_mutex_unlock(&conn_lock);
+      if(dead) {
+         break;
+      }
+   }
+
+   pthread_mutex_lock(&conn_lock);
+   kill_conn_locked(conn);
+   put_conn_locked(conn);
+   pthread_mutex_unlock(&conn_lock);
+
+   return NULL;
+}
+
+/* opens a connection and starts its receiver */
+static struct conn_t *open_conn()
+{
+   struct conn_t  *conn;
+   pthread_t      thread;
+   int            err;
+
+   conn = calloc(1, sizeof(struct conn_t));
+   if(NULL == conn) {
+      errno = ENOMEM;
+      return NULL;
+   }
+   conn->fd = connect_to_server();
+   if(conn->fd < 0) {
+      free(conn);
+      return NULL;
+   }
+   conn->refs = 2;   /* slot and receiver */
+   pthread_cond_init(&conn->posted, NULL);
+   pthread_mutex_init(&conn->tx_lock, NULL);
+
+   err = pthread_create(&thread, NULL, conn_receiver, conn);
+   if(err) {
+      close(conn->fd);
+      pthread_cond_destroy(&conn->posted);
+      pthread_mutex_destroy(&conn->tx_lock);
+      free(conn);
+      errno = err;
+      return NULL;
+   }
+   pthread_detach(thread);
+   STAT_ADD(masd_stat->conns, 1);
+
+   return conn;
+}
+
+/* get a connection for a new call, with a reference for it.
+   the least busy connection is taken, a new one is opened while all are busy
+   and there is room for more.
+ */
+static struct conn_t *get_conn()
+{
+   struct conn_t  *conn;
+   struct conn_t  *fresh;
+   int            failed;
+   int            slot;
+   int            i;
+
+   fresh = NULL;
+   failed = FALSE;
+   pthread_mutex_lock(&conn_lock);
+   while(1) {
+      slot = -1;
+      conn = NULL;
+      for(i = 0; i < conn_pool_size; i++) {
+         if(NULL == conns[i] || conns[i]->dead) {
+            slot = (slot < 0)? i: slot;
+         }
+         else if(NULL == conn || conns[i]->calls < conn->calls) {
+            conn = conns[i];
+         }
+      }
+      if(fresh && slot >= 0) {
+         if(conns[slot]) {
+            put_conn_locked(conns[slot]);
+         }
+         conns[slot] = fresh;
+         conn = fresh;
+         fresh = NULL;
+         break;
+      }
+      if(conn && (0 == conn->calls || slot < 0 || failed)) {
+         break;
+      }
+      if(failed) {
+         pthread_mutex_unlock(&conn_lock);
+         return NULL;
+      }
+
+      /* connect without holding lock, others may fill the slot meanwhile */
+      pthread_mutex_unlock(&conn_lock);
+      fresh = open_conn();
+      pthread_mutex_lock(&conn_lock);
+      failed = (NULL == fresh)? TRUE: FALSE;
+   }
+   if(fresh) {
+      /* lost the race for last slot */
+      kill_conn_locked(fresh);
+      put_conn_locked(fresh);
+   }
+   conn->refs++;
+   conn->calls++;
+   pthread_mutex_unlock(&conn_lock);
+
+   return conn;
+}
+
+/* get connection of 'slot' for a new call, with a reference for it.
+   stripes of one transfer take different slots so that they move side by side.
+ */
+static struct conn_t *get_conn_slot(int slot)
+{
+   struct conn_t  *conn;
+   struct conn_t  *fresh;
+
+   pthread_mutex_lock(&conn_lock);
+   conn = conns[slot];
+   if(NULL == conn || conn->dead) {
+      /* connect without holding lock, others may fill the slot meanwhile */
+      pthread_mutex_unlock(&conn_lock);
+      fresh = open_conn();
+      if(NULL == fresh) {
+         return NULL;
+      }
+      pthread_mutex_lock(&conn_lock);
+      conn = conns[slot];
+      if(conn && !conn->dead) {
+         kill_conn_locked(fresh);
+         put_conn_locked(fresh);
+      }
+      else {
+         if(conn) {
+            put_conn_locked(conn);
+         }
+         conns[slot] = fresh;
+         conn = fresh;
+      }
+   }
+   conn->refs++;
+   conn->calls++;
+   pthread_mutex_unlock(&conn_lock);
+
+   return conn;
+}
+
+/* sends request 'req' on connection of 'slot', or on any if 'slot' is -1.
+   frames of its response will be placed in 'rsp'.
+   returns -errno if request could not be sent, otherwise call must be ended by call_end().
+ */
+static int call_start_on(struct call_t *call, int slot, struct req_t *req, struct rsp_t *rsp)
+{
+   struct conn_t  *conn;
+   int            rv;
+
+   conn = (slot < 0)? get_conn(): get_conn_slot(slot);
+   if(NULL == conn) {
+      rv = errno;
+      STAT_ADD(stat_slot()->call_fails, 1);
+      return -rv;
+   }
+
+   memset(call, 0, sizeof(struct call_t));
+   pthread_cond_init(&call->done, NULL);
+   call->conn = conn;
+   call->rsp = rsp;
+   call->posted = TRUE;
+   call->msg = (req->msg > UNKNOWN && req->msg < STAT_MSGS)? req->msg: UNKNOWN;
+   call->start_ns = samfs_now_ns();
+
+   pthread_mutex_lock(&conn_lock);
+   call->id = ++conn->next_id;
+   call->failed = conn->dead;
+   call->next = conn->waiting;
+   conn->waiting = call;
+   pthread_mutex_unlock(&conn_lock);
+
+   req->id = call->id;
+   pthread_mutex_lock(&conn->tx_lock);
+   rv = send_req(conn->fd, req);
+   pthread_mutex_unlock(&conn->tx_lock);
+
+   if(rv < 0) {
+      pthread_mutex_lock(&conn_lock);
+      kill_conn_locked(conn);
+      pthread_mutex_unlock(&conn_lock);
+   }
+
+   return 0;
+}
+
+/* sends request 'req' on least busy connection, see call_start_on() */
+static int call_start(struct call_t *call, struct req_t *req, struct rsp_t *rsp)
+{
+   return call_start_on(call, -1, req, rsp);
+}
+
+/* waits for next response frame of call, which is placed in 'rsp'.
+   'rsp' can point to a new buffer before each frame but the first.
+   returns -1 if connection broke.
+ */
+static int call_wait(struct call_t *call, struct rsp_t *rsp)
+{
+   int rv;
+
+   pthread_mutex_lock(&conn_lock);
+   if(!call->posted && !call->filled) {
+      call->rsp = rsp;
+      call->posted = TRUE;
+      pthread_cond_broadcast(&call->conn->posted);
+   }
+   while(!call->filled && !call->failed) {
+      pthread_cond_wait(&call->done, &conn_lock);
+   }
+   rv = (call->filled)? 0: -1;
+   call->filled = FALSE;
+   pthread_mutex_unlock(&conn_lock);
+
+   return rv;
+}
+
+/* forgets call, once its last frame has come or it failed */
+static void call_end(struct call_t *call)
+{
+   struct call_t        **pcall;
+   struct conn_t        *conn;
+   struct stat_slot_t   *slot;
+
+   slot = stat_slot();
+   if(call->failed) {
+      STAT_ADD(slot->call_fails, 1);
+   }
+   else {
+      STAT_ADD(slot->calls[call->msg], 1);
+      stat_lat(slot->call_lat[call->msg], samfs_now_ns() - call->start_ns);
+   }
+
+   conn = call->conn;
+   pthread_mutex_lock(&conn_lock);
+   for(pcall = &conn->waiting; *pcall; pcall = &(*pcall)->next) {
+      if(*pcall == call) {
+         *pcall = call->next;
+         break;
+      }
+   }
+   conn->calls--;
+   put_conn_locked(conn);
+   pthread_mutex_unlock(&conn_lock);
+   pthread_cond_destroy(&call->done);
+}
+
+/* takes round trip of a request into account */
+static void rtt_note(double secs)
+{
+   pthread_mutex_lock(&stripe_lock);
+   rtt_avg = (rtt_avg > 0)? rtt_avg * 0.875 + secs * 0.125: secs;
+   pthread_mutex_unlock(&stripe_lock);
+}
+
+/* send a request on connection of 'slot' (-1 for any) and wait for its single response frame */
+static int do_request_on(struct req_t *req, struct rsp_t *rsp, int slot)
+{
+   struct call_t  call;
+   double         start;
+   int            rv;
+
+   start = now_sec();
+   rv = call_start_on(&call, slot, req, rsp);
+   if(rv < 0) {
+      return rv;
+   }
+   rv = call_wait(&call, rsp);
+   call_end(&call);
+   if(0 == rv && req->data_len + rsp->data_cap <= RTT_MAX_DATA) {
+      rtt_note(now_sec() - start);
+   }
+
+   return (rv < 0)? -EIO: 0;
+}
+
+/* send a request and wait for its single response frame */
+static int do_request(struct req_t *req, struct rsp_t *rsp)
+{
+   return do_request_on(req, rsp, -1);
+}
+
+/* number of stripes a transfer of 'sz' bytes is split in */
+static int stripe_count(size_t sz)
+{
+   double min;
+   int    n;
+
+   if(stripe_max < 2 || sz < 2 * STRIPE_MIN) {
+      return 1;
+   }
+
+   /* a stripe smaller than window of one stream takes a round trip all the same */
+   pthread_mutex_lock(&stripe_lock);
+   min = stream_rate * rtt_avg;
+   if(min < STRIPE_MIN) {
+      min = STRIPE_MIN;
+   }
+   n = sz / min;
+   if(n > stripe_width) {
+      n = stripe_width;
+   }
+   pthread_mutex_unlock(&stripe_lock);
+
+   return (n > 1)? n: 1;
+}
+
+/* size of each of 'n' stripes of 'sz' bytes, whole pages but the last.
+   'n' is lowered if fewer stripes cover 'sz'. returns first slot to use.
+ */
+static int stripe_split(size_t sz, int *n, size_t *len)
+{
+   int slot;
+
+   *len = ((sz + *n - 1) / *n + 4095) & ~(size_t) 4095;
+   *n = (sz + *len - 1) / *len;
+
+   /* concurrent transfers start on different connections */
+   pthread_mutex_lock(&stripe_lock);
+   slot = stripe_slot;
+   stripe_slot = (stripe_slot + *n) % conn_pool_size;
+   pthread_mutex_unlock(&stripe_lock);
+
+   return slot;
+}
+
+/* takes a large transfer of 'sz' bytes which took 'secs' in 'n' stripes into account.
+   after STRIPE_PROBE of them throughput is compared with the previous probe, number of
+   stripes keeps moving the same way while it got better, and turns around otherwise.
+ */
+static void stripe_note(size_t sz, double secs, int n)
+{
+   double rate;
+
+   if(stripe_max < 2 || sz < 2 * STRIPE_MIN || secs <= 0) {
+      return;
+   }
+
+   pthread_mutex_lock(&stripe_lock);
+   rate = sz / n / secs;
+   stream_rate = (stream_rate > 0)? stream_rate * 0.875 + rate * 0.125: rate;
+   probe_bytes += sz;
+   probe_time += secs;
+   if(++probe_count >= STRIPE_PROBE) {
+      rate = probe_bytes / probe_time;
+      if(rate < stripe_rate * 1.05) {
+         stripe_step = -stripe_step;
+      }
+      stripe_width += stripe_step;
+      if(stripe_width < 1 || stripe_width > stripe_max) {
+         stripe_step = -stripe_step;
+         stripe_width += 2 * stripe_step;
+      }
+      stripe_rate = rate;
+      probe_bytes = 0;
+      probe_time = 0;
+      probe_count = 0;
+   }
+   pthread_mutex_unlock(&stripe_lock);
+}
+
+/* server handle of file opened through fuse, 0 if there is none */
+static uint64_t server_fh(struct fuse_file_info *finfo)
+{
+   return (OPEN_FILE(finfo))? OPEN_FILE(finfo)->fh: 0;
+}
+
+/* reads up to 'sz' bytes at 'of' from server into 'buf' in 'n' stripes, all requested at once.
+   returns number of bytes read up to first short stripe or -errno.
+ */
+static int read_stripes (const char *path, uint64_t fh, char *buf, size_t sz, off_t of, int n)
+{
+   struct call_t calls[STRIPE_LIMIT];
+   struct rsp_t rsps[STRIPE_LIMIT];
+   struct req_t req;
+   size_t len;
+   size_t part;
+   size_t got;
+   size_t total;
+   int started;
+   int whole;
+   int slot;
+   int err;
+   int rv;
+   int i;
+
+   slot = -1;
+   len = sz;
+   if(n > 1) {
+      slot = stripe_split(sz, &n, &len);
+   }
+
+   rv = 0;
+   for(started = 0; started < n; started++) {
+      i = started;
+      part = (len < sz - i * len)? len: sz - i * len;
+      create_req_pkt(&req, READ, path, 0, 0, NULL, part, of + i * len);
+      /* '-raw_reads' lets server stream file data with sendfile(), its checksum covers headers only */
+      req.opts = ((raw_reads)? REQ_RAW_DATA: 0) | zip_req;
+      req.fh = fh;
+
+      /* server sends data in one or more frames, each is received straight into buffer */
+      memset(&rsps[i], 0, sizeof(struct rsp_t));
+      rsps[i].data = buf + i * len;
+      rsps[i].data_cap = part;
+      rv = call_start_on(&calls[i], (slot < 0)? -1: (slot + i) % conn_pool_size, &req, &rsps[i]);
+      if(rv < 0) {
+         break;
+      }
+   }
+   if(0 == started) {
+      return rv;
+   }
+
+   /* data counts up to first stripe that failed or ended short.
+      stripes are collected in order, as each may need its next frame posted.
+    */
+   total = 0;
+   err = 0;
+   whole = TRUE;
+   for(i = 0; i < started; i++) {
+      part = (len < sz - i * len)? len: sz - i * len;
+      got = 0;
+      rv = 0;
+      do {
+         if(call_wait(&calls[i], &rsps[i]) < 0) {
+            rv = -EIO;
+            break;
+         }
+         if(SUCCESS == rsps[i].status) {
+            got += rsps[i].data_len;
+            rv = 0;
+         }
+         else {
+            errno = rsps[i].errcode;
+            rv = -errno;
+         }
+         rsps[i].data = buf + i * len + got;
+         rsps[i].data_cap = part - got;
+      } while(!rsps[i].endofdata);
+      call_end(&calls[i]);
+
+      if(whole) {
+         if(rv < 0) {
+            err = (0 == i)? rv: 0;
+            whole = FALSE;
+         }
+         else {
+            total += got;
+            whole = (got == part);
+         }
+      }
+   }
+
+   return (err < 0)? err: (int) total;
+}
+
+/* reads up to 'sz' bytes at 'of' from server into 'buf', 'fh' is server handle or 0.
+   returns number of bytes read or -errno.
+ */
+static int read_server (const char *path, uint64_t fh, char *buf, size_t sz, off_t of)
+{
+   double start;
+   int n;
+   int rv;
+
+   n = stripe_count(sz);
+   start = now_sec();
+   rv = read_stripes(path, fh, buf, sz, of, n);
+   if(rv > 0) {
+      stripe_note(rv, now_sec() - start, n);
+   }
+
+   return rv;
+}
+
+static unsigned int block_hash(struct cfile_t *file, off_t index)
+{
+   return (((uintptr_t) file / sizeof(void *)) ^ ((uint64_t) index * 2654435761u)) % BLOCK_BUCKETS;
+}
+
+/* cached file of 'path', created if 'add' is TRUE. caller holds block_lock */
+static struct cfile_t *cfile_find(const char *path, int add)
+{
+   struct cfile_t *file;
+   unsigned int   h;
+
+   h = attr_hash(path);
+   for(file = cfiles[h]; file; file = file->next) {
+      if(strcmp(file->path, path) == 0) {
+         return file;
+      }
+   }
+   if(!add) {
+      return NULL;
+   }
+
+   file = malloc(sizeof(struct cfile_t) + strlen(path) + 1);
+   if(NULL == file) {
+      return NULL;
+   }
+   strcpy(file->path, path);
+   file->blocks = NULL;
+   file->next = cfiles[h];
+   cfiles[h] = file;
+
+   return file;
+}
+
+/* caller holds block_lock */
+static struct block_t *block_find(struct cfile_t *file, off_t index)
+{
+   struct block_t *blk;
+
+   for(blk = blocks[block_hash(file, index)]; blk; blk = blk->hnext) {
+      if(blk->file == file && blk->index == index) {
+         return blk;
+      }
+   }
+
+   return NULL;
+}
+
+static void block_lru_unlink(struct block_t *blk)
+{
+   if(blk->prev) {
+      blk->prev->next = blk->next;
+   }
+   else {
+      block_lru_head = blk->next;
+   }
+   if(blk->next) {
+      blk->next->prev = blk->prev;
+   }
+   else {
+      block_lru_tail = blk->prev;
+   }
+}
+
+static void block_lru_push(struct block_t *blk)
+{
+   blk->prev = NULL;
+   blk->next = block_lru_head;
+   if(block_lru_head) {
+      block_lru_head->prev = blk;
+   }
+   block_lru_head = blk;
+   if(NULL == block_lru_tail) {
+      block_lru_tail = blk;
+   }
+}
+
+/* removes 'blk' from cache, its file goes too once it has no blocks.
+   block is freed now or by its last holder. caller holds block_lock.
+ */
+static void block_drop(struct block_t *blk)
+{
+   struct block_t **pblk;
+   struct cfile_t **pfile;
+   struct cfile_t *file;
+
+   file = blk->file;
+   for(pblk = &blocks[block_hash(file, blk->index)]; *pblk != blk; pblk = &(*pblk)->hnext) {
+   }
+   *pblk = blk->hnext;
+   block_lru_unlink(blk);
+   if(blk->fprev) {
+      blk->fprev->fnext = blk->fnext;
+   }
+   else {
+      file->blocks = blk->fnext;
+   }
+   if(blk->fnext) {
+      blk->fnext->fprev = blk->fprev;
+   }
+   blk->file = NULL;
+   block_count--;
+
+   if(NULL == file->blocks) {
+      for(pfile = &cfiles[attr_hash(file->path)]; *pfile != file; pfile = &(*pfile)->next) {
+      }
+      *pfile = file->next;
+      free(file);
+   }
+   if(0 == blk->refs) {
+      free(blk);
+   }
+}
+
+/* drops all blocks of 'file' and so file itself. caller holds block_lock */
+static void cfile_drop(struct cfile_t *file)
+{
+   while(file->blocks->fnext) {
+      block_drop(file->blocks->fnext);
+   }
+   block_drop(file->blocks);
+}
+
+/* caller holds block_lock */
+static void block_put_locked(struct block_t *blk)
+{
+   blk->refs--;
+   if(0 == blk->refs && NULL == blk->file) {
+      free(blk);
+   }
+}
+
+static void block_put(struct block_t *blk)
+{
+   pthread_mutex_lock(&block_lock);
+   block_put_locked(blk);
+   pthread_mutex_unlock(&block_lock);
+}
+
+/* adds block 'index' of 'path' in BLOCK_LOADING state with one reference taken,
+   tagged with attributes of 'f'. least recently used idle blocks are evicted to
+   stay in budget, returns NULL if all blocks are in use. caller holds block_lock.
+ */
+static struct block_t *block_add(const char *path, off_t index, struct open_file_t *f)
+{
+   struct cfile_t *file;
+   struct block_t *blk;
+   unsigned int   h;
+
+   while(block_count >= block_max) {
+      for(blk = block_lru_tail; blk && blk->refs; blk = blk->prev) {
+      }
+      if(NULL == blk) {
+         return NULL;
+      }
+      block_drop(blk);
+   }
+
+   blk = malloc(sizeof(struct block_t) + BLOCK_SIZE);
+   if(NULL == blk) {
+      return NULL;
+   }
+   file = cfile_find(path, TRUE);
+   if(NULL == file) {
+      free(blk);
+      return NULL;
+   }
+
+   blk->file = file;
+   blk->index = index;
+   blk->state = BLOCK_LOADING;
+   blk->err = 0;
+   blk->refs = 1;
+   blk->len = 0;
+   blk->mtime = f->mtime;
+   blk->size = f->size;
+
+   h = block_hash(file, index);
+   blk->hnext = blocks[h];
+   blocks[h] = blk;
+   blk->fprev = NULL;
+   blk->fnext = file->blocks;
+   if(file->blocks) {
+      file->blocks->fprev = blk;
+   }
+   file->blocks = blk;
+   block_lru_push(blk);
+   block_count++;
+
+   return blk;
+}
+
+/* reads data of 'blk' from server and wakes up readers waiting for it */
+static void block_load(const char *path, uint64_t fh, struct block_t *blk)
+{
+   int rv;
+
+   rv = read_server(path, fh, blk->data, BLOCK_SIZE, blk->index * BLOCK_SIZE);
+
+   pthread_mutex_lock(&block_lock);
+   if(rv >= 0) {
+      blk->state = BLOCK_READY;
+      blk->len = rv;
+   }
+   else {
+      /* nobody else may find it, next reader asks server again */
+      blk->state = BLOCK_FAILED;
+      blk->err = -rv;
+      if(blk->file) {
+         block_drop(blk);
+      }
+   }
+   pthread_cond_broadcast(&block_loaded);
+   pthread_mutex_unlock(&block_lock);
+}
+
+/* returns block 'index' of 'path' with its data, read from server if it is not cached.
+   '*pblk' is set to NULL if cache is full of blocks in use. release with block_put().
+ */
+static int block_get(const char *path, struct open_file_t *f, off_t index, struct block_t **pblk)
+{
+   struct cfile_t *file;
+   struct block_t *blk;
+   int            err;
+
+   *pblk = NULL;
+   pthread_mutex_lock(&block_lock);
+   file = cfile_find(path, FALSE);
+   blk = (file)? block_find(file, index): NULL;
+   if(blk && BLOCK_READY == blk->state &&
+         (blk->size != f->size || blk->mtime.tv_sec != f->mtime.tv_sec || blk->mtime.tv_nsec != f->mtime.tv_nsec)) {
+      /* file has changed since block was read */
+      block_drop(blk);
+      blk = NULL;
+   }
+   if(blk) {
+      STAT_ADD(stat_slot()->block_hits, 1);
+      blk->refs++;
+      block_lru_unlink(blk);
+      block_lru_push(blk);
+   }
+   else {
+      STAT_ADD(stat_slot()->block_misses, 1);
+      blk = block_add(path, index, f);
+      if(NULL == blk) {
+         pthread_mutex_unlock(&block_lock);
+         return 0;
+      }
+      pthread_mutex_unlock(&block_lock);
+      block_load(path, f->fh, blk);
+      pthread_mutex_lock(&block_lock);
+   }
+
+   while(BLOCK_LOADING == blk->state) {
+      pthread_cond_wait(&block_loaded, &block_lock);
+   }
+   if(BLOCK_FAILED == blk->state) {
+      err = blk->err;
+      block_put_locked(blk);
+      pthread_mutex_unlock(&block_lock);
+      return -err;
+   }
+   pthread_mutex_unlock(&block_lock);
+   *pblk = blk;
+
+   return 0;
+}
+
+static void *ra_worker(void *arg)
+{
+   struct ra_item_t *item;
+   int              load;
+
+   for(;;) {
+      pthread_mutex_lock(&block_lock);
+      while(NULL == ra_head) {
+         pthread_cond_wait(&ra_ready, &block_lock);
+      }
+      item = ra_head;
+      ra_head = item->next;
+      if(NULL == ra_head) {
+         ra_tail = NULL;
+      }
+      ra_count--;
+      /* no need to read a block dropped meanwhile, unless a reader waits for it */
+      load = (item->blk->file || item->blk->refs > 1);
+      pthread_mutex_unlock(&block_lock);
+
+      if(load) {
+         STAT_ADD(stat_slot()->ra_blocks, 1);
+         block_load(item->path, item->fh, item->blk);
+      }
+      block_put(item->blk);
+      free(item);
+   }
+
+   return NULL;
+}
+
+static void start_ra_workers(void)
+{
+   pthread_t      thread;
+   pthread_attr_t attr;
+   int            i;
+
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+   for(i = 0; i < RA_THREADS; i++) {
+      pthread_create(&thread, &attr, ra_worker, NULL);
+   }
+   pthread_attr_destroy(&attr);
+}
+
+/* queues blocks 'first' to 'last' of 'path' which are not cached yet for readahead workers */
+static void read_ahead(const char *path, struct open_file_t *f, off_t first, off_t last)
+{
+   struct cfile_t    *file;
+   struct ra_item_t  *item;
+   off_t             index;
+
+   pthread_once(&ra_once, start_ra_workers);
+
+   pthread_mutex_lock(&block_lock);
+   for(index = first; index <= last && ra_count < RA_QUEUE_MAX; index++) {
+      file = cfile_find(path, FALSE);
+      if(file && block_find(file, index)) {
+         continue;
+      }
+      item = malloc(sizeof(struct ra_item_t) + strlen(path) + 1);
+      if(NULL == item) {
+         break;
+      }
+      item->blk = block_add(path, index, f);
+      if(NULL == item->blk) {
+         free(item);
+         break;
+      }
+      strcpy(item->path, path);
+      item->fh = f->fh;
+      item->next = NULL;
+      if(ra_tail) {
+         ra_tail->next = item;
+      }
+      else {
+         ra_head = item;
+      }
+      ra_tail = item;
+      ra_count++;
+      pthread_cond_signal(&ra_ready);
+   }
+   pthread_mutex_unlock(&block_lock);
+}
+
+/* drops cached blocks of 'path', and of everything below it if 'tree' is TRUE */
+static void block_cache_forget(const char *path, int tree)
+{
+   struct cfile_t *file;
+   struct cfile_t *next;
+   size_t         len;
+   int            i;
+
+   pthread_mutex_lock(&block_lock);
+   if(tree) {
+      len = strlen(path);
+      for(i = 0; i < ATTR_CACHE_BUCKETS; i++) {
+         for(file = cfiles[i]; file; file = next) {
+            next = file->next;
+            if(strncmp(file->path, path, len) == 0 && (file->path[len] == '\0' || file->path[len] == '/')) {
+               cfile_drop(file);
+            }
+         }
+      }
+   }
+   else {
+      file = cfile_find(path, FALSE);
+      if(file) {
+         cfile_drop(file);
+      }
+   }
+   pthread_mutex_unlock(&block_lock);
+}
+
+/* 'sz' bytes at 'of' of 'path' were written. blocks covering them go, and so do
+   blocks ending at old end of file, which would now end reads too early.
+ */
+static void block_cache_forget_range(const char *path, size_t sz, off_t of)
+{
+   struct cfile_t *file;
+   struct block_t *blk;
+   struct block_t *next;
+
+   pthread_mutex_lock(&block_lock);
+   file = cfile_find(path, FALSE);
+   for(blk = (file)? file->blocks: NULL; blk; blk = next) {
+      next = blk->fnext;
+      if((blk->index + 1) * BLOCK_SIZE > of && blk->index * BLOCK_SIZE < of + (off_t) sz) {
+         block_drop(blk);
+      }
+      else if(BLOCK_LOADING == blk->state || blk->len < BLOCK_SIZE) {
+         block_drop(blk);
+      }
+   }
+   pthread_mutex_unlock(&block_lock);
+}
+
+/* file of 'path' having dirty data, NULL if there is none. caller holds wb_lock */
+static struct wfile_t *wb_find(const char *path)
+{
+   struct wfile_t *wf;
+
+   for(wf = wfiles[attr_hash(path) % WB_BUCKETS]; wf; wf = wf->next) {
+      if(strcmp(wf->path, path) == 0) {
+         break;
+      }
+   }
+
+   return wf;
+}
+
+/* file of 'path' with a reference taken, created if 'add' is TRUE */
+static struct wfile_t *wb_get(const char *path, int add)
+{
+   struct wfile_t *wf;
+   unsigned int   h;
+
+   pthread_mutex_lock(&wb_lock);
+   wf = wb_find(path);
+   if(NULL == wf && add) {
+      wf = calloc(1, sizeof(struct wfile_t) + strlen(path) + 1);
+      if(wf) {
+         strcpy(wf->path, path);
+         pthread_rwlock_init(&wf->sent_lock, NULL);
+         h = attr_hash(path) % WB_BUCKETS;
+         wf->next = wfiles[h];
+         wfiles[h] = wf;
+      }
+   }
+   if(wf) {
+      wf->refs++;
+   }
+   pthread_mutex_unlock(&wb_lock);
+
+   return wf;
+}
+
+/* file is freed once it is clean, unused and has no error to report. caller holds wb_lock */
+static void wb_put_locked(struct wfile_t *wf)
+{
+   struct wfile_t **pwf;
+
+   wf->refs--;
+   if(wf->refs || wf->ranges || wf->busy || wf->err) {
+      return;
+   }
+   for(pwf = &wfiles[attr_hash(wf->path) % WB_BUCKETS]; *pwf != wf; pwf = &(*pwf)->next) {
+   }
+   *pwf = wf->next;
+   pthread_rwlock_destroy(&wf->sent_lock);
+   free(wf);
+}
+
+static void wb_put(struct wfile_t *wf)
+{
+   pthread_mutex_lock(&wb_lock);
+   wb_put_locked(wf);
+   pthread_mutex_unlock(&wb_lock);
+}
+
+/* adds write of 'sz' bytes at 'of' to dirty ranges of 'wf', merging it with ranges
+   it overlaps or touches. returns -ENOMEM if it can not be kept. caller holds wb_lock.
+ */
+static int wb_add(struct wfile_t *wf, const char *buf, size_t sz, off_t of)
+{
+   struct dirty_t **pr;
+   struct dirty_t *r;
+   struct dirty_t *n;
+   off_t          start;
+   off_t          end;
+   size_t         cap;
+   size_t         old_len;
+   char           *data;
+
+   /* first range not ending before new data, only one new data can join at its start */
+   for(pr = &wf->ranges; *pr && (*pr)->of + (off_t) (*pr)->len < of; pr = &(*pr)->next) {
+   }
+   r = *pr;
+   if(NULL == r || r->of > of + (off_t) sz) {
+      r = malloc(sizeof(struct dirty_t));
+      data = malloc(sz);
+      if(NULL == r || NULL == data) {
+         free(r);
+         free(data);
+         return -ENOMEM;
+      }
+      memcpy(data, buf, sz);
+      r->of = of;
+      r->len = r->cap = sz;
+      r->data = data;
+      r->next = *pr;
+      *pr = r;
+      wf->dirty += sz;
+      wb_dirty += sz;
+      return 0;
+   }
+
+   start = (r->of < of)? r->of: of;
+   end = of + sz;
+   for(n = r; n && n->of <= of + (off_t) sz; n = n->next) {
+      if(n->of + (off_t) n->len > end) {
+         end = n->of + n->len;
+      }
+   }
+
+   if(start == r->of && (size_t) (end - start) > r->cap) {
+      /* capacity doubles, so that a stream of appends keeps growing one range cheaply */
+      cap = (r->cap * 2 > (size_t) (end - start))? r->cap * 2: (size_t) (end - start);
+      data = realloc(r->data, cap);
+      if(NULL == data) {
+         return -ENOMEM;
+      }
+      r->data = data;
+      r->cap = cap;
+   }
+   else if(start < r->of) {
+      data = malloc(end - start);
+      if(NULL == data) {
+         return -ENOMEM;
+      }
+      memcpy(data + (r->of - start), r->data, r->len);
+      free(r->data);
+      r->data = data;
+      r->cap = end - start;
+   }
+
+   /* absorb following ranges reached by new data, new data is copied last as it is newest */
+   old_len = r->len;
+   while(r->next && r->next->of <= of + (off_t) sz) {
+      n = r->next;
+      memcpy(r->data + (n->of - start), n->data, n->len);
+      old_len += n->len;
+      r->next = n->next;
+      free(n->data);
+      free(n);
+   }
+   memcpy(r->data + (of - start), buf, sz);
+   r->of = start;
+   r->len = end - start;
+   wf->dirty += r->len - old_len;
+   wb_dirty += r->len - old_len;
+
+   return 0;
+}
+
+/* sends dirty data of 'wf' to server, one write per range. flushes of a file run one
+   at a time, so that data reaches server in the order it was written.
+ */
+static void wb_flush(struct wfile_t *wf)
+{
+   struct dirty_t *list;
+   struct dirty_t *r;
+   uint64_t       fh;
+   size_t         bytes;
+   int            err;
+   int            rv;
+
+   pthread_mutex_lock(&wb_lock);
+   while(wf->busy) {
+      pthread_cond_wait(&wb_flushed, &wb_lock);
+   }
+   list = wf->ranges;
+   if(NULL == list) {
+      pthread_mutex_unlock(&wb_lock);
+      return;
+   }
+   wf->ranges = NULL;
+   wf->flushing = list;
+   wf->busy = TRUE;
+   wf->since = 0;
+   fh = wf->fh;
+   pthread_mutex_unlock(&wb_lock);
+
+   bytes = 0;
+   err = 0;
+   for(r = list; r; r = r->next) {
+      bytes += r->len;
+      if(err) {
+         continue;   /* rest of batch is lost with failed part */
+      }
+      rv = write_server(wf->path, fh, r->data, r->len, r->of);
+      if(rv < 0) {
+         err = -rv;
+      }
+      else if((size_t) rv < r->len) {
+         err = EIO;
+      }
+   }
+
+   /* wait for readers that may have read server before data landed */
+   pthread_rwlock_wrlock(&wf->sent_lock);
+   pthread_mutex_lock(&wb_lock);
+   wf->flushing = NULL;
+   wf->busy = FALSE;
+   wf->dirty -= bytes;
+   wb_dirty -= bytes;
+   if(err && 0 == wf->err) {
+      wf->err = err;
+   }
+   pthread_cond_broadcast(&wb_flushed);
+   pthread_mutex_unlock(&wb_lock);
+   pthread_rwlock_unlock(&wf->sent_lock);
+
+   while(list) {
+      r = list;
+      list = r->next;
+      free(r->data);
+      free(r);
+   }
+}
+
+/* flushes dirty data of 'path', and of everything below it if 'tree' is TRUE.
+   metadata operations call this first, so that pending writes land before them.
+ */
+static void wb_flush_path(const char *path, int tree)
+{
+   struct wfile_t *wf;
+   size_t         len;
+   int            i;
+
+   if(wb_delay <= 0) {
+      return;
+   }
+
+   len = strlen(path);
+   pthread_mutex_lock(&wb_lock);
+   do {
+      if(tree) {
+         for(i = 0, wf = NULL; i < WB_BUCKETS && NULL == wf; i++) {
+            for(wf = wfiles[i]; wf; wf = wf->next) {
+               if((wf->ranges || wf->busy) && strncmp(wf->path, path, len) == 0 &&
+                     (wf->path[len] == '\0' || wf->path[len] == '/')) {
+                  break;
+               }
+            }
+         }
+      }
+      else {
+         wf = wb_find(path);
+         if(wf && NULL == wf->ranges && !wf->busy) {
+            wf = NULL;
+         }
+      }
+      if(wf) {
+         wf->refs++;
+         pthread_mutex_unlock(&wb_lock);
+         wb_flush(wf);
+         pthread_mutex_lock(&wb_lock);
+         wb_put_locked(wf);
+      }
+   } while(wf && tree);
+   pthread_mutex_unlock(&wb_lock);
+}
+
+/* flushes dirty data of 'path' for fsync, flush or release, returns -errno if this or an
+   earlier flush failed. 'fh' is server handle being released, writes stop using it.
+ */
+static int wb_sync(const char *path, uint64_t fh)
+{
+   struct wfile_t *wf;
+   int            err;
+
+   if(wb_delay <= 0) {
+      return 0;
+   }
+   wf = wb_get(path, FALSE);
+   if(NULL == wf) {
+      return 0;
+   }
+
+   wb_flush(wf);
+
+   pthread_mutex_lock(&wb_lock);
+   err = wf->err;
+   wf->err = 0;
+   if(fh && wf->fh == fh) {
+      wf->fh = 0;
+   }
+   wb_put_locked(wf);
+   pthread_mutex_unlock(&wb_lock);
+
+   return -err;
+}
+
+/* flushes files whose dirty data is old or big enough */
+static void *wb_flusher(void *arg)
+{
+   struct wfile_t    *wf;
+   struct timespec   ts;
+   double            wait;
+   int               i;
+
+   wait = (wb_delay / 4 < 1.0)? wb_delay / 4: 1.0;
+   pthread_mutex_lock(&wb_lock);
+   for(;;) {
+      for(i = 0, wf = NULL; i < WB_BUCKETS && NULL == wf; i++) {
+         for(wf = wfiles[i]; wf; wf = wf->next) {
+            if(wf->ranges && !wf->busy && (wf->dirty >= WB_FILE_FLUSH || now_sec() - wf->since >= wb_delay)) {
+               break;
+            }
+         }
+      }
+      if(wf) {
+         wf->refs++;
+         pthread_mutex_unlock(&wb_lock);
+         wb_flush(wf);
+         pthread_mutex_lock(&wb_lock);
+         wb_put_locked(wf);
+         continue;
+      }
+
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_sec += (time_t) wait;
+      ts.tv_nsec += (long) ((wait - (time_t) wait) * 1e9);
+      if(ts.tv_nsec >= 1000000000) {
+         ts.tv_sec++;
+         ts.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&wb_kick, &wb_lock, &ts);
+   }
+
+   return NULL;
+}
+
+static void start_wb_flusher(void)
+{
+   pthread_t      thread;
+   pthread_attr_t attr;
+
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+   pthread_create(&thread, &attr, wb_flusher, NULL);
+   pthread_attr_destroy(&attr);
+}
+
+/* keeps write in dirty ranges of its file, returns at once. a file with much dirty data
+   is handed to flusher, writers flush themselves once all files together hold too much.
+ */
+static int wb_write(const char *path, uint64_t fh, const char *buf, size_t sz, off_t of)
+{
+   struct wfile_t *wf;
+   int            rv;
+   int            kick;
+   int            over;
+
+   pthread_once(&wb_once, start_wb_flusher);
+
+   wf = wb_get(path, TRUE);
+   if(NULL == wf) {
+      return write_server(path, fh, buf, sz, of);
+   }
+
+   kick = over = FALSE;
+   pthread_mutex_lock(&wb_lock);
+   rv = wb_add(wf, buf, sz, of);
+   if(0 == rv) {
+      if(0 == wf->since) {
+         wf->since = now_sec();
+      }
+      if(fh) {
+         wf->fh = fh;
+      }
+      kick = (wf->dirty >= WB_FILE_FLUSH);
+      over = (wb_dirty >= WB_MAX_DIRTY);
+   }
+   pthread_mutex_unlock(&wb_lock);
+
+   if(rv < 0) {
+      /* out of memory, write goes through after older dirty data */
+      wb_flush(wf);
+      rv = write_server(path, fh, buf, sz, of);
+   }
+   else {
+      attr_cache_forget(path, FALSE);
+      if(over) {
+         wb_flush(wf);
+      }
+      else if(kick) {
+         pthread_cond_signal(&wb_kick);
+      }
+      rv = sz;
+   }
+   wb_put(wf);
+
+   return rv;
+}
+
+/* lays dirty data of 'wf' over 'rv' bytes read at 'of' into 'buf' of 'sz' bytes.
+   a short read ended at end of file on server, dirty data past it extends the read
+   and gaps read as zeros.
+ */
+static int wb_overlay(struct wfile_t *wf, char *buf, size_t sz, off_t of, int rv)
+{
+   struct dirty_t *lists[2];
+   struct dirty_t *r;
+   off_t          start;
+   off_t          end;
+   size_t         len;
+   int            i;
+
+   if(rv < 0) {
+      return rv;
+   }
+
+   len = rv;
+   pthread_mutex_lock(&wb_lock);
+   lists[0] = wf->flushing;
+   lists[1] = wf->ranges;   /* newer data goes over older */
+   for(i = 0, end = of + len; len < sz && i < 2; i++) {
+      for(r = lists[i]; r; r = r->next) {
+         if(r->of + (off_t) r->len > end) {
+            end = r->of + r->len;
+         }
+      }
+   }
+   if(end > of + (off_t) len) {
+      end = ((size_t) (end - of) < sz)? end: of + (off_t) sz;
+      memset(buf + len, 0, (end - of) - len);
+      len = end - of;
+   }
+
+   for(i = 0; i < 2; i++) {
+      for(r = lists[i]; r; r = r->next) {
+         start = (r->of > of)? r->of: of;
+         end = (r->of + (off_t) r->len < of + (off_t) len)? r->of + (off_t) r->len: of + (off_t) len;
+         if(start < end) {
+            memcpy(buf + (start - of), r->data + (start - r->of), end - start);
+         }
+      }
+   }
+   pthread_mutex_unlock(&wb_lock);
+
+   return len;
+}
+
+/* size of 'path' as seen by reads, its dirty data may lie past end of file on server */
+static void wb_fix_size(const char *path, struct stat *st)
+{
+   struct wfile_t *wf;
+   struct dirty_t *r;
+   int            i;
+
+   if(wb_delay <= 0) {
+      return;
+   }
+
+   pthread_mutex_lock(&wb_lock);
+   wf = wb_find(path);
+   for(i = 0; wf && i < 2; i++) {
+      for(r = (i)? wf->ranges: wf->flushing; r; r = r->next) {
+         if(r->of + (off_t) r->len > st->st_size) {
+            st->st_size = r->of + r->len;
+         }
+      }
+   }
+   pthread_mutex_unlock(&wb_lock);
+}
+
+static int masd_getattr (const char *path, struct stat *st)
+{
+   struct req_t req;
+   struct rsp_t rsp;
+   int rv;
+   int err;
+
+   if(attr_cache_lookup(path, st, &err)) {
+      if(0 == err) {
+         wb_fix_size(path, st);
+      }
+      return -err;
+   }
+
+   create_req_pkt(&req, GETATTR, path, 0, 0, NULL, 0, 0);
+   memset(&rsp, 0, sizeof(rsp));
+   rsp.data = (char *) st;
+   rsp.data_cap = sizeof(struct stat);
+
+   rv = do_request(&req, &rsp);
+   if(rv < 0) {
+      return rv;
+   }
+
+   if(SUCCESS == rsp.status) {
+      if(rsp.data_len != sizeof(struct stat)) {
+         return -EIO;
+      }
+      attr_cache_store(path, st, 0);
+      wb_fix_size(path, st);
+   }
+   else {
+      errno = rsp.errcode;
+      rv = -errno;
+      if(ENOENT == errno) {
+         attr_cache_store(path, NULL, ENOENT);
+      }
+   }
+
+   return rv;
+}
+
+static int masd_access (const char *path, int val)
+{
+   /* dont know, invoked when directory is accessed  */
+   return 0;
+}
+
+static int masd_mkdir (const char *path, mode_t md)
+{
+   struct req_t req;
+   struct rsp_t rsp;
+   int rv;
+
+   create_req_pkt(&req, MKDIR, path, md, 0, NULL, 0, 0);
+   memset(&rsp, 0, sizeof(rsp));
+
+   rv = do_request(&req, &rsp);
+   attr_cache_forget_entry(path);
+   if(rv < 0) {
+      return rv;
+   }
+
+   if(SUCCESS != rsp.status) {
+      errno = rsp.errcode;
+      rv = -errno;
+   }
+
+   return rv;
+}
+
+static int masd_opendir (const char *path, struct fuse_file_info *finfo)
+{
+   /* not really required, can check for persmissions and other such stuff */
+   return 0;
+}
+
+/* passes entries of a READDIRPLUS frame to 'filler' and caches their attributes */
+static int fill_dir_plus (const char *path, char *data, size_t len, void *buf, fuse_fill_dir_t filler)
+{
+   char           child[PATH_MAX];
+   dirent_plus_t  ent;
+   char           *p;
+   char           *name;
+
+   for(p = data; p < data + len; ) {
+      if(data + len - p < sizeof(ent)) {
+         return -EIO;
+      }
+      memcpy(&ent, p, sizeof(ent));
+      p += sizeof(ent);
+      name = p;
+      if(0 == ent.name_len || ent.name_len > data + len - p || name[ent.name_len - 1] != '\0') {
+         return -EIO;
+      }
+      p += ent.name_len;
+
+      if(ent.errcode) {
+         filler(buf, name, NULL, 0);
+         continue;
+      }
+      /* kernel stats every entry of 'ls -l' next, answer those from cache */
+      if(strcmp(name, ".") != 0 && strcmp(name, "..") != 0 &&
+            snprintf(child, sizeof(child), "%s/%s", (strcmp(path, "/") == 0)? "": path, name) < sizeof(child)) {
+         attr_cache_store(child, &ent.st, 0);
+      }
+      filler(buf, name, &ent.st, 0);
+   }
+
+   return 0;
+}
+
+/* passes NUL terminated names of a READDIR frame to 'filler' */
+static int fill_dir (char *data, size_t len, void *buf, fuse_fill_dir_t filler)
+{
+   char *name;
+
+   /* last name must end within the frame */
+   if(len && data[len - 1] != '\0') {
+      return -EIO;
+   }
+   for(name = data; name < data + len; name += strlen(name) + 1) {
+      filler(buf, name, NULL, 0);
+   }
+
+   return 0;
+}
+
+static int masd_readdir (const char *path, void *buf, fuse_fill_dir_t filler, off_t of, struct fuse_file_info *finfo)
+{
+   struct call_t call;
+   struct req_t req;
+   struct rsp_t rsp;
+   int rv;
+   int plus;
+   char *data;
+
+   rv = 0;
+
+   /* attributes come along with names if server can send them */
+   plus = (server_features & SAMFS_FEAT_READDIRPLUS)? TRUE: FALSE;
+   create_req_pkt(&req, (plus)? READDIRPLUS: READDIR, path, 0, 0, NULL, 0, 0);
+
+   /* server packs entries in frames of up to SAMFS_MIN_PAYLOAD bytes */
+   data = malloc(SAMFS_MIN_PAYLOAD);
+   if(NULL == data) {
+      return -ENOMEM;
+   }
+   memset(&rsp, 0, sizeof(rsp));
+   rsp.data = data;
+   rsp.data_cap = SAMFS_MIN_PAYLOAD;
+
+   rv = call_start(&call, &req, &rsp);
+   if(rv < 0) {
+      free(data);
+      return rv;
+   }
+
+   do {
+      if(call_wait(&call, &rsp) < 0) {
+         call_end(&call);
+         free(data);
+         return -EIO;
+      }
+      if(SUCCESS == rsp.status) {
+         if(0 == rv && plus) {
+            rv = fill_dir_plus(path, data, rsp.data_len, buf, filler);
+         }
+         else if(0 == rv) {
+            rv = fill_dir(data, rsp.data_len, buf, filler);
+         }
+      }
+      else {
+         errno = rsp.errcode;
+         rv = -errno;
+      }
+   } while(!rsp.endofdata);
+
+   call_end(&call);
+   free(data);
+
+   return rv;
+}
+
+static int masd_releasedir (const char *path, struct fuse_file_info *finfo)
+{
+   /* not required, invoked when directory is released after access */
+   return 0;
+}
+
+static int masd_rmdir (const char *path)
+{
+   struct req_t req;
+   struct rsp_t rsp;
+   int rv;
+
+   create_req_pkt(&req, RMDIR, path, 0, 0, NULL, 0, 0);
+   memset(&rsp, 0, sizeof(rsp));
+
+   rv = do_request(&req, &rsp);
+   attr_cache_forget_entry(path);
+   if(rv < 0) {
+      return rv;
+   }
+
+   if(SUCCESS != rsp.status) {
+      errno = rsp.errcode;
+      rv = -errno;
+   }
+
+   return rv;
+}
+
+static int masd_create (const char *path, mode_t md, struct fuse_file_info *finfo)
+{
+   struct req_t req;
+   struct rsp_t rsp;
+   struct open_file_t *f;
+   int rv;
+
+   f = calloc(1, sizeof(struct open_file_t));
+   if(NULL == f) {
+      return -ENOMEM;
+   }
+
+   wb_flush_path(path, FALSE);
+   create_req_pkt(&req, CREATE, path, md, finfo->flags, NULL, 0, 0);
+   memset(&rsp, 0, sizeof(rsp));
+
+   rv = do_request(&req, &rsp);
+   attr_cache_forget_entry(path);
+   block_cache_forget(path, FALSE);    /* an existing file may have been truncated */
+   if(rv < 0) {
+      free(f);
+      return rv;
+   }
+
+   if(SUCCESS != rsp.status) {
+      errno = rsp.errcode;
+      rv = -errno;
+      free(f);
+   }
+   else {
+      f->fh = rsp.size;   /* created file is kept open by server */
+      finfo->fh = (uintptr_t) f;
+   }
+
+   return rv;
+}
+
+/* server opens the file and keeps it open until release, reads and writes
+   carry its handle so that server does not open file for each of them.
+ */
+static int masd_open (const char *path, struct fuse_file_info *finfo)
+{
+   struct req_t req;
+   struct rsp_t rsp;
+   struct stat st;
+   struct open_file_t *f;
+   int rv;
+
+   f = calloc(1, sizeof(struct open_file_t));
+   if(NULL == f) {
+      return -ENOMEM;
+   }
+
+   /* cached blocks of file are used by this open only if they match its attributes now */
+   if(masd_getattr(path, &st) == 0) {
+      f->size = st.st_size;
+      f->mtime = st.st_mtim;
+   }
+   else {
+      block_cache_forget(path, FALSE);
+   }
+
+   create_req_pkt(&req, OPEN, path, 0, finfo->flags, NULL, 0, 0);
+   memset(&rsp, 0, sizeof(rsp));
+
+   rv = do_request(&req, &rsp);
+   if(rv < 0) {
+      free(f);
+      return rv;
+   }
+
+   if(SUCCESS != rsp.status) {
+      errno = rsp.errcode;
+      rv = -errno;
+      free(f);
+   }
+   else {
+      f->fh = rsp.size;   /* 0 if server could not keep it open, requests go by path */
+      finfo->fh = (uintptr_t) f;
+   }
+
+   return rv;
+}
+
+/* reads go through block cache. sequential reads of an open file grow its readahead
+   window, upcoming blocks are then read by readahead workers while current ones are
+   consumed.
+ */
+static int read_data (const char *path, char *buf, size_t sz, off_t of, struct fuse_file_info *finfo)
+{
+   struct open_file_t *f;
+   struct block_t *blk;
+   off_t first;
+   off_t last;
+   off_t span;
+   off_t eof_block;
+   size_t done;
+   size_t skip;
+   size_t n;
+   int eof;
+   int rv;
+
+   f = OPEN_FILE(finfo);
+   if(NULL == f || 0 == block_max || 0 == sz) {
+      return read_server(path, server_fh(finfo), buf, sz, of);
+   }
+
+   /* a read starting where last one ended is sequential, any jump resets window */
+   pthread_mutex_lock(&block_lock);
+   if(of == f->next_off) {
+      f->ra_window = (f->ra_window)? f->ra_window * 2: RA_MIN_BLOCKS;
+      if(f->ra_window > RA_MAX_BLOCKS) {
+         f->ra_window = RA_MAX_BLOCKS;
+      }
+   }
+   else {
+      f->ra_window = 0;
+      f->ra_next = 0;
+   }
+   f->next_off = of + sz;
+   last = (of + sz - 1) / BLOCK_SIZE;
+   first = (f->ra_next > last)? f->ra_next: last + 1;
+   eof_block = (f->size + BLOCK_SIZE - 1) / BLOCK_SIZE - 1;   /* nothing to read beyond end of file */
+   span = (last < eof_block)? last: eof_block;
+   last += f->ra_window;
+   if(last > eof_block) {
+      last = eof_block;
+   }
+   if(first <= last) {
+      f->ra_next = last + 1;
+   }
+   pthread_mutex_unlock(&block_lock);
+   /* blocks of a read spanning several are fetched side by side by readahead workers,
+      while this one waits for the first
+    */
+   if(stripe_max > 1 && of / BLOCK_SIZE < span) {
+      read_ahead(path, f, of / BLOCK_SIZE + 1, span);
+   }
+   if(f->ra_window && first <= last) {
+      read_ahead(path, f, first, last);
+   }
+
+   done = 0;
+   while(done < sz) {
+      skip = (of + done) % BLOCK_SIZE;
+      rv = block_get(path, f, (of + done) / BLOCK_SIZE, &blk);
+      if(rv < 0) {
+         return (done)? (int) done: rv;
+      }
+      if(NULL == blk) {
+         /* cache is full of blocks in use, rest comes straight from server */
+         rv = read_server(path, f->fh, buf + done, sz - done, of + done);
+         return (rv < 0)? ((done)? (int) done: rv): (int) done + rv;
+      }
+      n = (blk->len > skip)? blk->len - skip: 0;
+      if(n > sz - done) {
+         n = sz - done;
+      }
+      memcpy(buf + done, blk->data + skip, n);
+      done += n;
+      eof = (blk->len < BLOCK_SIZE);
+      block_put(blk);
+      if(eof) {
+         break;
+      }
+   }
+
+   return done;
+}
+
+static int masd_read (const char *path, char *buf, size_t sz, off_t of, struct fuse_file_info *finfo)
+{
+   struct wfile_t *wf;
+   int rv;
+
+   wf = (wb_delay > 0)? wb_get(path, FALSE): NULL;
+   if(NULL == wf) {
+      return read_data(path, buf, sz, of, finfo);
+   }
+
+   /* dirty data not on server yet goes over what server has */
+   pthread_rwlock_rdlock(&wf->sent_lock);
+   rv = read_data(path, buf, sz, of, finfo);
+   rv = wb_overlay(wf, buf, sz, of, rv);
+   pthread_rwlock_unlock(&wf->sent_lock);
+   wb_put(wf);
+
+   return rv;
+}
+
+/* sends whole write as one REQ_BULK request on connection of 'slot' (-1 for any),
+   server moves data into file without copying it
+ */
+static int masd_bulk_write (const char *path, const char *buf, size_t sz, off_t of, uint64_t fh, int slot)
+{
+   struct req_t req;
+   struct rsp_t rsp;
+   int rv;
+
+   create_req_pkt(&req, WRITE, path, 0, 0, NULL, sz, of);
+   req.opts = REQ_BULK;
+   req.fh = fh;
+   req.data = (char *) buf;
+   req.data_len = sz;
+
+   memset(&rsp, 0, sizeof(rsp));
+   rv = do_request_on(&req, &rsp, slot);
+   attr_cache_forget(path, FALSE);
+   block_cache_forget_range(path, sz, of);
+   if(rv < 0) {
+      return rv;
+   }
+
+   /* report what was written before a failure, or the failure if nothing was written */
+   if(SUCCESS != rsp.status && 0 == rsp.size) {
+      errno = rsp.errcode;
+      return -errno;
+   }
+
+   return rsp.size;
+}
+
+/* writes one stripe and wakes up writer waiting for it */
+static void stripe_write(struct stripe_t *stripe)
+{
+   int rv;
+
+   rv = masd_bulk_write(stripe->path, stripe->buf, stripe->sz, stripe->of, stripe->fh, stripe->slot);
+
+   pthread_mutex_lock(&stripe_lock);
+   stripe->rv = rv;
+   stripe->done = TRUE;
+   pthread_cond_broadcast(&stripe_done);
+   pthread_mutex_unlock(&stripe_lock);
+}
+
+/* sends stripes of large writes, so that they go out side by side */
+static void *stripe_worker(void *arg)
+{
+   struct stripe_t *stripe;
+
+   for(;;) {
+      pthread_mutex_lock(&stripe_lock);
+      while(NULL == stripe_head) {
+         pthread_cond_wait(&stripe_ready, &stripe_lock);
+      }
+      stripe = stripe_head;
+      stripe_head = stripe->next;
+      if(NULL == stripe_head) {
+         stripe_tail = NULL;
+      }
+      stripe->taken = TRUE;
+      pthread_mutex_unlock(&stripe_lock);
+
+      stripe_write(stripe);
+   }
+
+   return NULL;
+}
+
+static void start_stripe_workers(void)
+{
+   pthread_t      thread;
+   pthread_attr_t attr;
+   int            i;
+
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+   for(i = 1; i < stripe_max; i++) {
+      pthread_create(&thread, &attr, stripe_worker, NULL);
+   }
+   pthread_attr_destroy(&attr);
+}
+
+/* takes a stripe off the queue before any worker did, caller holds stripe_lock */
+static void stripe_unqueue_locked(struct stripe_t *stripe)
+{
+   struct stripe_t **pstripe;
+   struct stripe_t *prev;
+
+   prev = NULL;
+   for(pstripe = &stripe_head; *pstripe; pstripe = &(*pstripe)->next) {
+      if(*pstripe == stripe) {
+         *pstripe = stripe->next;
+         if(stripe_tail == stripe) {
+            stripe_tail = prev;
+         }
+         break;
+      }
+      prev = *pstripe;
+   }
+   stripe->taken = TRUE;
+}
+
+/* writes 'sz' bytes at 'of' as 'n' REQ_BULK stripes on different connections.
+   first stripe is sent by caller, the others by stripe workers, or by caller as well
+   when workers are still busy with stripes of other writes.
+   returns bytes written up to first stripe that failed or was written short, or -errno.
+ */
+static int write_stripes (const char *path, uint64_t fh, const char *buf, size_t sz, off_t of, int n)
+{
+   struct stripe_t stripes[STRIPE_LIMIT];
+   size_t len;
+   size_t total;
+   int slot;
+   int i;
+
+   pthread_once(&stripe_once, start_stripe_workers);
+
+   slot = stripe_split(sz, &n, &len);
+   for(i = 0; i < n; i++) {
+      stripes[i].next = NULL;
+      stripes[i].path = path;
+      stripes[i].fh = fh;
+      stripes[i].buf = buf + i * len;
+      stripes[i].sz = (len < sz - i * len)? len: sz - i * len;
+      stripes[i].of = of + i * len;
+      stripes[i].slot = (slot + i) % conn_pool_size;
+      stripes[i].taken = (0 == i)? TRUE: FALSE;
+      stripes[i].done = FALSE;
+      stripes[i].rv = 0;
+   }
+
+   pthread_mutex_lock(&stripe_lock);
+   for(i = 1; i < n; i++) {
+      if(stripe_tail) {
+         stripe_tail->next = &stripes[i];
+      }
+      else {
+         stripe_head = &stripes[i];
+      }
+      stripe_tail = &stripes[i];
+   }
+   pthread_cond_broadcast(&stripe_ready);
+   pthread_mutex_unlock(&stripe_lock);
+
+   stripe_write(&stripes[0]);
+
+   pthread_mutex_lock(&stripe_lock);
+   for(i = 1; i < n; i++) {
+      if(!stripes[i].taken) {
+         stripe_unqueue_locked(&stripes[i]);
+         pthread_mutex_unlock(&stripe_lock);
+         stripe_write(&stripes[i]);
+         pthread_mutex_lock(&stripe_lock);
+      }
+   }
+   for(i = 1; i < n; i++) {
+      while(!stripes[i].done) {
+         pthread_cond_wait(&stripe_done, &stripe_lock);
+      }
+   }
+   pthread_mutex_unlock(&stripe_lock);
+
+   /* report what was written before a failure, or the failure if nothing was written */
+   total = 0;
+   for(i = 0; i < n; i++) {
+      if(stripes[i].rv < 0) {
+         return (0 == i)? stripes[i].rv: (int) total;
+      }
+      total += stripes[i].rv;
+      if((size_t) stripes[i].rv < stripes[i].sz) {
+         break;
+      }
+   }
+
+   return total;
+}
+
+/* writes 'sz' bytes at 'of' on server, 'fh' is server handle or 0.
+   returns number of bytes written or -errno.
+ */
+static int write_server (const char *path, uint64_t fh, const char *buf, size_t sz, off_t of)
+{
+   struct req_t req;
+   struct rsp_t *rsps;
+   struct call_t *calls;
+   char *zbuf;
+   size_t zip_size;
+   size_t write_size;
+   size_t write_of;
+   size_t total_write;
+   double start;
+   int req_count;
+   int started;
+   int errcode;
+   int slot;
+   int rv;
+   int n;
+   int i;
+
+   /* compressible data goes compressed in WRITE requests, other data in bulk if it can */
+   zbuf = NULL;
+   if(zip_codec && samfs_zip_worth(zip_codec, buf, sz)) {
+      zbuf = malloc(sz? sz: 1);
+   }
+
+   n = stripe_count(sz);
+   start = now_sec();
+   if((server_features & SAMFS_FEAT_BULK_WRITE) && sz >= BULK_WRITE_MIN && NULL == zbuf) {
+      rv = (n > 1)? write_stripes(path, fh, buf, sz, of, n): masd_bulk_write(path, buf, sz, of, fh, -1);
+      if(rv > 0) {
+         stripe_note(rv, now_sec() - start, n);
+      }
+      return rv;
+   }
 
-static int connect_to_server()
-{
-   struct sockaddr_in   sock;
-   int                  sock_fd;
-   int                  ret;
+   /* data is carried inline in WRITE requests of up to 'server_max_payload' bytes.
+      all requests are sent back to back, then their responses are collected.
+      requests of a large write are spread over 'n' connections.
+    */
+   slot = -1;
+   if(n > 1) {
+      slot = stripe_split(sz, &n, &write_size);
+   }
+   req_count = (sz)? (sz + server_max_payload - 1) / server_max_payload: 1;
+   rsps = calloc(req_count, sizeof(struct rsp_t));
+   calls = malloc(req_count * sizeof(struct call_t));
+   if(NULL == rsps || NULL == calls) {
+      free(rsps);
+      free(calls);
+      free(zbuf);
+      return -ENOMEM;
+   }
 
-   /* create a socket for TCP connection */
-   sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+   errcode = 0;
+   started = 0;
+   write_of = 0;
+   for(i = 0; i < req_count; i++) {
+      write_size = (server_max_payload < (sz - write_of))? server_max_payload: (sz - write_of);
+      create_req_pkt(&req, WRITE, path, 0, 0, NULL, write_size, of + write_of);
+      req.fh = fh;
+      req.data = (char *) buf + write_of;
+      req.data_len = write_size;
+      zip_size = (zbuf)? samfs_zip(zip_codec, buf + write_of, write_size, zbuf + write_of): 0;
+      if(zip_size) {
+         req.data = zbuf + write_of;
+         req.data_len = zip_size;
+         req.zip = zip_codec;
+      }
+      errcode = -call_start_on(&calls[i], (slot < 0)? -1: (slot + i % n) % conn_pool_size, &req, &rsps[i]);
+      if(errcode) {
+         break;
+      }
+      started++;
+      write_of += write_size;
+   }
 
-   /* connect to server */
-   sock.sin_family = AF_INET;
-   sock.sin_addr.s_addr = inet_addr(SERVER_IP);
-   sock.sin_port = htons(SERVER_PORT);
-   ret = connect(sock_fd, (struct sockaddr *)&sock, sizeof(struct sockaddr));
-   if(-1 == ret) {
-      return ret;
+   /* collect responses of all parts sent, even if some part failed */
+   total_write = 0;
+   for(i = 0; i < started; i++) {
+      if(call_wait(&calls[i], &rsps[i]) < 0) {
+         errcode = (errcode)? errcode: EIO;
+      }
+      else if(SUCCESS != rsps[i].status) {
+         errcode = (errcode)? errcode: rsps[i].errcode;
+      }
+      else if(!errcode) {
+         total_write += rsps[i].size; /* server returns written bytes (should be equal to 'write_size') */
+      }
+      call_end(&calls[i]);
    }
+   free(rsps);
+   free(calls);
+   free(zbuf);
 
-   return sock_fd;
+   attr_cache_forget(path, FALSE);  /* size and times have changed */
+   block_cache_forget_range(path, sz, of);
+
+   /* report what was written before a failure, or the failure if nothing was written */
+   if(errcode && 0 == total_write) {
+      errno = errcode;
+      return -errno;
+   }
+   stripe_note(total_write, now_sec() - start, n);
+
+   return total_write;
 }
 
-static int create_req_pkt(struct req_t *req, int msg, const char *path, mode_t mode, int flags, int len, const char *npath, size_t size, off_t offset)
+static int masd_write (const char *path, const char *buf, size_t sz, off_t of, struct fuse_file_info *finfo)
 {
-   memset(req, 0, sizeof(struct req_t));
-   req->msg = msg;
-   strcpy(req->url, SERVER_URL);
-   strcpy(req->uri, path);
-   req->mode = mode;
-   req->flags = flags;
-   req->truncate_len = len;
-   if(npath) strcpy(req->data, npath);
-   req->size = size;
-   req->offset = offset;
+   if(wb_delay > 0 && sz) {
+      return wb_write(path, server_fh(finfo), buf, sz, of);
+   }
 
-   return 0;
+   return write_server(path, server_fh(finfo), buf, sz, of);
 }
 
-static int send_req(int sock_fd, struct req_t *req)
+/* close() waits for write-back of file, so that its failure can be reported */
+static int masd_flush (const char *path, struct fuse_file_info *finfo)
 {
-   int rv;
-   int magic;
-
-   magic = 0;
-   req->magic = rand();
+   return wb_sync(path, 0);
+}
 
-   rv = write(sock_fd, req, sizeof(struct req_t));
-   read(sock_fd, &magic, sizeof(magic));
-   if(req->magic != magic) {
-      printf("ERROR IN WRITE: INVALID MAGIC!\n");
-   }
-   return rv;
+static int masd_fsync (const char *path, int datasync, struct fuse_file_info *finfo)
+{
+   return wb_sync(path, 0);
 }
 
-static int read_rsp(int sock_fd, struct rsp_t *rsp)
+static int masd_truncate (const char *path, off_t len)
 {
+   struct req_t req;
+   struct rsp_t rsp;
    int rv;
-   int magic;
 
-   rv = read(sock_fd, rsp, sizeof(struct rsp_t));
-   magic = rsp->magic;
-   write(sock_fd, &magic, sizeof(magic));
+   wb_flush_path(path, FALSE);
+   create_req_pkt(&req, TRUNCATE, path, 0, 0, NULL, 0, len);
+   memset(&rsp, 0, sizeof(rsp));
+
+   rv = do_request(&req, &rsp);
+   attr_cache_forget(path, FALSE);
+   block_cache_forget(path, FALSE);
+   if(rv < 0) {
+      return rv;
+   }
+
+   if(SUCCESS != rsp.status) {
+      errno = rsp.errcode;
+      rv = -errno;
+   }
+
    return rv;
 }
 
-static int masd_getattr (const char *path, struct stat *st)
+static int masd_release (const char *path, struct fuse_file_info *finfo)
 {
-   int server_fd;
    struct req_t req;
    struct rsp_t rsp;
-   int rv;
+   struct open_file_t *f;
 
-   server_fd = connect_to_server();
-   if(server_fd < 0) {
-      return -errno;
+   f = OPEN_FILE(finfo);
+   if(NULL == f) {
+      return 0;
    }
 
-   rv = 0;
+   /* return value of release is ignored by fuse, nothing to do if this fails */
+   wb_sync(path, f->fh);
+   if(f->fh) {
+      create_req_pkt(&req, RELEASE, path, 0, 0, NULL, 0, 0);
+      req.fh = f->fh;
+      memset(&rsp, 0, sizeof(rsp));
+      do_request(&req, &rsp);
+   }
+   free(f);
+   finfo->fh = 0;
 
-   create_req_pkt(&req, GETATTR, path, 0, 0, 0, NULL, 0, 0);
+   return 0;
+}
 
-   send_req(server_fd, &req);
+static int masd_unlink (const char *path)
+{
+   struct req_t req;
+   struct rsp_t rsp;
+   int rv;
 
-   read_rsp(server_fd, &rsp);
+   wb_flush_path(path, FALSE);
+   create_req_pkt(&req, UNLINK, path, 0, 0, NULL, 0, 0);
+   memset(&rsp, 0, sizeof(rsp));
 
-   if(SUCCESS == rsp.status) {
-      memcpy(st, &rsp.data, sizeof(struct stat));
+   rv = do_request(&req, &rsp);
+   attr_cache_forget_entry(path);
+   block_cache_forget(path, FALSE);
+   if(rv < 0) {
+      return rv;
    }
-   else {
+
+   if(SUCCESS != rsp.status) {
       errno = rsp.errcode;
       rv = -errno;
    }
 
-   close(server_fd);
-
    return rv;
 }
 
-static int masd_access (const char *path, int val)
-{
-   /* dont know, invoked when directory is accessed  */
-   return 0;
-}
-
-static int masd_mkdir (const char *path, mode_t md)
+static int masd_rename (const char *path, const char *npath)
 {
-   int server_fd;
    struct req_t req;
    struct rsp_t rsp;
    int rv;
 
-   server_fd = connect_to_server();
-   if(server_fd < 0) {
-      return -errno;
+   wb_flush_path(path, TRUE);
+   wb_flush_path(npath, TRUE);
+   create_req_pkt(&req, RENAME, path, 0, 0, npath, 0, 0);
+   memset(&rsp, 0, sizeof(rsp));
+
+   rv = do_request(&req, &rsp);
+   attr_cache_forget_entry(path);
+   attr_cache_forget(path, TRUE);   /* a renamed dir takes its subtree along */
+   attr_cache_forget_entry(npath);
+   attr_cache_forget(npath, TRUE);
+   block_cache_forget(path, TRUE);
+   block_cache_forget(npath, TRUE);
+   if(rv < 0) {
+      return rv;
    }
 
-   rv = 0;
+   if(SUCCESS != rsp.status) {
+      errno = rsp.errcode;
+      rv = -errno;
+   }
+
+   return rv;
+}
 
-   create_req_pkt(&req, MKDIR, path, md, 0, 0, NULL, 0, 0);
+static int masd_chmod (const char *path, mode_t md)
+{
+   struct req_t req;
+   struct rsp_t rsp;
+   int rv;
 
-   send_req(server_fd, &req);
+   wb_flush_path(path, FALSE);
+   create_req_pkt(&req, CHMOD, path, md, 0, NULL, 0, 0);
+   memset(&rsp, 0, sizeof(rsp));
 
-   read_rsp(server_fd, &rsp);
+   rv = do_request(&req, &rsp);
+   attr_cache_forget(path, FALSE);
+   if(rv < 0) {
+      return rv;
+   }
 
    if(SUCCESS != rsp.status) {
       errno = rsp.errcode;
       rv = -errno;
    }
 
-   close(server_fd);
-
    return rv;
 }
 
-static int masd_opendir (const char *path, struct fuse_file_info *finfo)
-{
-   /* not really required, can check for persmissions and other such stuff */
-   return 0;
-}
-
-static int masd_readdir (const char *path, void *buf, fuse_fill_dir_t filler, off_t of, struct fuse_file_info *finfo)
+static int masd_utime (const char *path, struct utimbuf *tm)
 {
-   int server_fd;
    struct req_t req;
    struct rsp_t rsp;
    int rv;
-   struct dirent dent;
 
-   server_fd = connect_to_server();
-   if(server_fd < 0) {
-      return -errno;
+   wb_flush_path(path, FALSE);   /* later write-back would set times again */
+   create_req_pkt(&req, UTIME, path, 0, 0, NULL, 0, 0);
+   if(tm) {
+      /* new times go to server, empty data means current time */
+      req.data = (char *) tm;
+      req.data_len = sizeof(struct utimbuf);
    }
+   memset(&rsp, 0, sizeof(rsp));
 
-   rv = 0;
+   rv = do_request(&req, &rsp);
+   attr_cache_forget(path, FALSE);
+   if(rv < 0) {
+      return rv;
+   }
 
-   create_req_pkt(&req, READDIR, path, 0, 0, 0, NULL, 0, 0);
+   if(SUCCESS != rsp.status) {
+      errno = rsp.errcode;
+      rv = -errno;
+   }
 
-   send_req(server_fd, &req);
+   return rv;
+}
 
-   do {
-      read_rsp(server_fd, &rsp);
-      if(SUCCESS == rsp.status) {
-         memcpy(&dent, &rsp.data, sizeof(struct stat));
-         filler(buf, dent.d_name, NULL, 0);
-      }
-      else {
-         errno = rsp.errcode;
-         rv = -errno;
-      }
-   } while(!rsp.endofdata);
+static int masd_statfs (const char *path, struct statvfs * stat)
+{
+   struct req_t req;
+   struct rsp_t rsp;
+   int rv;
+
+   create_req_pkt(&req, STATFS, path, 0, 0, NULL, 0, 0);
+   memset(&rsp, 0, sizeof(rsp));
+   rsp.data = (char *) stat;
+   rsp.data_cap = sizeof(struct statvfs);
+
+   rv = do_request(&req, &rsp);
+   if(rv < 0) {
+      return rv;
+   }
 
-   close(server_fd);
+   if(SUCCESS == rsp.status) {
+      if(rsp.data_len != sizeof(struct statvfs)) {
+         return -EIO;
+      }
+   }
+   else {
+      errno = rsp.errcode;
+      rv = -errno;
+   }
 
    return rv;
 }
 
-static int masd_releasedir (const char *path, struct fuse_file_info *finfo)
+
+static void *masd_init (struct fuse_conn_info *conn)
 {
-   /* not required, invoked when directory is released after access */
-   return 0;
+#ifdef FUSE_CAP_AUTO_INVAL_DATA
+   /* cached pages are dropped as soon as getattr sees size or mtime change */
+   if(kernel_cache) {
+      conn->want |= conn->capable & FUSE_CAP_AUTO_INVAL_DATA;
+   }
+#endif
+   return NULL;
 }
 
-static int masd_rmdir (const char *path)
+/* counts fuse operation 'op' started at 'start' (ns) that returned 'rv' */
+static void op_note(int op, uint64_t start, int rv)
 {
-   int server_fd;
-   struct req_t req;
-   struct rsp_t rsp;
-   int rv;
+   struct stat_slot_t *slot;
 
-   server_fd = connect_to_server();
-   if(server_fd < 0) {
-      return -errno;
+   slot = stat_slot();
+   STAT_ADD(slot->ops[op], 1);
+   if(rv < 0) {
+      STAT_ADD(slot->op_errors[op], 1);
    }
+   stat_lat(slot->op_lat[op], samfs_now_ns() - start);
+}
 
-   rv = 0;
+/* defines op_<name>(), which runs masd_<name>() and counts it as fuse operation 'op'.
+   kernel requests of both high-level and low-level api go through these.
+ */
+#define TIMED_OP(name, op, params, args) \
+   static int op_##name params \
+   { \
+      uint64_t start; \
+      int      rv; \
+      \
+      start = samfs_now_ns(); \
+      rv = masd_##name args; \
+      op_note(op, start, rv); \
+      \
+      return rv; \
+   }
 
-   create_req_pkt(&req, RMDIR, path, 0, 0, 0, NULL, 0, 0);
+TIMED_OP(getattr, OP_GETATTR, (const char *path, struct stat *st), (path, st))
+TIMED_OP(access, OP_ACCESS, (const char *path, int val), (path, val))
+TIMED_OP(mkdir, OP_MKDIR, (const char *path, mode_t md), (path, md))
+TIMED_OP(opendir, OP_OPENDIR, (const char *path, struct fuse_file_info *finfo), (path, finfo))
+TIMED_OP(readdir, OP_READDIR, (const char *path, void *buf, fuse_fill_dir_t filler, off_t of, struct fuse_file_info *finfo),
+      (path, buf, filler, of, finfo))
+TIMED_OP(releasedir, OP_RELEASEDIR, (const char *path, struct fuse_file_info *finfo), (path, finfo))
+TIMED_OP(rmdir, OP_RMDIR, (const char *path), (path))
+TIMED_OP(create, OP_CREATE, (const char *path, mode_t md, struct fuse_file_info *finfo), (path, md, finfo))
+TIMED_OP(open, OP_OPEN, (const char *path, struct fuse_file_info *finfo), (path, finfo))
+TIMED_OP(read, OP_READ, (const char *path, char *buf, size_t sz, off_t of, struct fuse_file_info *finfo),
+      (path, buf, sz, of, finfo))
+TIMED_OP(write, OP_WRITE, (const char *path, const char *buf, size_t sz, off_t of, struct fuse_file_info *finfo),
+      (path, buf, sz, of, finfo))
+TIMED_OP(truncate, OP_TRUNCATE, (const char *path, off_t len), (path, len))
+TIMED_OP(flush, OP_FLUSH, (const char *path, struct fuse_file_info *finfo), (path, finfo))
+TIMED_OP(fsync, OP_FSYNC, (const char *path, int datasync, struct fuse_file_info *finfo), (path, datasync, finfo))
+TIMED_OP(release, OP_RELEASE, (const char *path, struct fuse_file_info *finfo), (path, finfo))
+TIMED_OP(unlink, OP_UNLINK, (const char *path), (path))
+TIMED_OP(rename, OP_RENAME, (const char *path, const char *npath), (path, npath))
+TIMED_OP(chmod, OP_CHMOD, (const char *path, mode_t md), (path, md))
+TIMED_OP(utime, OP_UTIME, (const char *path, struct utimbuf *tm), (path, tm))
+TIMED_OP(statfs, OP_STATFS, (const char *path, struct statvfs *stat), (path, stat))
 
-   send_req(server_fd, &req);
+static struct fuse_operations masd_oper = {
+   .init = masd_init,               /* mount is set up */
+
+   .getattr = op_getattr,           /* get file/dir attributes */
+   .access = op_access,             /* access dir/file */
+
+   .mkdir = op_mkdir,               /* create dir */
+   .opendir = op_opendir,           /* not reuired */
+   .readdir = op_readdir,           /* read dir contents */
+   .releasedir = op_releasedir,     /* close dir */
+   .rmdir = op_rmdir,               /* remove dir */
+
+   .create = op_create,             /* create a new file */
+   .open = op_open,                 /* open file */
+   .read = op_read,                 /* read file */
+   .write = op_write,               /* write file */
+   .truncate = op_truncate,         /* truncate the file */
+   .flush = op_flush,               /* file descriptor closed */
+   .fsync = op_fsync,               /* sync file */
+   .release = op_release,           /* close file */
+   .unlink = op_unlink,             /* delete file */
+
+   .rename = op_rename,             /* rename file/dir */
+   .chmod = op_chmod,               /* change read/write/executable permissions */
+   .utime = op_utime,               /* get access time of file/dir */
+   .statfs = op_statfs,             /* stat fs */
+};
 
-   read_rsp(server_fd, &rsp);
+static struct inode_t *inode_find(fuse_ino_t ino)
+{
+   struct inode_t *inode;
 
-   if(SUCCESS != rsp.status) {
-      errno = rsp.errcode;
-      rv = -errno;
+   for(inode = inodes[ino % ATTR_CACHE_BUCKETS]; inode; inode = inode->next) {
+      if(inode->ino == ino) {
+         break;
+      }
    }
 
-   close(server_fd);
-
-   return rv;
+   return inode;
 }
 
-static int masd_create (const char *path, mode_t md, struct fuse_file_info *finfo)
+static void inode_hash_path(struct inode_t *inode)
 {
-   int server_fd;
-   struct req_t req;
-   struct rsp_t rsp;
-   int rv;
-
-   server_fd = connect_to_server();
-   if(server_fd < 0) {
-      return -errno;
-   }
+   struct inode_t **pinode;
 
-   rv = 0;
+   pinode = &inode_paths[attr_hash(inode->path)];
+   inode->pnext = *pinode;
+   *pinode = inode;
+   inode->hashed = TRUE;
+}
 
-   create_req_pkt(&req, CREATE, path, md, finfo->flags, 0, NULL, 0, 0);
+static void inode_unhash_path(struct inode_t *inode)
+{
+   struct inode_t **pinode;
 
-   send_req(server_fd, &req);
+   for(pinode = &inode_paths[attr_hash(inode->path)]; *pinode; pinode = &(*pinode)->pnext) {
+      if(*pinode == inode) {
+         *pinode = inode->pnext;
+         break;
+      }
+   }
+   inode->hashed = FALSE;
+}
 
-   read_rsp(server_fd, &rsp);
+/* copies path of 'ino' to 'path' which has room for PATH_MAX bytes */
+static int inode_path(fuse_ino_t ino, char *path)
+{
+   struct inode_t *inode;
 
-   if(SUCCESS != rsp.status) {
-      errno = rsp.errcode;
-      rv = -errno;
+   if(FUSE_ROOT_ID == ino) {
+      strcpy(path, "/");
+      return 0;
    }
 
-   close(server_fd);
+   pthread_mutex_lock(&inode_lock);
+   inode = inode_find(ino);
+   if(inode) {
+      strcpy(path, inode->path);
+   }
+   pthread_mutex_unlock(&inode_lock);
 
-   return rv;
+   return (inode)? 0: -ESTALE;
 }
 
-static int masd_open (const char *path, struct fuse_file_info *finfo)
+/* path of entry 'name' of directory 'parent' */
+static int child_path(fuse_ino_t parent, const char *name, char *path)
 {
-   /* check read/write and other permissions and finfo flag */
+   char  dir[PATH_MAX];
+   int   rv;
+
+   rv = inode_path(parent, dir);
+   if(rv < 0) {
+      return rv;
+   }
+   if(snprintf(path, PATH_MAX, "%s/%s", (strcmp(dir, "/") == 0)? "": dir, name) >= PATH_MAX) {
+      return -ENAMETOOLONG;
+   }
+
    return 0;
 }
 
-static int masd_read (const char *path, char *buf, size_t sz, off_t of, struct fuse_file_info *finfo)
+/* inode of 'path' for a lookup reply, counts the lookup. returns 0 if out of memory */
+static fuse_ino_t inode_get(const char *path)
 {
-   int server_fd;
-   struct req_t req;
-   struct rsp_t rsp;
-   int rv;
-   int last_of;
+   struct inode_t *inode;
+   fuse_ino_t     ino;
 
-   server_fd = connect_to_server();
-   if(server_fd < 0) {
-      return -errno;
+   if(strcmp(path, "/") == 0) {
+      return FUSE_ROOT_ID;
    }
 
-   rv = 0;
+   pthread_mutex_lock(&inode_lock);
+   for(inode = inode_paths[attr_hash(path)]; inode; inode = inode->pnext) {
+      if(strcmp(inode->path, path) == 0) {
+         break;
+      }
+   }
+   if(NULL == inode) {
+      inode = calloc(1, sizeof(struct inode_t));
+      if(inode) {
+         inode->path = strdup(path);
+      }
+      if(NULL == inode || NULL == inode->path) {
+         free(inode);
+         pthread_mutex_unlock(&inode_lock);
+         return 0;
+      }
+      inode->ino = inode_next++;
+      inode->next = inodes[inode->ino % ATTR_CACHE_BUCKETS];
+      inodes[inode->ino % ATTR_CACHE_BUCKETS] = inode;
+      inode_hash_path(inode);
+   }
+   inode->nlookup++;
+   ino = inode->ino;
+   pthread_mutex_unlock(&inode_lock);
 
-   create_req_pkt(&req, READ, path, 0, 0, 0, NULL, sz, of);
+   return ino;
+}
 
-   send_req(server_fd, &req);
+/* kernel dropped 'nlookup' lookups of 'ino', inode goes with the last one */
+static void inode_forget(fuse_ino_t ino, uint64_t nlookup)
+{
+   struct inode_t **pinode;
+   struct inode_t *inode;
 
-   last_of = 0;
-   do {
-      read_rsp(server_fd, &rsp);
-      if(SUCCESS == rsp.status) {
-         if(rsp.size) {
-            memcpy(buf + last_of, &rsp.data, rsp.size);
+   pthread_mutex_lock(&inode_lock);
+   for(pinode = &inodes[ino % ATTR_CACHE_BUCKETS]; *pinode; pinode = &(*pinode)->next) {
+      if((*pinode)->ino == ino) {
+         break;
+      }
+   }
+   inode = *pinode;
+   if(inode) {
+      inode->nlookup = (inode->nlookup > nlookup)? inode->nlookup - nlookup: 0;
+      if(0 == inode->nlookup) {
+         *pinode = inode->next;
+         if(inode->hashed) {
+            inode_unhash_path(inode);
          }
-         last_of += rsp.size;
-         rv = last_of;
+         free(inode->path);
+         free(inode);
       }
-      else {
-         errno = rsp.errcode;
-         rv = -errno;
+   }
+   pthread_mutex_unlock(&inode_lock);
+}
+
+/* 'path' is gone from server, its inode is no longer found by it */
+static void inode_drop_path(const char *path)
+{
+   struct inode_t *inode;
+
+   pthread_mutex_lock(&inode_lock);
+   for(inode = inode_paths[attr_hash(path)]; inode; inode = inode->pnext) {
+      if(strcmp(inode->path, path) == 0) {
+         inode_unhash_path(inode);
+         break;
       }
-   } while(!rsp.endofdata);
+   }
+   pthread_mutex_unlock(&inode_lock);
+}
 
-   close(server_fd);
+/* 'path' was renamed to 'npath', inodes below it move along */
+static void inode_move(const char *path, const char *npath)
+{
+   struct inode_t *moved;
+   struct inode_t *inode;
+   struct inode_t *next;
+   size_t         len;
+   size_t         nlen;
+   char           *p;
+   int            i;
+
+   len = strlen(path);
+   nlen = strlen(npath);
+   moved = NULL;
+   pthread_mutex_lock(&inode_lock);
+   for(i = 0; i < ATTR_CACHE_BUCKETS; i++) {
+      for(inode = inode_paths[i]; inode; inode = next) {
+         next = inode->pnext;
+         if(strncmp(inode->path, npath, nlen) == 0 && inode->path[nlen] == '\0') {
+            inode_unhash_path(inode);   /* replaced by renamed file */
+         }
+         else if(strncmp(inode->path, path, len) == 0 &&
+               (inode->path[len] == '\0' || inode->path[len] == '/')) {
+            inode_unhash_path(inode);
+            inode->pnext = moved;
+            moved = inode;
+         }
+      }
+   }
+   /* rehash with new paths once all of them are out of the table */
+   for(inode = moved; inode; inode = next) {
+      next = inode->pnext;
+      p = malloc(nlen + strlen(inode->path + len) + 1);
+      if(p) {
+         sprintf(p, "%s%s", npath, inode->path + len);
+         free(inode->path);
+         inode->path = p;
+         inode_hash_path(inode);
+      }
+   }
+   pthread_mutex_unlock(&inode_lock);
+}
 
-   return rv;
+/* returns TRUE if kernel can keep cached pages of 'ino' for open 'f',
+   which is when file has not changed since it was last opened.
+ */
+static int inode_keep_cache(fuse_ino_t ino, struct open_file_t *f)
+{
+   struct inode_t *inode;
+   int            keep;
+
+   keep = FALSE;
+   pthread_mutex_lock(&inode_lock);
+   inode = inode_find(ino);
+   if(inode) {
+      keep = inode->opened && inode->size == f->size &&
+             inode->mtime.tv_sec == f->mtime.tv_sec && inode->mtime.tv_nsec == f->mtime.tv_nsec;
+      inode->opened = TRUE;
+      inode->size = f->size;
+      inode->mtime = f->mtime;
+   }
+   pthread_mutex_unlock(&inode_lock);
+
+   return keep && kernel_cache;
 }
 
-static int masd_write (const char *path, const char *buf, size_t sz, off_t of, struct fuse_file_info *finfo)
+/* fills entry reply for 'path', which counts as a lookup of its inode */
+static int ll_entry(const char *path, struct fuse_entry_param *e)
 {
-   int server_fd;
-   struct req_t req;
-   struct rsp_t rsp;
    int rv;
-   int write_size;
-   int total_write;
-   int write_of;
 
-   server_fd = connect_to_server();
-   if(server_fd < 0) {
-      return -errno;
+   memset(e, 0, sizeof(struct fuse_entry_param));
+   rv = op_getattr(path, &e->attr);
+   if(rv < 0) {
+      return rv;
    }
+   e->ino = inode_get(path);
+   if(0 == e->ino) {
+      return -ENOMEM;
+   }
+   e->attr.st_ino = e->ino;
+   e->attr_timeout = attr_timeout;
+   e->entry_timeout = entry_timeout;
 
-   rv = 0;
-
-   create_req_pkt(&req, WRITE, path, 0, 0, 0, NULL, sz, of);
+   return 0;
+}
 
-   send_req(server_fd, &req);
+static void masd_ll_init (void *userdata, struct fuse_conn_info *conn)
+{
+#ifdef FUSE_CAP_SPLICE_READ
+   /* let kernel splice write data to us and reply data from us */
+   conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE);
+#endif
+   masd_init(conn);
+}
 
-   /* check if server is ready to receive a file data */
-   read_rsp(server_fd, &rsp);
-   write_of = 0;
-   if(SUCCESS == rsp.status) {
-      write_size = (sizeof(req.data) < sz)? sizeof(req.data): sz;
-      do {
-         memcpy(&req.data, buf + write_of, write_size);
-         req.size = write_size;
-         write_of += write_size;
-         total_write += write_size;
-         if(total_write < sz) {
-            req.endofdata = FALSE;
-            write_size = (sizeof(req.data) < (sz - total_write))? sizeof(req.data): (sz - total_write);
-         }
-         else {
-            req.endofdata = TRUE;
-            write_size = 0; /* sent all data, break the loop */
-         }
-         send_req(server_fd, &req);
-      } while(write_size);
+static void masd_ll_lookup (fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+   struct fuse_entry_param e;
+   char path[PATH_MAX];
+   int rv;
 
-      /* check the write status on server side */
-      read_rsp(server_fd, &rsp);
-      if(SUCCESS != rsp.status) {
-         errno = rsp.errcode;
-         rv = -errno;
-      }
-      else {
-         rv = rsp.size; /* server will return total written bytes (should be equal to 'sz') */
-      }
+   rv = child_path(parent, name, path);
+   if(0 == rv) {
+      rv = ll_entry(path, &e);
    }
-   else {
-      errno = rsp.errcode;
-      rv = -errno;
+   if(-ENOENT == rv && neg_timeout > 0) {
+      /* inode 0 lets kernel cache the failed lookup */
+      memset(&e, 0, sizeof(e));
+      e.entry_timeout = neg_timeout;
+      rv = 0;
    }
+   if(rv < 0) {
+      fuse_reply_err(req, -rv);
+      return;
+   }
+   fuse_reply_entry(req, &e);
+}
 
-   close(server_fd);
-
-   return rv;
+static void masd_ll_forget (fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+   inode_forget(ino, nlookup);
+   fuse_reply_none(req);
 }
 
-static int masd_truncate (const char *path, off_t len)
+static void masd_ll_getattr (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *finfo)
 {
-   int server_fd;
-   struct req_t req;
-   struct rsp_t rsp;
+   struct stat st;
+   char path[PATH_MAX];
    int rv;
 
-   server_fd = connect_to_server();
-   if(server_fd < 0) {
-      return -errno;
+   rv = inode_path(ino, path);
+   if(0 == rv) {
+      rv = op_getattr(path, &st);
    }
+   if(rv < 0) {
+      fuse_reply_err(req, -rv);
+      return;
+   }
+   st.st_ino = ino;
+   fuse_reply_attr(req, &st, attr_timeout);
+}
 
-   rv = 0;
-
-   create_req_pkt(&req, TRUNCATE, path, 0, 0, len, NULL, 0, 0);
-
-   send_req(server_fd, &req);
+#ifndef FUSE_SET_ATTR_ATIME_NOW
+#define FUSE_SET_ATTR_ATIME_NOW  (1 << 7)
+#define FUSE_SET_ATTR_MTIME_NOW  (1 << 8)
+#endif
 
-   read_rsp(server_fd, &rsp);
+static void masd_ll_setattr (fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *finfo)
+{
+   struct utimbuf tm;
+   struct stat st;
+   char path[PATH_MAX];
+   int rv;
 
-   if(SUCCESS != rsp.status) {
-      errno = rsp.errcode;
-      rv = -errno;
+   rv = inode_path(ino, path);
+   if(0 == rv && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))) {
+      rv = -ENOSYS;   /* owner can not be changed, same as in path mode */
    }
-
-   close(server_fd);
-
-   return rv;
+   if(0 == rv && (to_set & FUSE_SET_ATTR_MODE)) {
+      rv = op_chmod(path, attr->st_mode);
+   }
+   if(0 == rv && (to_set & FUSE_SET_ATTR_SIZE)) {
+      rv = op_truncate(path, attr->st_size);
+   }
+   if(0 == rv && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+      /* server sets both times, one not being changed is sent as it is */
+      rv = op_getattr(path, &st);
+      if(0 == rv) {
+         tm.actime = (to_set & FUSE_SET_ATTR_ATIME_NOW)? time(NULL):
+                     (to_set & FUSE_SET_ATTR_ATIME)? attr->st_atime: st.st_atime;
+         tm.modtime = (to_set & FUSE_SET_ATTR_MTIME_NOW)? time(NULL):
+                     (to_set & FUSE_SET_ATTR_MTIME)? attr->st_mtime: st.st_mtime;
+         rv = op_utime(path, &tm);
+      }
+   }
+   if(0 == rv) {
+      rv = op_getattr(path, &st);
+   }
+   if(rv < 0) {
+      fuse_reply_err(req, -rv);
+      return;
+   }
+   st.st_ino = ino;
+   fuse_reply_attr(req, &st, attr_timeout);
 }
 
-static int masd_release (const char *path, struct fuse_file_info *finfo)
+static void masd_ll_mkdir (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t md)
 {
-   /* dont know, invoked when file is closed(?)  */
-   return 0;
+   struct fuse_entry_param e;
+   char path[PATH_MAX];
+   int rv;
+
+   rv = child_path(parent, name, path);
+   if(0 == rv) {
+      rv = op_mkdir(path, md);
+   }
+   if(0 == rv) {
+      rv = ll_entry(path, &e);
+   }
+   if(rv < 0) {
+      fuse_reply_err(req, -rv);
+      return;
+   }
+   fuse_reply_entry(req, &e);
 }
 
-static int masd_unlink (const char *path)
+static void masd_ll_unlink (fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-   int server_fd;
-   struct req_t req;
-   struct rsp_t rsp;
+   char path[PATH_MAX];
    int rv;
 
-   server_fd = connect_to_server();
-   if(server_fd < 0) {
-      return -errno;
+   rv = child_path(parent, name, path);
+   if(0 == rv) {
+      rv = op_unlink(path);
    }
+   if(0 == rv) {
+      inode_drop_path(path);
+   }
+   fuse_reply_err(req, -rv);
+}
 
-   rv = 0;
-
-   create_req_pkt(&req, UNLINK, path, 0, 0, 0, NULL, 0, 0);
-
-   send_req(server_fd, &req);
-
-   read_rsp(server_fd, &rsp);
+static void masd_ll_rmdir (fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+   char path[PATH_MAX];
+   int rv;
 
-   if(SUCCESS != rsp.status) {
-      errno = rsp.errcode;
-      rv = -errno;
+   rv = child_path(parent, name, path);
+   if(0 == rv) {
+      rv = op_rmdir(path);
    }
+   if(0 == rv) {
+      inode_drop_path(path);
+   }
+   fuse_reply_err(req, -rv);
+}
 
-   close(server_fd);
+static void masd_ll_rename (fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t nparent, const char *nname)
+{
+   char path[PATH_MAX];
+   char npath[PATH_MAX];
+   int rv;
 
-   return rv;
+   rv = child_path(parent, name, path);
+   if(0 == rv) {
+      rv = child_path(nparent, nname, npath);
+   }
+   if(0 == rv) {
+      rv = op_rename(path, npath);
+   }
+   if(0 == rv) {
+      inode_move(path, npath);
+   }
+   fuse_reply_err(req, -rv);
 }
 
-static int masd_rename (const char *path, const char *npath)
+static void masd_ll_create (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t md, struct fuse_file_info *finfo)
 {
-   int server_fd;
-   struct req_t req;
-   struct rsp_t rsp;
+   struct fuse_entry_param e;
+   char path[PATH_MAX];
    int rv;
 
-   server_fd = connect_to_server();
-   if(server_fd < 0) {
-      return -errno;
+   rv = child_path(parent, name, path);
+   if(0 == rv) {
+      rv = op_create(path, md, finfo);
    }
+   if(0 == rv) {
+      rv = ll_entry(path, &e);
+      if(rv < 0) {
+         op_release(path, finfo);
+      }
+   }
+   if(rv < 0) {
+      fuse_reply_err(req, -rv);
+      return;
+   }
+   if(fuse_reply_create(req, &e, finfo) == -ENOENT) {
+      /* request was interrupted, kernel does not know about this open */
+      op_release(path, finfo);
+      inode_forget(e.ino, 1);
+   }
+}
 
-   rv = 0;
-
-   create_req_pkt(&req, RENAME, path, 0, 0, 0, npath, 0, 0);
+static void masd_ll_open (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *finfo)
+{
+   char path[PATH_MAX];
+   int rv;
 
-   send_req(server_fd, &req);
+   rv = inode_path(ino, path);
+   if(0 == rv) {
+      rv = op_open(path, finfo);
+   }
+   if(rv < 0) {
+      fuse_reply_err(req, -rv);
+      return;
+   }
+   finfo->keep_cache = inode_keep_cache(ino, OPEN_FILE(finfo));
+   if(fuse_reply_open(req, finfo) == -ENOENT) {
+      op_release(path, finfo);
+   }
+}
 
-   read_rsp(server_fd, &rsp);
+static void masd_ll_read (fuse_req_t req, fuse_ino_t ino, size_t sz, off_t of, struct fuse_file_info *finfo)
+{
+   struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(0);
+   char path[PATH_MAX];
+   char *buf;
+   int rv;
 
-   if(SUCCESS != rsp.status) {
-      errno = rsp.errcode;
-      rv = -errno;
+   buf = NULL;
+   rv = inode_path(ino, path);
+   if(0 == rv) {
+      buf = malloc((sz)? sz: 1);
+      rv = (buf)? op_read(path, buf, sz, of, finfo): -ENOMEM;
    }
+   if(rv < 0) {
+      fuse_reply_err(req, -rv);
+   }
+   else {
+      /* libfuse splices reply to kernel if it can, instead of copying it once more */
+      bufv.buf[0].mem = buf;
+      bufv.buf[0].size = rv;
+      fuse_reply_data(req, &bufv, 0);
+   }
+   free(buf);
+}
 
-   close(server_fd);
+static void masd_ll_write_buf (fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t of, struct fuse_file_info *finfo)
+{
+   struct fuse_bufvec dst = FUSE_BUFVEC_INIT(0);
+   char path[PATH_MAX];
+   char *buf;
+   char *data;
+   size_t sz;
+   ssize_t n;
+   int rv;
 
-   return rv;
+   buf = NULL;
+   data = NULL;
+   sz = fuse_buf_size(bufv);
+   rv = inode_path(ino, path);
+   if(0 == rv && 1 == bufv->count && !(bufv->buf[0].flags & FUSE_BUF_IS_FD)) {
+      data = (char *) bufv->buf[0].mem + bufv->off;
+   }
+   else if(0 == rv) {
+      /* data is still in pipe kernel spliced it to, take it out once */
+      buf = malloc((sz)? sz: 1);
+      if(NULL == buf) {
+         rv = -ENOMEM;
+      }
+      else {
+         dst.buf[0].mem = buf;
+         dst.buf[0].size = sz;
+         n = fuse_buf_copy(&dst, bufv, 0);
+         rv = (n < 0)? n: 0;
+         sz = (n < 0)? 0: n;
+         data = buf;
+      }
+   }
+   if(0 == rv) {
+      rv = op_write(path, data, sz, of, finfo);
+   }
+   if(rv < 0) {
+      fuse_reply_err(req, -rv);
+   }
+   else {
+      fuse_reply_write(req, rv);
+   }
+   free(buf);
 }
 
-static int masd_chmod (const char *path, mode_t md)
+static void masd_ll_flush (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *finfo)
 {
-   int server_fd;
-   struct req_t req;
-   struct rsp_t rsp;
+   char path[PATH_MAX];
    int rv;
 
-   server_fd = connect_to_server();
-   if(server_fd < 0) {
-      return -errno;
+   rv = inode_path(ino, path);
+   if(0 == rv) {
+      rv = op_flush(path, finfo);
    }
+   fuse_reply_err(req, -rv);
+}
 
-   rv = 0;
-
-   create_req_pkt(&req, CHMOD, path, md, 0, 0, NULL, 0, 0);
+static void masd_ll_fsync (fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *finfo)
+{
+   char path[PATH_MAX];
+   int rv;
 
-   send_req(server_fd, &req);
+   rv = inode_path(ino, path);
+   if(0 == rv) {
+      rv = op_fsync(path, datasync, finfo);
+   }
+   fuse_reply_err(req, -rv);
+}
 
-   read_rsp(server_fd, &rsp);
+static void masd_ll_release (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *finfo)
+{
+   char path[PATH_MAX];
 
-   if(SUCCESS != rsp.status) {
-      errno = rsp.errcode;
-      rv = -errno;
+   /* path may be stale if inode is gone, release then goes by server handle only */
+   if(inode_path(ino, path) < 0) {
+      path[0] = '\0';
    }
+   op_release(path, finfo);
+   fuse_reply_err(req, 0);
+}
 
-   close(server_fd);
+/* adds an entry to listing of low-level directory, passed to op_readdir() as filler */
+static int ll_fill_dir (void *buf, const char *name, const struct stat *st, off_t of)
+{
+   struct ll_dir_t *dir;
+   struct stat est;
+   size_t need;
+   size_t cap;
+   char *p;
+
+   dir = buf;
+   memset(&est, 0, sizeof(est));
+   est.st_ino = (st)? st->st_ino: 0xffffffff;   /* unknown inode, as libfuse reports it */
+   est.st_mode = (st)? st->st_mode: 0;
+
+   need = fuse_add_direntry(dir->req, NULL, 0, name, NULL, 0);
+   if(dir->len + need > dir->cap) {
+      cap = (dir->cap)? dir->cap: 4096;
+      while(cap < dir->len + need) {
+         cap *= 2;
+      }
+      p = realloc(dir->buf, cap);
+      if(NULL == p) {
+         return 1;   /* stops listing */
+      }
+      dir->buf = p;
+      dir->cap = cap;
+   }
+   fuse_add_direntry(dir->req, dir->buf + dir->len, need, name, &est, dir->len + need);
+   dir->len += need;
 
-   return rv;
+   return 0;
 }
 
-static int masd_utime (const char *path, struct utimbuf *tm)
+static void masd_ll_opendir (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *finfo)
 {
-   int server_fd;
-   struct req_t req;
-   struct rsp_t rsp;
-   int rv;
+   struct ll_dir_t *dir;
 
-   server_fd = connect_to_server();
-   if(server_fd < 0) {
-      return -errno;
+   dir = calloc(1, sizeof(struct ll_dir_t));
+   if(NULL == dir) {
+      fuse_reply_err(req, ENOMEM);
+      return;
    }
+   finfo->fh = (uintptr_t) dir;
+   if(fuse_reply_open(req, finfo) == -ENOENT) {
+      free(dir);
+   }
+}
 
-   rv = 0;
-
-   create_req_pkt(&req, UTIME, path, 0, 0, 0, NULL, 0, 0);
-
-   send_req(server_fd, &req);
+static void masd_ll_readdir (fuse_req_t req, fuse_ino_t ino, size_t sz, off_t of, struct fuse_file_info *finfo)
+{
+   struct ll_dir_t *dir;
+   char path[PATH_MAX];
+   int rv;
 
-   read_rsp(server_fd, &rsp);
+   /* whole listing is fetched when reading starts over, later calls are served from it */
+   dir = (struct ll_dir_t *)(uintptr_t) finfo->fh;
+   if(0 == of || !dir->filled) {
+      dir->len = 0;
+      dir->req = req;
+      rv = inode_path(ino, path);
+      if(0 == rv) {
+         rv = op_readdir(path, dir, ll_fill_dir, 0, NULL);
+      }
+      if(rv < 0) {
+         fuse_reply_err(req, -rv);
+         return;
+      }
+      dir->filled = TRUE;
+   }
 
-   if(SUCCESS == rsp.status) {
-      memcpy(tm, &rsp.data, sizeof(struct utimbuf));
+   if(of < dir->len) {
+      fuse_reply_buf(req, dir->buf + of, (dir->len - of < sz)? dir->len - of: sz);
    }
    else {
-      errno = rsp.errcode;
-      rv = -errno;
+      fuse_reply_buf(req, NULL, 0);
    }
+}
 
-   close(server_fd);
+static void masd_ll_releasedir (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *finfo)
+{
+   struct ll_dir_t *dir;
 
-   return rv;
+   dir = (struct ll_dir_t *)(uintptr_t) finfo->fh;
+   free(dir->buf);
+   free(dir);
+   fuse_reply_err(req, 0);
 }
 
-static int masd_statfs (const char *path, struct statvfs * stat)
+static void masd_ll_statfs (fuse_req_t req, fuse_ino_t ino)
 {
-   int server_fd;
-   struct req_t req;
-   struct rsp_t rsp;
+   struct statvfs sv;
    int rv;
 
-   server_fd = connect_to_server();
-   if(server_fd < 0) {
-      return -errno;
+   rv = op_statfs("/", &sv);
+   if(rv < 0) {
+      fuse_reply_err(req, -rv);
+      return;
    }
+   fuse_reply_statfs(req, &sv);
+}
 
-   rv = 0;
-
-   create_req_pkt(&req, STATFS, path, 0, 0, 0, NULL, 0, 0);
+static void masd_ll_access (fuse_req_t req, fuse_ino_t ino, int mask)
+{
+   fuse_reply_err(req, 0);   /* same as masd_access() */
+}
 
-   send_req(server_fd, &req);
+static struct fuse_lowlevel_ops masd_ll_oper = {
+   .init = masd_ll_init,
+   .lookup = masd_ll_lookup,        /* name in dir to inode */
+   .forget = masd_ll_forget,        /* kernel dropped inode */
+   .getattr = masd_ll_getattr,
+   .setattr = masd_ll_setattr,      /* chmod, truncate and utime */
+   .access = masd_ll_access,
+
+   .mkdir = masd_ll_mkdir,
+   .opendir = masd_ll_opendir,
+   .readdir = masd_ll_readdir,
+   .releasedir = masd_ll_releasedir,
+   .rmdir = masd_ll_rmdir,
+
+   .create = masd_ll_create,
+   .open = masd_ll_open,
+   .read = masd_ll_read,
+   .write_buf = masd_ll_write_buf,  /* takes spliced data too */
+   .flush = masd_ll_flush,
+   .fsync = masd_ll_fsync,
+   .release = masd_ll_release,
+   .unlink = masd_ll_unlink,
+
+   .rename = masd_ll_rename,
+   .statfs = masd_ll_statfs,
+};
 
-   read_rsp(server_fd, &rsp);
+/* mounts and serves kernel requests with low-level api, a thread is started
+   for each request kernel has pending so slow ones do not hold back others.
+ */
+static int masd_ll_main (char *prog, char *mount_point, int debug)
+{
+   char *fuse_argv[4];
+   char opts[256];
+   struct fuse_args args;
+   struct fuse_chan *ch;
+   struct fuse_session *se;
+   int rv;
 
-   if(SUCCESS == rsp.status) {
-      memcpy(stat, &rsp.data, sizeof(struct statvfs));
+   /* timeouts and page cache are handled by our replies, not by options */
+   snprintf(opts, sizeof(opts), "big_writes,max_read=%u,max_write=%u,max_readahead=%u",
+            max_io, max_io, max_io);
+   fuse_argv[0] = prog;
+   fuse_argv[1] = "-o";
+   fuse_argv[2] = opts;
+   fuse_argv[3] = "-d";
+   args.argc = (debug)? 4: 3;
+   args.argv = fuse_argv;
+   args.allocated = 0;
+
+   ch = fuse_mount(mount_point, &args);
+   if(NULL == ch) {
+      return 1;
    }
-   else {
-      errno = rsp.errcode;
-      rv = -errno;
+
+   rv = -1;
+   se = fuse_lowlevel_new(&args, &masd_ll_oper, sizeof(masd_ll_oper), NULL);
+   if(se) {
+      if(fuse_set_signal_handlers(se) != -1) {
+         fuse_session_add_chan(se, ch);
+         rv = fuse_session_loop_mt(se);
+         fuse_remove_signal_handlers(se);
+         fuse_session_remove_chan(ch);
+      }
+      fuse_session_destroy(se);
    }
+   fuse_unmount(mount_point, ch);
+   fuse_opt_free_args(&args);
 
-   close(server_fd);
+   return (rv)? 1: 0;
+}
 
-   return rv;
+/* adds up counters of all slots into 'sum' */
+static void stat_sum(struct stat_slot_t *sum)
+{
+   struct stat_slot_t *slot;
+   int                i;
+   int                k;
+   int                b;
+
+   memset(sum, 0, sizeof(struct stat_slot_t));
+   for(i = 0; i < STAT_SLOTS; i++) {
+      slot = &masd_stat->slots[i];
+      sum->connects += STAT_GET(slot->connects);
+      sum->connect_fails += STAT_GET(slot->connect_fails);
+      sum->call_fails += STAT_GET(slot->call_fails);
+      sum->attr_hits += STAT_GET(slot->attr_hits);
+      sum->attr_misses += STAT_GET(slot->attr_misses);
+      sum->block_hits += STAT_GET(slot->block_hits);
+      sum->block_misses += STAT_GET(slot->block_misses);
+      sum->ra_blocks += STAT_GET(slot->ra_blocks);
+      for(b = 0; b < SAMFS_LAT_BUCKETS; b++) {
+         sum->connect_lat[b] += STAT_GET(slot->connect_lat[b]);
+      }
+      for(k = 0; k < OP_COUNT; k++) {
+         sum->ops[k] += STAT_GET(slot->ops[k]);
+         sum->op_errors[k] += STAT_GET(slot->op_errors[k]);
+         for(b = 0; b < SAMFS_LAT_BUCKETS; b++) {
+            sum->op_lat[k][b] += STAT_GET(slot->op_lat[k][b]);
+         }
+      }
+      for(k = 0; k < STAT_MSGS; k++) {
+         sum->calls[k] += STAT_GET(slot->calls[k]);
+         for(b = 0; b < SAMFS_LAT_BUCKETS; b++) {
+            sum->call_lat[k][b] += STAT_GET(slot->call_lat[k][b]);
+         }
+      }
+   }
 }
 
+/* percent of 'hits' in 'hits' + 'misses' */
+static double hit_ratio(uint64_t hits, uint64_t misses)
+{
+   return (hits + misses)? 100.0 * hits / (hits + misses): 0.0;
+}
 
-static struct fuse_operations masd_oper = {
-   .getattr = masd_getattr,         /* get file/dir attributes */
-   .access = masd_access,           /* access dir/file */
-
-   .mkdir = masd_mkdir,             /* create dir */
-   .opendir = masd_opendir,         /* not reuired */
-   .readdir = masd_readdir,         /* read dir contents */
-   .releasedir = masd_releasedir,   /* close dir */
-   .rmdir = masd_rmdir,             /* remove dir */
-
-   .create = masd_create,           /* create a new file */
-   .open = masd_open,               /* open file */
-   .read = masd_read,               /* read file */
-   .write = masd_write,             /* write file */
-   .truncate = masd_truncate,       /* truncate the file */
-   .release = masd_release,         /* close file */
-   .unlink = masd_unlink,           /* delete file */
-
-   .rename = masd_rename,           /* rename file/dir */
-   .chmod = masd_chmod,             /* change read/write/executable permissions */
-   .utime = masd_utime,             /* get access time of file/dir */
-   .statfs = masd_statfs,           /* stat fs */
-};
+/* prints statistics of masd serving 'mount_point' every second, till it exits */
+static int print_status(const char *mount_point)
+{
+   static struct stat_slot_t total;
+   static struct stat_slot_t last;
+   char                      spct[16];
+   int                       k;
+
+   masd_stat = stat_attach(mount_point, FALSE);
+   if(NULL == masd_stat) {
+      printf("no masd is serving %s\n", mount_point);
+      return FAIL;
+   }
+
+   stat_sum(&last);
+   while(kill(masd_stat->pid, 0) == 0 || errno != ESRCH) {
+      printf("\x1b[H\x1b[2J"); /* clears screen */
+
+      /* rates are operations counted since last reading, a second ago */
+      stat_sum(&total);
+
+      printf("\n");
+      printf("   +--------------------------------------------------------------------------+\n");
+      printf("   |                             Client Dashboard                             |\n");
+      printf("   +--------------------------------------------------------------------------+\n");
+      printf("   | Mount Point : %-41.41s masd PID : %5d |\n", masd_stat->mount_point, masd_stat->pid);
+      printf("   | Server      : %-41.41s Conns    : %5d |\n", masd_stat->server, STAT_GET(masd_stat->conns));
+      printf("   +--------------------------------------------------------------------------+\n");
+      printf("   | Connects : %-10llu Failed : %-9llu Connect Time : %-16s |\n",
+            (unsigned long long) total.connects, (unsigned long long) total.connect_fails,
+            samfs_lat_pcts(total.connect_lat, spct));
+      printf("   | Failed Calls (lost with connection, not retried) : %-21llu |\n",
+            (unsigned long long) total.call_fails);
+      printf("   | Attr Cache Hits  : %6.2f %%      Block Cache Hits : %6.2f %%             |\n",
+            hit_ratio(total.attr_hits, total.attr_misses), hit_ratio(total.block_hits, total.block_misses));
+      printf("   | Blocks Read Ahead : %-52llu |\n", (unsigned long long) total.ra_blocks);
+      printf("   +--------------------------------------------------------------------------+\n");
+      printf("   | %-72s |\n", "Operation Latency since start, p50/p99/p99.9 (u = us, m = ms, s = sec)");
+      printf("   | %-11s %7s %10s  %-16s                         |\n", "Operation", "Ops/s", "Errors", "Latency");
+      for(k = 0; k < OP_COUNT; k++) {
+         if(0 == total.ops[k]) {
+            continue;
+         }
+         printf("   | %-11s %7llu %10llu  %-16s                         |\n", op_names[k],
+               (unsigned long long) (total.ops[k] - last.ops[k]), (unsigned long long) total.op_errors[k],
+               samfs_lat_pcts(total.op_lat[k], spct));
+      }
+      printf("   +--------------------------------------------------------------------------+\n");
+      printf("   | %-11s %7s  %-16s                                    |\n", "Server Call", "Calls/s", "Round Trip");
+      for(k = 0; k < STAT_MSGS; k++) {
+         if(0 == total.calls[k]) {
+            continue;
+         }
+         printf("   | %-11s %7llu  %-16s                                    |\n", msg_names[k],
+               (unsigned long long) (total.calls[k] - last.calls[k]), samfs_lat_pcts(total.call_lat[k], spct));
+      }
+      printf("   +--------------------------------------------------------------------------+\n");
+      printf("\n");
+      last = total;
+
+      sleep(1); /* update after every one second */
+   }
+
+   printf("masd %d serving %s has exited\n", masd_stat->pid, mount_point);
+   shmdt(masd_stat);
+
+   return SUCCESS;
+}
 
 int main(int argc, char *argv[])
 {
@@ -581,6 +4229,15 @@ int main(int argc, char *argv[])
    int digit_count;
    int is_last_char_dot;
    int mount_point;
+   int debug;
+   char *fuse_argv[5];
+   char opts[256];
+   int rv;
+
+   if(argc == 3 && strcmp(argv[1], "-status") == 0) {
+      /* dashboard of a running masd, read from its shared memory */
+      return (print_status(argv[2]) == SUCCESS)? 0: 1;
+   }
 
    if(argc < 4) {
       printf("insufficient arguments\n");
@@ -591,9 +4248,133 @@ int main(int argc, char *argv[])
    memset(SERVER_URL, 0, sizeof(SERVER_URL));
    SERVER_URL[0] = '/'; /* default url is '/' */
 
+   debug = FALSE;
+   mount_point = -1;
    for(i = 1; i < argc; i++) {
       if(strcmp(argv[i], "-d") == 0) {
-         /* do nothing */
+         /* fuse logs every operation */
+         debug = TRUE;
+      }
+      else if(strcmp(argv[i], "-lowlevel") == 0) {
+         lowlevel = TRUE;
+      }
+      else if(strcmp(argv[i], "-conns") == 0) {
+         /* max number of connections opened to server, requests share them */
+         i++;
+         if(i < argc && atoi(argv[i]) > 0) {
+            conn_pool_size = atoi(argv[i]);
+            if(conn_pool_size > CONN_POOL_MAX) {
+               conn_pool_size = CONN_POOL_MAX;
+            }
+         }
+         else {
+            printf("invalid argument for -conns\n");
+            goto invalid_arg;
+         }
+      }
+      else if(strcmp(argv[i], "-stripes") == 0) {
+         /* max connections one large read or write is spread over, 1 never splits them */
+         i++;
+         if(i < argc && atoi(argv[i]) > 0) {
+            stripe_max = atoi(argv[i]);
+            if(stripe_max > STRIPE_LIMIT) {
+               stripe_max = STRIPE_LIMIT;
+            }
+         }
+         else {
+            printf("invalid argument for -stripes\n");
+            goto invalid_arg;
+         }
+      }
+      else if(strcmp(argv[i], "-compress") == 0) {
+         /* codec data frames are compressed with, if server has it too */
+         i++;
+         if(i < argc && strcmp(argv[i], "lz4") == 0) {
+            zip_want = SAMFS_FEAT_LZ4;
+         }
+         else if(i < argc && strcmp(argv[i], "zstd") == 0) {
+            zip_want = SAMFS_FEAT_ZSTD;
+         }
+         else {
+            printf("invalid argument for -compress\n");
+            goto invalid_arg;
+         }
+         if(!(samfs_zip_features() & zip_want)) {
+            printf("%s is not built in, see Makefile\n", argv[i]);
+            goto invalid_arg;
+         }
+      }
+      else if(strcmp(argv[i], "-attr_timeout") == 0) {
+         /* seconds attributes are cached, 0 disables attribute cache */
+         i++;
+         if(i < argc && atof(argv[i]) >= 0) {
+            attr_timeout = atof(argv[i]);
+         }
+         else {
+            printf("invalid argument for -attr_timeout\n");
+            goto invalid_arg;
+         }
+      }
+      else if(strcmp(argv[i], "-neg_timeout") == 0) {
+         /* seconds failed lookups are cached, 0 disables negative entries */
+         i++;
+         if(i < argc && atof(argv[i]) >= 0) {
+            neg_timeout = atof(argv[i]);
+         }
+         else {
+            printf("invalid argument for -neg_timeout\n");
+            goto invalid_arg;
+         }
+      }
+      else if(strcmp(argv[i], "-entry_timeout") == 0) {
+         /* seconds kernel keeps lookups of names */
+         i++;
+         if(i < argc && atof(argv[i]) >= 0) {
+            entry_timeout = atof(argv[i]);
+         }
+         else {
+            printf("invalid argument for -entry_timeout\n");
+            goto invalid_arg;
+         }
+      }
+      else if(strcmp(argv[i], "-max_io") == 0) {
+         /* KB kernel may read or write with one request */
+         i++;
+         if(i < argc && atoi(argv[i]) >= 4) {
+            max_io = atoi(argv[i]) * 1024;
+         }
+         else {
+            printf("invalid argument for -max_io\n");
+            goto invalid_arg;
+         }
+      }
+      else if(strcmp(argv[i], "-no_kernel_cache") == 0) {
+         kernel_cache = FALSE;
+      }
+      else if(strcmp(argv[i], "-raw_reads") == 0) {
+         raw_reads = TRUE;
+      }
+      else if(strcmp(argv[i], "-cache_size") == 0) {
+         /* MB of file data cached, 0 disables block cache and readahead */
+         i++;
+         if(i < argc && atoi(argv[i]) >= 0) {
+            block_max = atoi(argv[i]) * (1024 * 1024 / BLOCK_SIZE);
+         }
+         else {
+            printf("invalid argument for -cache_size\n");
+            goto invalid_arg;
+         }
+      }
+      else if(strcmp(argv[i], "-writeback") == 0) {
+         /* seconds writes may be buffered before going to server, 0 writes through */
+         i++;
+         if(i < argc && atof(argv[i]) >= 0) {
+            wb_delay = atof(argv[i]);
+         }
+         else {
+            printf("invalid argument for -writeback\n");
+            goto invalid_arg;
+         }
       }
       else if(strcmp(argv[i], "-mount") == 0) {
          i++;
@@ -668,7 +4449,7 @@ int main(int argc, char *argv[])
 
             /* second argument after '-mount' is destination, i.e. mount point */
             i++;
-            if(i > argc || argv[i][0] == '-') {
+            if(i >= argc || argv[i][0] == '-') {
                /* mount point missing */
                printf("mount point missing\n");
                goto invalid_arg;
@@ -696,17 +4477,71 @@ int main(int argc, char *argv[])
          goto invalid_arg;
       }
    }
+   if(-1 == mount_point) {
+      /* '-mount' not given */
+      printf("mount point missing\n");
+      goto invalid_arg;
+   }
 
    /* TODO: check if server is available or not */
    /* TODO: check if url is valid on server or not */
 
+   /* pooled connections may be closed by server at any time,
+      a write on such connection must fail with EPIPE rather than kill us.
+    */
+   signal(SIGPIPE, SIG_IGN);
+
+   /* stripes of a transfer go on different connections */
+   if(stripe_max > conn_pool_size) {
+      stripe_max = conn_pool_size;
+   }
+   stripe_width = stripe_max;
+
+   /* statistics are shared with 'masd -status', kept private if shared memory is not available */
+   masd_stat = stat_attach(argv[mount_point], TRUE);
+   if(NULL == masd_stat) {
+      perror("shmget");
+      masd_stat = calloc(1, sizeof(struct masd_status_t));
+      if(NULL == masd_stat) {
+         return 1;
+      }
+   }
+   else {
+      memset(masd_stat, 0, sizeof(struct masd_status_t));
+   }
+   masd_stat->pid = getpid();
+   snprintf(masd_stat->mount_point, sizeof(masd_stat->mount_point), "%s", argv[mount_point]);
+   snprintf(masd_stat->server, sizeof(masd_stat->server), "%s:%s", SERVER_IP, SERVER_URL);
+
    printf("mounting %s:%s to %s\n", SERVER_IP, SERVER_URL, argv[mount_point]);
-   argv[1] = argv[mount_point];
-   argv[2] = strdup("-d"); /* do not run in daemon mode */
-   return fuse_main(3, argv, &masd_oper, NULL);
+   if(lowlevel) {
+      rv = masd_ll_main(argv[0], argv[mount_point], debug);
+      goto unmounted;
+   }
+
+   /* stay in foreground, fuse serves requests from several threads.
+      kernel sends large reads and writes and caches what our caches would answer anyway.
+    */
+   snprintf(opts, sizeof(opts), "big_writes,max_read=%u,max_write=%u,max_readahead=%u,"
+            "attr_timeout=%g,entry_timeout=%g,negative_timeout=%g%s",
+            max_io, max_io, max_io, attr_timeout, entry_timeout, neg_timeout,
+            (kernel_cache)? ",auto_cache": "");
+   fuse_argv[0] = argv[0];
+   fuse_argv[1] = argv[mount_point];
+   fuse_argv[2] = (debug)? "-d": "-f";
+   fuse_argv[3] = "-o";
+   fuse_argv[4] = opts;
+   rv = fuse_main(5, fuse_argv, &masd_oper, NULL);
+
+unmounted:
+   if(stat_shmid >= 0) {
+      shmctl(stat_shmid, IPC_RMID, NULL);
+   }
+   return rv;
 
 invalid_arg:
-   printf("USAGE: %s -mount <source_ip:dir> <mount_point>\n", argv[0]);
+   printf("USAGE: %s [-conns <n>] [-stripes <n>] [-compress <lz4|zstd>] [-attr_timeout <sec>] [-neg_timeout <sec>] [-entry_timeout <sec>] [-max_io <KB>] [-no_kernel_cache] [-raw_reads] [-cache_size <MB>] [-writeback <sec>] [-lowlevel] [-d] -mount <source_ip:dir> <mount_point>\n", argv[0]);
+   printf("       %s -status <mount_point>\n", argv[0]);
    return 0;
 }
 
@@ -1,447 +1,1389 @@
+#define _GNU_SOURCE        /* accept4() */
+
 #include <sys/ipc.h>
 #include <sys/shm.h>
 
 #include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>      /* mmap() */
+#include <sched.h>         /* sched_yield() */
 #include <sys/time.h>
+#include <sys/resource.h>  /* getrlimit() */
 #include <sys/types.h>
 #include <unistd.h>
 
 #include <pthread.h>
 #include <semaphore.h>
+#include <signal.h>
+#include <netinet/tcp.h>   /* TCP_NODELAY */
+#include <sys/un.h>        /* struct sockaddr_un */
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define SAM_HAVE_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#endif
 
 #include "samfs_common.h"
 
-static char    SRCPATH[URL_LEN];
+static char    SRCPATH[PATH_MAX];
 static fd_set  select_fds; /* this fd set stores fds of client connected using select */
 static fd_set  thread_fds; /* this fd set stores fds of client connected using select,
                               used by child process to close non-required, while using fork.
                             */
+static struct client_stat_t *select_clients[FD_SETSIZE]; /* byte counters of select clients, by fd */
+static uint64_t select_trace_ids[FD_SETSIZE]; /* trace numbers of select clients, by fd */
 
 /* different types of concurrency method used by this server */
 enum {
    SAM_PTHREAD,
    SAM_FORK,
    SAM_SELECT,
+   SAM_EPOLL,
+   SAM_POOL,
+   SAM_URING,
    SAM_UNDEFINED
 };
 
+/* names of concurrency methods, as used by '-cmethod' */
+static const char *conc_method_names[SAM_UNDEFINED] = {
+   "pthread",
+   "fork",
+   "select",
+   "epoll",
+   "pool",
+   "uring",
+};
+
+/* engines run their own event loops and can only be chosen when server starts */
+#define IS_ENGINE(method)  ((method) >= SAM_EPOLL && (method) < SAM_UNDEFINED)
+
+#define EPOLL_EVENTS      64          /* max events handled per epoll_wait() */
+
+#define SENDFILE_MIN      (16 * 1024) /* smaller reads are cheaper to copy and send with one writev() */
+
+#define HANDLE_MAX        1024        /* max files kept open for clients (at most 1/4 of fd limit),
+                                         least recently used is evicted */
+
+#define FD_CACHE_MAX      1024        /* max descriptors cached by path (at most 1/4 of fd limit) */
+#define FD_CACHE_SHARDS   16          /* power of 2, each shard has its own lock and LRU list */
+#define FD_CACHE_BUCKETS  256         /* hash buckets of each shard */
+
+#define POOL_QUEUE_SIZE   65536       /* power of 2, max connections waiting for a worker */
+#define POOL_STACK_SIZE   (256 * 1024)
+
+#define URING_ENTRIES     256         /* submission entries of each ring */
+#define URING_FILES       1024        /* registered socket slots of each ring */
+#define URING_BUFS        16          /* registered file read buffers of each ring */
+#define URING_BUF_SIZE    (256 * 1024)
+
+static int     engine_threads;   /* number of event loop threads of engine, '-threads' */
+static int     server_running;   /* TRUE if shared memory belongs to an already running server */
+
+/* statistics live in shared memory, 'samd -status' reads them from another process.
+   byte counters are kept apart for each serving thread (or forked child), in slots of
+   their own cache line, so that counting is one uncontended atomic add. reader sums
+   slots up, rates are differences between two readings.
+   every served request also counts in latency histograms of its msg_type_t (see
+   samfs_lat_bucket()), one for each part of its time: waiting to be served, working
+   on file system and sending.
+ */
+#define STAT_SLOTS        128         /* last one is shared by threads finding no free slot */
+#define STAT_MSGS         (READDIRPLUS + 1)
+
+enum {
+   LAT_QUEUE,     /* from request received till its serving started */
+   LAT_FS,        /* serving it, without sending */
+   LAT_SEND,      /* sending its responses (queueing them, for event driven engines) */
+   LAT_PHASES
+};
+
+#define STAT_ADD(counter, n)  __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+#define STAT_SUB(counter, n)  __atomic_fetch_sub(&(counter), (n), __ATOMIC_RELAXED)
+#define STAT_GET(counter)     __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+struct stat_slot_t {
+   int            busy;                   /* claimed by a thread, counters stay when it ends */
+   uint64_t       bytes_rcvd;             /* total number of bytes received */
+   uint64_t       bytes_sent;             /* total number of bytes sent */
+   uint64_t       zip_raw;                /* bytes of data offered to compression, or unpacked */
+   uint64_t       zip_wire;               /* bytes they took on the wire */
+   uint64_t       zip_cpu_ns;             /* cpu spent packing and unpacking them */
+   uint64_t       fd_hits;                /* lookups served from fd cache */
+   uint64_t       fd_misses;              /* lookups that had to open or stat path */
+   uint64_t       ops[STAT_MSGS];         /* requests served, by msg_type_t */
+   uint64_t       lat_ns[STAT_MSGS][LAT_PHASES];            /* their total time of each phase */
+   uint32_t       lat[STAT_MSGS][LAT_PHASES][SAMFS_LAT_BUCKETS];  /* and latency histograms */
+} __attribute__((aligned(64)));
+
+/* bytes moved for one client address. entries are claimed when a connection is set up
+   and never given back, so counters only grow, as metrics scrapers expect.
+ */
+#define CLIENT_SLOTS      1024        /* clients beyond this many are not counted on their own */
+
+struct client_stat_t {
+   uint32_t       addr;                   /* IPv4 address, network order, 0 if slot is free */
+   uint64_t       bytes_rcvd;
+   uint64_t       bytes_sent;
+} __attribute__((aligned(64)));
+
 /* structure to maintain statistics and status */
 struct sam_status_t {
-   sem_t          mutex;                  /* mutex to protect updation of variables below variables */
-   char           server_name[URL_LEN];   /* name of server binary */
+   char           server_name[80];        /* name of server binary */
    char           server_ip[32];          /* ip on which server is running */
-   char           server_dir[URL_LEN];    /* source directory which is exported by server */
+   char           server_dir[PATH_MAX];   /* source directory which is exported by server */
    int            server_pid;             /* pid of server process */
    unsigned int   conc_method;            /* type of concurrency method being applied */
    unsigned int   select_count;           /* number of clients connected using select */
    unsigned int   thread_count;           /* number of clients connected using pthread */
    unsigned int   forked_count;           /* number of clients connected using fork */
-   unsigned int   bytes_rcvd;             /* total number of bytes received */
-   unsigned int   bytes_sent;             /* total number of bytes sent */
-   unsigned int   uplink_rate;            /* uplink data rate */
-   unsigned int   dnlink_rate;            /* downlink data rate */
-   unsigned int   uplink_avg;             /* average uplink data rate */
-   unsigned int   dnlink_avg;             /* average downlink data rate */
+   unsigned int   epoll_count;            /* number of clients connected using epoll */
+   unsigned int   pool_count;             /* number of clients connected using worker pool */
+   unsigned int   uring_count;            /* number of clients connected using io_uring */
+   struct stat_slot_t slots[STAT_SLOTS];
+   struct client_stat_t clients[CLIENT_SLOTS];
 } *sam_stat;
 
-static int read_req(int sock_fd, struct req_t *req)
-{
-   int rv;
-   int magic;
+static pthread_key_t    stat_key;         /* slot of calling thread */
+static pthread_once_t   stat_once = PTHREAD_ONCE_INIT;
+
+/* request trace, '-trace <file>'. every served request is written to the ring of its
+   stat slot: claiming a record is one atomic add on a ring head that only its own thread
+   uses (but for the shared last slot), so serving threads never wait for each other.
+   file is mapped shared, page cache writes it out and it stays whole if server dies.
+ */
+#define TRACE_RING_MB     4           /* default size of each ring, '-trace_size' */
+
+static char                *trace_map;      /* mapped trace file, NULL if not tracing */
+static struct trace_ring_t *trace_rings;
+static struct trace_rec_t  *trace_recs;
+static uint64_t            trace_ring_recs; /* records of each ring, power of 2 */
+static uint32_t            trace_conns;     /* connections numbered by this process */
+
+/* names of requests in statistics, by msg_type_t */
+static const char *msg_names[STAT_MSGS] = {
+   "unknown",
+   "getattr",
+   "access",
+   "mkdir",
+   "opendir",
+   "readdir",
+   "releasedir",
+   "rmdir",
+   "create",
+   "open",
+   "read",
+   "write",
+   "truncate",
+   "release",
+   "unlink",
+   "rename",
+   "chmod",
+   "utime",
+   "statfs",
+   "hello",
+   "readdirplus",
+};
 
-   rv = read(sock_fd, req, sizeof(struct req_t));
-   magic = req->magic;
-   write(sock_fd, &magic, sizeof(magic));
-   
-   sem_wait(&sam_stat->mutex);
-   sam_stat->bytes_rcvd += rv;
-   sam_stat->dnlink_rate += rv;
-   sem_post(&sam_stat->mutex);
+/* names of latency phases in statistics */
+static const char *phase_names[LAT_PHASES] = {
+   "queue",
+   "fs",
+   "send",
+};
 
-   return rv;
-}
+/* cell of work queue */
+struct work_cell_t {
+   unsigned long  seq;        /* lap number telling if cell is free or holds data */
+   void           *data;
+};
+
+/* lock free queue used to hand ready connections to pool workers */
+struct work_queue_t {
+   struct work_cell_t   *cells;
+   unsigned long        mask;                               /* size - 1, size is power of 2 */
+   unsigned long        head __attribute__((aligned(64)));  /* next cell to fill, producers */
+   unsigned long        tail __attribute__((aligned(64)));  /* next cell to consume, workers */
+   sem_t                items;                              /* number of queued items */
+};
+
+static struct work_queue_t pool_queue;      /* connections waiting for a pool worker */
+static int                 pool_epoll_fd;   /* epoll set of pool dispatcher */
+
+/* file kept open for client between OPEN and RELEASE.
+   handle given to client is slot number and generation of slot.
+ */
+struct handle_t {
+   int            fd;         /* -1 if slot is free */
+   uint32_t       gen;        /* bumped when slot is freed, stale handles do not match */
+   int            refs;       /* requests using fd right now */
+   int            closing;    /* released while in use, last user frees slot */
+   int            prev;       /* LRU list of open slots (most recently used first), */
+   int            next;       /* next is also link of free list */
+};
+
+static struct handle_t  handles[HANDLE_MAX];
+static int              handle_free;      /* first free slot, -1 if none */
+static int              handle_lru_head;
+static int              handle_lru_tail;
+static pthread_mutex_t  handle_lock = PTHREAD_MUTEX_INITIALIZER;
+static int              handles_off;      /* TRUE in forked child, its handles would clash with siblings' */
+
+/* file or directory kept open by path, so that requests going by path
+   do not pay for open() and path lookup every time.
+ */
+struct fd_entry_t {
+   struct fd_entry_t *hnext;     /* next entry in hash bucket */
+   struct fd_entry_t *prev;      /* LRU list of shard (most recently used first) */
+   struct fd_entry_t *next;
+   uint32_t          hash;
+   int               fd;
+   int               accmode;    /* O_RDONLY, O_WRONLY or O_RDWR */
+   int               refs;       /* requests using fd right now */
+   int               stale;      /* dropped from cache while in use, last user closes it */
+   char              path[];
+};
 
-static int send_rsp(int sock_fd, struct rsp_t *rsp)
+struct fd_shard_t {
+   pthread_mutex_t   lock;
+   struct fd_entry_t *buckets[FD_CACHE_BUCKETS];
+   struct fd_entry_t *lru_head;
+   struct fd_entry_t *lru_tail;
+   int               count;
+} __attribute__((aligned(64)));
+
+#define FD_SHARD(hash)     (&fd_cache[(hash) & (FD_CACHE_SHARDS - 1)])
+#define FD_BUCKET(hash)    (((hash) / FD_CACHE_SHARDS) % FD_CACHE_BUCKETS)
+
+static struct fd_shard_t   fd_cache[FD_CACHE_SHARDS];
+static int                 fd_cache_limit;   /* max entries of each shard, 0 if cache is off */
+
+/* descriptor used by a request and where it comes from, see open_req_file() */
+struct file_ref_t {
+   int               slot;       /* handle slot, -1 if file is not client's handle */
+   struct fd_entry_t *ent;       /* fd cache entry, NULL if file was opened for this request only */
+};
+
+/* state of one client connection */
+struct conn_t {
+   int            fd;         /* socket connected to client */
+   int            nonblock;   /* TRUE if socket is non-blocking and responses are queued in tx buffer */
+   struct req_t   req;        /* request being served, its receive buffer is reused across requests */
+   char           *rx_buf;    /* received bytes, used by event driven engines */
+   size_t         rx_size;    /* allocated size of rx_buf */
+   size_t         rx_len;     /* number of bytes in rx_buf */
+   size_t         rx_pos;     /* number of bytes of rx_buf already served */
+   char           *tx_buf;    /* queued response bytes, used by event driven engines */
+   size_t         tx_size;    /* allocated size of tx_buf */
+   size_t         tx_len;     /* number of bytes in tx_buf */
+   size_t         tx_pos;     /* number of bytes of tx_buf already sent */
+   int            tx_file_fd; /* file whose data is sent after tx_buf, by event driven engines */
+   struct file_ref_t tx_file_ref; /* where tx_file_fd comes from */
+   off_t          tx_file_off;
+   size_t         tx_file_len; /* bytes of tx_file_fd still to be sent in current frame, 0 if none */
+   size_t         tx_file_rest; /* bytes of tx_file_fd going in later frames of response */
+   uint16_t       tx_file_msg; /* request of streamed response, its later frames carry it */
+   uint64_t       tx_file_id;
+   int            tx_read;    /* TRUE if tx_file_rest bytes of conn->req are read into tx_buf frame by frame */
+   int            tx_read_codec; /* compression of those frames, 0 if none */
+   int            pipe_fds[2]; /* used to splice bulk writes, by blocking engines */
+   int            tee_fds[2]; /* bulk data passes here on its way in, its copy is read for checksum */
+   size_t         pipe_size;  /* capacity of pipe_fds, bulk data up to it is checked before it is written */
+   int            shared;     /* TRUE if several workers serve requests of connection at once */
+   int            refs;       /* workers holding shared connection, it is closed by last one */
+   pthread_mutex_t tx_lock;   /* keeps frames of shared connection whole on socket */
+   uint64_t       rx_ns;      /* when bytes were last received, or found waiting by pool dispatcher */
+   struct client_stat_t *client; /* byte counters of client address, NULL if not counted */
+   uint64_t       trace_id;   /* number of connection in request trace, 0 till its first traced request */
+};
+
+#ifdef SAM_HAVE_URING
+/* kind of operation, kept in low bits of completion user data next to connection pointer */
+enum {
+   URING_ACCEPT,
+   URING_RECV,
+   URING_SEND,
+   URING_FILE,
+};
+#define URING_KIND_MASK    3
+#define URING_ACCEPT_WAIT  ((uint64_t) URING_KIND_MASK + 1) /* accept backoff timer, has no connection */
+#define URING_ACCEPT_MS    100         /* accept backoff while process is out of descriptors */
+
+/* one ring of io_uring engine, owned by one thread */
+struct uring_t {
+   int                  fd;
+   unsigned             *sq_head;
+   unsigned             *sq_tail;
+   unsigned             sq_mask;
+   unsigned             sq_entries;
+   struct io_uring_sqe  *sqes;
+   unsigned             *cq_head;
+   unsigned             *cq_tail;
+   unsigned             cq_mask;
+   struct io_uring_cqe  *cqes;
+   unsigned             to_submit;                 /* entries queued since last io_uring_enter() */
+   int                  server_fd;
+   struct __kernel_timespec accept_wait;           /* timeout of accept backoff, read by kernel */
+   int                  fixed_files;               /* TRUE if sockets are registered with ring */
+   int                  free_slots[URING_FILES];   /* unused slots of registered file table */
+   int                  nfree_slots;
+   char                 *bufs;                     /* URING_BUFS buffers for file reads */
+   int                  fixed_bufs;                /* TRUE if bufs are registered with ring */
+   int                  free_bufs[URING_BUFS];
+   int                  nfree_bufs;
+};
+
+/* connection served by io_uring engine */
+struct uring_conn_t {
+   struct conn_t  conn;        /* handlers get pointer to this */
+   int            slot;        /* slot in registered file table, -1 if socket is used directly */
+   int            inflight;    /* submitted operations not completed yet */
+   int            recv_busy;
+   int            send_busy;
+   int            closing;
+   int            file_op;     /* READ or WRITE in progress through ring, 0 if none */
+   int            file_fd;
+   struct file_ref_t file_ref; /* where file_fd comes from */
+   int            file_ready;  /* chunk of file operation completed, its result is in file_res */
+   int            file_res;
+   int            buf;         /* index of read buffer, -1 if none */
+   size_t         file_len;    /* bytes asked in last chunk */
+   size_t         file_done;   /* bytes transferred so far */
+};
+#endif /* SAM_HAVE_URING */
+
+/* a thread that ends gives its slot back, counters stay in it for next owner */
+static void stat_slot_release(void *data)
 {
-   int rv;
-   int magic;
+   struct stat_slot_t *slot;
 
-   magic = 0;
-   rsp->magic = rand();
-   rv = write(sock_fd, rsp, sizeof(struct rsp_t));
-   read(sock_fd, &magic, sizeof(magic));
-   if(rsp->magic != magic) {
-      printf("ERROR IN WRITE: INVALID MAGIC\n");
+   slot = data;
+   if(slot != &sam_stat->slots[STAT_SLOTS - 1]) {
+      __atomic_store_n(&slot->busy, FALSE, __ATOMIC_RELEASE);
    }
-   
-   sem_wait(&sam_stat->mutex);
-   sam_stat->bytes_sent += rv;
-   sam_stat->uplink_rate += rv;
-   sem_post(&sam_stat->mutex);
-   
-   return rv;
 }
 
-static int handle_getattr(int client_fd, struct req_t *req)
+static void stat_key_init(void)
 {
-   int            rv;
-   char           local_path[URI_LEN];
-   struct stat    st;
-   struct rsp_t   rsp;
-
-   sprintf(local_path, "%s%s%s", SRCPATH, req->url, req->uri);
+   pthread_key_create(&stat_key, stat_slot_release);
+}
 
-   rv = lstat(local_path, &st);
-   if(0 == rv) {
-      rsp.status = SUCCESS;
-      memcpy(&rsp.data, &st, sizeof(struct stat));
+/* counters of calling thread, a free slot is claimed on first use */
+static struct stat_slot_t *stat_slot(void)
+{
+   struct stat_slot_t   *slot;
+   int                  busy;
+   int                  i;
+
+   pthread_once(&stat_once, stat_key_init);
+   slot = pthread_getspecific(stat_key);
+   if(slot) {
+      return slot;
    }
-   else {
-      rsp.status = FAIL;
-      rsp.errcode = errno;
+
+   for(i = 0; i < STAT_SLOTS - 1; i++) {
+      busy = FALSE;
+      if(!STAT_GET(sam_stat->slots[i].busy) &&
+            __atomic_compare_exchange_n(&sam_stat->slots[i].busy, &busy, TRUE, FALSE, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+         break;
+      }
    }
-   rsp.endofdata = TRUE;
+   slot = &sam_stat->slots[i];
+   pthread_setspecific(stat_key, slot);
 
-   send_rsp(client_fd, &rsp);
+   return slot;
+}
 
-   return 0;
+/* forked child counts in a slot of its own, not in the one of its parent thread */
+static void stat_slot_forget(void)
+{
+   pthread_once(&stat_once, stat_key_init);
+   pthread_setspecific(stat_key, NULL);
 }
 
-static int handle_mkdir(int client_fd, struct req_t *req)
+/* counts served request 'req' in histograms of its msg_type_t, 'end' is when it was done */
+static void lat_stat(struct req_t *req, uint64_t end)
 {
-   int            rv;
-   char           local_path[URI_LEN];
-   struct rsp_t   rsp;
+   struct stat_slot_t   *slot;
+   uint64_t             busy;
+   int                  msg;
+
+   msg = (req->msg > UNKNOWN && req->msg < STAT_MSGS)? req->msg: UNKNOWN;
+   busy = end - req->start_ns;
+   slot = stat_slot();
+   STAT_ADD(slot->ops[msg], 1);
+   STAT_ADD(slot->lat_ns[msg][LAT_QUEUE], (req->start_ns > req->rcvd_ns)? req->start_ns - req->rcvd_ns: 0);
+   STAT_ADD(slot->lat_ns[msg][LAT_FS], (busy > req->send_ns)? busy - req->send_ns: 0);
+   STAT_ADD(slot->lat_ns[msg][LAT_SEND], req->send_ns);
+   STAT_ADD(slot->lat[msg][LAT_QUEUE][samfs_lat_bucket((req->start_ns > req->rcvd_ns)? req->start_ns - req->rcvd_ns: 0)], 1);
+   STAT_ADD(slot->lat[msg][LAT_FS][samfs_lat_bucket((busy > req->send_ns)? busy - req->send_ns: 0)], 1);
+   STAT_ADD(slot->lat[msg][LAT_SEND][samfs_lat_bucket(req->send_ns)], 1);
+}
 
-   sprintf(local_path, "%s%s%s", SRCPATH, req->url, req->uri);
+/* creates trace file 'path' with a ring of about 'ring_mb' MB for every stat slot and maps it */
+static int trace_open(const char *path, int ring_mb)
+{
+   struct trace_hdr_t   *hdr;
+   struct timespec      ts;
+   size_t               size;
+   int                  fd;
+
+   trace_ring_recs = 1;
+   while(trace_ring_recs * 2 * sizeof(struct trace_rec_t) <= (uint64_t) ring_mb * 1024 * 1024) {
+      trace_ring_recs *= 2;
+   }
+   size = sizeof(struct trace_hdr_t) + STAT_SLOTS * sizeof(struct trace_ring_t) +
+          STAT_SLOTS * trace_ring_recs * sizeof(struct trace_rec_t);
 
-   rv = mkdir(local_path, req->mode);
-   if(0 == rv) {
-      rsp.status = SUCCESS;
+   fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+   if(fd < 0) {
+      return FAIL;
    }
-   else {
-      rsp.status = FAIL;
-      rsp.errcode = errno;
+   /* file stays sparse, rings of slots that never serve take no disk space */
+   if(ftruncate(fd, size) < 0) {
+      close(fd);
+      return FAIL;
+   }
+   trace_map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   if(MAP_FAILED == trace_map) {
+      trace_map = NULL;
+      return FAIL;
    }
-   rsp.endofdata = TRUE;
 
-   send_rsp(client_fd, &rsp);
+   hdr = (struct trace_hdr_t *) trace_map;
+   hdr->version = SAMFS_TRACE_VERSION;
+   hdr->rec_size = sizeof(struct trace_rec_t);
+   hdr->rings = STAT_SLOTS;
+   hdr->ring_recs = trace_ring_recs;
+   hdr->start_ns = samfs_now_ns();
+   clock_gettime(CLOCK_REALTIME, &ts);
+   hdr->start_real_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+   trace_rings = (struct trace_ring_t *) (trace_map + sizeof(struct trace_hdr_t));
+   trace_recs = (struct trace_rec_t *) (trace_rings + STAT_SLOTS);
+
+   /* magic goes last, file is complete once it has it */
+   __atomic_store_n(&hdr->magic, SAMFS_TRACE_MAGIC, __ATOMIC_RELEASE);
+
+   return SUCCESS;
+}
 
-   return 0;
+/* number of 'conn' in trace, taken on its first traced request.
+   workers serving a shared connection at once agree on it by CAS.
+ */
+static uint64_t trace_conn_id(struct conn_t *conn)
+{
+   uint64_t id;
+   uint64_t none;
+
+   id = __atomic_load_n(&conn->trace_id, __ATOMIC_RELAXED);
+   if(0 == id) {
+      /* pid keeps connections of forked children apart */
+      id = ((uint64_t) getpid() << 32) | __atomic_add_fetch(&trace_conns, 1, __ATOMIC_RELAXED);
+      none = 0;
+      if(!__atomic_compare_exchange_n(&conn->trace_id, &none, id, FALSE, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+         id = none;
+      }
+   }
+
+   return id;
 }
 
-static int handle_readdir(int client_fd, struct req_t *req)
+/* writes served request 'req' of 'conn' to trace, 'end' is when it was done */
+static void trace_req(struct conn_t *conn, struct req_t *req, uint64_t end)
 {
-   int            rv;
-   char           local_path[URI_LEN];
-   struct rsp_t   rsp;
-   DIR            *dirp;
-   struct dirent  dent;
-   struct dirent  *next_dent;
+   struct trace_rec_t   *rec;
+   uint64_t             ring;
+   uint64_t             seq;
+   uint64_t             queue;
 
-   sprintf(local_path, "%s%s%s", SRCPATH, req->url, req->uri);
+   if(NULL == trace_map) {
+      return;
+   }
 
-   dirp = opendir(local_path);
-   if(NULL == dirp) {
-      rsp.status = FAIL;
-      rsp.errcode = ENOENT;
-      rsp.endofdata = TRUE;
-      send_rsp(client_fd, &rsp);
-      return 0;
+   ring = stat_slot() - sam_stat->slots;
+   seq = __atomic_fetch_add(&trace_rings[ring].head, 1, __ATOMIC_RELAXED);
+   rec = &trace_recs[ring * trace_ring_recs + (seq & (trace_ring_recs - 1))];
+
+   /* reader takes a record only if its seq is same before and after copying it */
+   __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+   __atomic_thread_fence(__ATOMIC_RELEASE);
+
+   queue = (req->start_ns > req->rcvd_ns)? req->start_ns - req->rcvd_ns: 0;
+   rec->conn = trace_conn_id(conn);
+   rec->rcvd_ns = req->rcvd_ns;
+   rec->dur_ns = (end > req->rcvd_ns)? end - req->rcvd_ns: 0;
+   rec->queue_ns = (queue < UINT32_MAX)? queue: UINT32_MAX;
+   rec->path = samfs_hash(samfs_hash(SAMFS_HASH_INIT, req->url), req->uri);
+   rec->npath = (req->npath[0])? samfs_hash(samfs_hash(SAMFS_HASH_INIT, req->url), req->npath): 0;
+   rec->offset = req->offset;
+   rec->size = req->size;
+   rec->mode = req->mode;
+   rec->flags = req->flags;
+   rec->errcode = req->errcode;
+   rec->msg = req->msg;
+   rec->opts = req->opts;
+
+   __atomic_store_n(&rec->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/* counters of peer address of connected socket 'fd', NULL if there is no room for it.
+   slot is claimed by CAS, lookups of other threads never wait.
+ */
+static struct client_stat_t *client_stat(int fd)
+{
+   struct sockaddr_in   addr;
+   socklen_t            len;
+   struct client_stat_t *client;
+   uint32_t             free_addr;
+   uint32_t             h;
+   int                  i;
+
+   len = sizeof(addr);
+   if(getpeername(fd, (struct sockaddr *) &addr, &len) < 0 || addr.sin_family != AF_INET ||
+         0 == addr.sin_addr.s_addr) {
+      return NULL;
    }
 
-   do {
-      rv = readdir_r(dirp, &dent, &next_dent);
-      if(rv != 0) {
-         rsp.status = FAIL;
-         rsp.endofdata = TRUE;
-         rsp.errcode = rv;
+   h = addr.sin_addr.s_addr * 2654435761u;
+   for(i = 0; i < CLIENT_SLOTS; i++) {
+      client = &sam_stat->clients[(h + i) % CLIENT_SLOTS];
+      free_addr = 0;
+      if(STAT_GET(client->addr) == addr.sin_addr.s_addr ||
+            __atomic_compare_exchange_n(&client->addr, &free_addr, addr.sin_addr.s_addr, FALSE,
+               __ATOMIC_RELAXED, __ATOMIC_RELAXED) ||
+            free_addr == addr.sin_addr.s_addr) {
+         return client;
       }
-      else if(next_dent) {
-         memcpy(&rsp.data, &dent, sizeof(struct dirent));
-         rsp.status = SUCCESS;
-         rsp.endofdata = (next_dent)? FALSE: TRUE;
-      }
-      else {
-         rsp.status = FAIL;
-         rsp.endofdata = TRUE;
-         rsp.errcode = 0;
-      }
-      send_rsp(client_fd, &rsp);
-   } while(next_dent);
-
-   closedir(dirp);
+   }
 
-   return 0;
+   return NULL;
 }
 
-static int handle_rmdir(int client_fd, struct req_t *req)
+/* decode string of 'len' bytes (including NUL) at 'p', returns NULL if it is malformed */
+static char *decode_str(char **p, char *end, uint16_t len)
 {
-   int            rv;
-   char           local_path[URI_LEN];
-   struct rsp_t   rsp;
-
-   sprintf(local_path, "%s%s%s", SRCPATH, req->url, req->uri);
+   char *str;
 
-   rv = rmdir(local_path);
-   if(0 == rv) {
-      rsp.status = SUCCESS;
+   if(0 == len) {
+      return "";
    }
-   else {
-      rsp.status = FAIL;
-      rsp.errcode = errno;
+   if(len > PATH_MAX || len > end - *p || (*p)[len - 1] != '\0') {
+      return NULL;
    }
-   rsp.endofdata = TRUE;
+   str = *p;
+   *p += len;
 
-   send_rsp(client_fd, &rsp);
-
-   return 0;
+   return str;
 }
 
-static int handle_create(int client_fd, struct req_t *req)
+/* verify checksum of frame 'hdr' whose payload is at 'payload' and decode request out of it.
+   request fields point into payload, returns -1 if frame is corrupted or malformed.
+ */
+static int decode_req(struct req_t *req, struct frame_hdr_t *hdr, char *payload)
 {
-   int            fd;
-   char           local_path[URI_LEN];
-   struct rsp_t   rsp;
-
-   sprintf(local_path, "%s%s%s", SRCPATH, req->url, req->uri);
-
-   fd = open(local_path, req->flags | O_WRONLY | O_CREAT);
-   if(-1 == fd) {
-      rsp.status = FAIL;
-      rsp.errcode = errno;
+   struct req_hdr_t     rhdr;
+   struct iovec         iov[2];
+   uint32_t             csum;
+   char                 *p;
+   char                 *end;
+   int                  len;
+
+   csum = hdr->csum;
+   hdr->csum = 0;
+   iov[0].iov_base = hdr;
+   iov[0].iov_len = sizeof(struct frame_hdr_t);
+   iov[1].iov_base = payload;
+   iov[1].iov_len = hdr->len;
+   if(csum != samfs_csum_iov(iov, 2)) {
+      printf("ERROR IN READ: CHECKSUM MISMATCH\n");
+      return -1;
    }
-   else {
-      close(fd);
-      chmod(local_path, req->mode);
-      rsp.status = SUCCESS;
+
+   memcpy(&rhdr, payload, sizeof(rhdr));
+   p = payload + sizeof(rhdr);
+   end = payload + hdr->len;
+   req->id = hdr->id;
+   req->msg = hdr->msg;
+   req->mode = rhdr.mode;
+   req->flags = rhdr.flags;
+   req->size = rhdr.size;
+   req->offset = rhdr.offset;
+   req->opts = rhdr.opts;
+   req->fh = rhdr.fh;
+   req->zip = hdr->flags & FRAME_ZIP;
+   req->url = decode_str(&p, end, rhdr.url_len);
+   req->uri = decode_str(&p, end, rhdr.uri_len);
+   req->npath = decode_str(&p, end, rhdr.npath_len);
+   if(NULL == req->url || NULL == req->uri || NULL == req->npath) {
+      printf("ERROR IN READ: MALFORMED REQUEST\n");
+      return -1;
    }
-   rsp.endofdata = TRUE;
+   req->data = p;
+   req->data_len = end - p;
 
-   send_rsp(client_fd, &rsp);
+   len = sizeof(struct frame_hdr_t) + hdr->len;
+   STAT_ADD(stat_slot()->bytes_rcvd, len);
 
-   return 0;
+   return len;
 }
 
-static int handle_read(int client_fd, struct req_t *req)
+/* returns TRUE if 'hdr' can start a request frame */
+static int is_valid_hdr(struct frame_hdr_t *hdr)
 {
-   int            rv;
-   char           local_path[URI_LEN];
-   struct rsp_t   rsp;
-   int            fd;
-   int            read_size;
-   int            total_read;
+   if(hdr->magic != SAMFS_MAGIC || hdr->len < sizeof(struct req_hdr_t) || hdr->len > SAMFS_MAX_FRAME) {
+      printf("ERROR IN READ: INVALID FRAME HEADER\n");
+      return FALSE;
+   }
 
-   sprintf(local_path, "%s%s%s", SRCPATH, req->url, req->uri);
+   return TRUE;
+}
 
-   fd = open(local_path, O_RDONLY);
-   if(-1 == fd) {
-      rsp.status = FAIL;
-      rsp.errcode = errno;
-      rsp.endofdata = TRUE;
-      send_rsp(client_fd, &rsp);
-      return 0;
+/* blocking read of next request on connection.
+   returns size of request read, or <= 0 if client has closed the connection
+   or sent a corrupted frame.
+ */
+static int read_req(struct conn_t *conn, struct req_t *req)
+{
+   int                  rv;
+   struct frame_hdr_t   hdr;
+
+   rv = samfs_read_full(conn->fd, &hdr, sizeof(hdr));
+   if(rv <= 0) {
+      return rv;
+   }
+   if(!is_valid_hdr(&hdr)) {
+      return -1;
    }
 
-   if(req->offset) {
-      rv = lseek(fd, req->offset, SEEK_SET);
-      if(-1 == rv) {
-         rsp.status = FAIL;
-         rsp.errcode = errno;
-         rsp.endofdata = TRUE;
-         send_rsp(client_fd, &rsp);
-         return 0;
+   /* grow receive buffer if this frame does not fit, buffer is kept for next requests */
+   if(req->buf_size < hdr.len) {
+      free(req->buf);
+      req->buf = malloc(hdr.len);
+      if(NULL == req->buf) {
+         req->buf_size = 0;
+         return -1;
       }
+      req->buf_size = hdr.len;
    }
 
-   /* read minimum of 'buffer size' and 'requested size' */
-   read_size = (sizeof(rsp.data) < req->size)? sizeof(rsp.data): req->size;
-   total_read = 0;
-   do {
-      rv = read(fd, &rsp.data, read_size);
-      total_read += rv;
-      if(rv < 0) {
-         /* error has occured while reading from file */
-         rsp.status = FAIL;
-         rsp.endofdata = TRUE;
-         rsp.errcode = errno;
-         read_size = 0; /* nothing to read, break the loop */
-      }
-      else if(rv < read_size) {
-         /* we have reached end of file */
-         rsp.status = SUCCESS;
-         rsp.endofdata = TRUE;
-         rsp.size = rv;
-         read_size = 0; /* nothing to read, break the loop */
-      }
-      else if(total_read == req->size) {
-         /* read requested size of data */
-         rsp.status = SUCCESS;
-         rsp.endofdata = TRUE;
-         rsp.size = rv;
-         read_size = 0; /* nothing to read, break the loop */
-      }
-      else {
-         rsp.status = SUCCESS;
-         rsp.endofdata = FALSE;
-         rsp.size = rv;
-         /* read minimum of 'buffer size' and 'remaining requested size' */
-         read_size = (sizeof(rsp.data) < (req->size - total_read))? sizeof(rsp.data): (req->size - total_read);
-      }
-      send_rsp(client_fd, &rsp);
-   } while(read_size);
+   rv = samfs_read_full(conn->fd, req->buf, hdr.len);
+   if(rv <= 0) {
+      return rv;
+   }
+   req->rcvd_ns = samfs_now_ns();
 
-   close(fd);
+   rv = decode_req(req, &hdr, req->buf);
+   if(rv > 0 && conn->client) {
+      STAT_ADD(conn->client->bytes_rcvd, rv);
+   }
 
-   return 0;
+   return rv;
 }
 
-static int handle_write(int client_fd, struct req_t *req)
+/* append bytes of 'iov' to transmit buffer of connection, flushed later by event loop */
+static int queue_tx(struct conn_t *conn, struct iovec *iov, int iovcnt)
 {
-   int            rv;
-   char           local_path[URI_LEN];
-   struct rsp_t   rsp;
-   int            fd;
-   struct req_t   dreq;
-   int            total_write;
-
-   sprintf(local_path, "%s%s%s", SRCPATH, req->url, req->uri);
-
-   fd = open(local_path, O_WRONLY);
-   if(-1 == fd) {
-      rsp.status = FAIL;
-      rsp.errcode = errno;
-      rsp.endofdata = TRUE;
-      send_rsp(client_fd, &rsp);
-      return 0;
+   size_t   len;
+   size_t   size;
+   char     *buf;
+   int      i;
+
+   len = 0;
+   for(i = 0; i < iovcnt; i++) {
+      len += iov[i].iov_len;
    }
 
-   if(req->offset) {
-      rv = lseek(fd, req->offset, SEEK_SET);
-      if(-1 == rv) {
-         rsp.status = FAIL;
-         rsp.errcode = errno;
-         rsp.endofdata = TRUE;
-         send_rsp(client_fd, &rsp);
-         return 0;
-      }
+   /* drop already sent bytes before growing buffer */
+   if(conn->tx_pos == conn->tx_len) {
+      conn->tx_pos = conn->tx_len = 0;
    }
- 
-   /* send rsp just to tell server is ready to recv file data */
-   rsp.status = SUCCESS;
-   send_rsp(client_fd, &rsp);
-
-   /* recv data from client */
-   total_write = 0;
-   rv = 0;
-   do {
-      read_req(client_fd, &dreq);
-      if(rv >= 0) {
-         rv = write(fd, &dreq.data, dreq.size);
-         if(rv < 0) {
-            rsp.status = FAIL;
-            rsp.errcode = errno;
-            rsp.endofdata = TRUE;
-         }
-         else {
-            total_write += rv;
-            rsp.status = SUCCESS;
-            rsp.endofdata = TRUE;
-            rsp.size = total_write;
+   if(conn->tx_len + len > conn->tx_size) {
+      if(conn->tx_pos) {
+         memmove(conn->tx_buf, conn->tx_buf + conn->tx_pos, conn->tx_len - conn->tx_pos);
+         conn->tx_len -= conn->tx_pos;
+         conn->tx_pos = 0;
+      }
+      size = (conn->tx_size)? conn->tx_size: SAMFS_MIN_PAYLOAD;
+      while(size < conn->tx_len + len) {
+         size *= 2;
+      }
+      if(size != conn->tx_size) {
+         buf = realloc(conn->tx_buf, size);
+         if(NULL == buf) {
+            return -1;
          }
+         conn->tx_buf = buf;
+         conn->tx_size = size;
       }
-   } while(!dreq.endofdata);
+   }
 
-   /* send client write status */
-   send_rsp(client_fd, &rsp);
+   for(i = 0; i < iovcnt; i++) {
+      memcpy(conn->tx_buf + conn->tx_len, iov[i].iov_base, iov[i].iov_len);
+      conn->tx_len += iov[i].iov_len;
+   }
 
-   close(fd);
- 
-   return 0;
+   return len;
 }
 
-static int handle_truncate(int client_fd, struct req_t *req)
+/* send response to request 'req', rsp->data (if any) follows response header */
+static int send_rsp(struct conn_t *conn, struct req_t *req, struct rsp_t *rsp)
 {
-   int            rv;
-   char           local_path[URI_LEN];
-   struct rsp_t   rsp;
+   int                  rv;
+   struct frame_hdr_t   hdr;
+   struct rsp_hdr_t     rhdr;
+   struct iovec         iov[3];
+   uint64_t             start;
 
-   sprintf(local_path, "%s%s%s", SRCPATH, req->url, req->uri);
+   if(SUCCESS != rsp->status) {
+      req->errcode = rsp->errcode;
+   }
 
-   rv = truncate(local_path, req->truncate_len);
-   if(0 == rv) {
-      rsp.status = SUCCESS;
+   rhdr.status = rsp->status;
+   rhdr.errcode = rsp->errcode;
+   rhdr.size = rsp->size;
+
+   hdr.magic = SAMFS_MAGIC;
+   hdr.msg = req->msg;
+   hdr.id = req->id;
+   hdr.flags = ((rsp->endofdata)? FRAME_EOD: 0) | rsp->zip;
+   hdr.len = sizeof(rhdr) + rsp->data_len;
+   hdr.csum = 0;
+
+   iov[0].iov_base = &hdr;
+   iov[0].iov_len = sizeof(hdr);
+   iov[1].iov_base = &rhdr;
+   iov[1].iov_len = sizeof(rhdr);
+   iov[2].iov_base = rsp->data;
+   iov[2].iov_len = rsp->data_len;
+   hdr.csum = samfs_csum_iov(iov, 3);
+
+   start = samfs_now_ns();
+   if(conn->nonblock) {
+      /* event driven engine, frame is sent when socket is writable */
+      rv = queue_tx(conn, iov, 3);
    }
    else {
-      rsp.status = FAIL;
-      rsp.errcode = errno;
+      /* whole frame goes out in one syscall, no need to wait for any ack */
+      if(conn->shared) {
+         pthread_mutex_lock(&conn->tx_lock);
+      }
+      rv = samfs_writev_full(conn->fd, iov, 3);
+      if(conn->shared) {
+         pthread_mutex_unlock(&conn->tx_lock);
+      }
+   }
+   req->send_ns += samfs_now_ns() - start;
+   if(rv <= 0) {
+      return -1;
+   }
+   STAT_ADD(stat_slot()->bytes_sent, rv);
+   if(conn->client) {
+      STAT_ADD(conn->client->bytes_sent, rv);
    }
-   rsp.endofdata = TRUE;
-
-   send_rsp(client_fd, &rsp);
 
-   return 0;
+   return rv;
 }
 
-static int handle_unlink(int client_fd, struct req_t *req)
+/* send failure response carrying 'errcode' */
+static int send_error(struct conn_t *conn, struct req_t *req, int errcode)
 {
-   int            rv;
-   char           local_path[URI_LEN];
    struct rsp_t   rsp;
 
-   sprintf(local_path, "%s%s%s", SRCPATH, req->url, req->uri);
-
-   rv = unlink(local_path);
-   if(0 == rv) {
-      rsp.status = SUCCESS;
-   }
-   else {
-      rsp.status = FAIL;
-      rsp.errcode = errno;
-   }
+   memset(&rsp, 0, sizeof(rsp));
+   rsp.status = FAIL;
+   rsp.errcode = errcode;
    rsp.endofdata = TRUE;
 
-   send_rsp(client_fd, &rsp);
-
-   return 0;
+   return send_rsp(conn, req, &rsp);
 }
 
-static int handle_rename(int client_fd, struct req_t *req)
+/* build path on local disk for 'uri' of request, fails with ENAMETOOLONG if it does not fit */
+static int get_local_path(char *local_path, struct req_t *req, const char *uri)
 {
-   int            rv;
-   char           local_path[URI_LEN];
-   char           new_path[URI_LEN];
-   struct rsp_t   rsp;
-
-   sprintf(local_path, "%s%s%s", SRCPATH, req->url, req->uri);
-   sprintf(new_path, "%s%s%s", SRCPATH, req->url, req->data);
+   int len;
 
-   rv = rename(local_path, new_path);
-   if(0 == rv) {
-      rsp.status = SUCCESS;
-   }
-   else {
-      rsp.status = FAIL;
-      rsp.errcode = errno;
+   len = snprintf(local_path, PATH_MAX, "%s%s%s", SRCPATH, req->url, uri);
+   if(len >= PATH_MAX) {
+      errno = ENAMETOOLONG;
+      return -1;
    }
-   rsp.endofdata = TRUE;
-
-   send_rsp(client_fd, &rsp);
 
    return 0;
 }
 
-static int handle_chmod(int client_fd, struct req_t *req)
+static void init_handles(void)
 {
-   int            rv;
-   char           local_path[URI_LEN];
-   struct rsp_t   rsp;
+   struct rlimit  rl;
+   int            limit;
+   int            i;
 
-   sprintf(local_path, "%s%s%s", SRCPATH, req->url, req->uri);
+   /* leave most descriptors to client connections */
+   limit = HANDLE_MAX;
+   if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur / 4 < limit) {
+      limit = rl.rlim_cur / 4;
+   }
 
-   rv = chmod(local_path, req->mode);
+   /* slots in use start on free list */
+   for(i = 0; i < HANDLE_MAX; i++) {
+      handles[i].fd = -1;
+      handles[i].gen = 1;
+      handles[i].next = (i + 1 < limit)? i + 1: -1;
+   }
+   handle_free = (limit > 0)? 0: -1;
+   handle_lru_head = handle_lru_tail = -1;
+}
+
+/* unlinks 'slot' from LRU list, caller holds handle_lock */
+static void handle_lru_unlink(int slot)
+{
+   struct handle_t *h;
+
+   h = &handles[slot];
+   if(h->prev >= 0) {
+      handles[h->prev].next = h->next;
+   }
+   else {
+      handle_lru_head = h->next;
+   }
+   if(h->next >= 0) {
+      handles[h->next].prev = h->prev;
+   }
+   else {
+      handle_lru_tail = h->prev;
+   }
+}
+
+/* puts 'slot' at head of LRU list, caller holds handle_lock */
+static void handle_lru_push(int slot)
+{
+   handles[slot].prev = -1;
+   handles[slot].next = handle_lru_head;
+   if(handle_lru_head >= 0) {
+      handles[handle_lru_head].prev = slot;
+   }
+   handle_lru_head = slot;
+   if(handle_lru_tail < 0) {
+      handle_lru_tail = slot;
+   }
+}
+
+/* closes file of 'slot' and gives slot back, caller holds handle_lock */
+static void handle_free_slot(int slot)
+{
+   close(handles[slot].fd);
+   handles[slot].fd = -1;
+   handles[slot].gen++;      /* handles of old file do not match any more */
+   handles[slot].closing = FALSE;
+   handles[slot].next = handle_free;
+   handle_free = slot;
+}
+
+/* keeps 'fd' open for client, returns its handle or 0 if table is full of files in use */
+static uint64_t add_handle(int fd)
+{
+   int      slot;
+   uint64_t fh;
+
+   if(handles_off) {
+      return 0;
+   }
+
+   pthread_mutex_lock(&handle_lock);
+   if(handle_free < 0) {
+      /* evict least recently used idle file, its client falls back to path */
+      for(slot = handle_lru_tail; slot >= 0 && handles[slot].refs; slot = handles[slot].prev) {
+      }
+      if(slot < 0) {
+         pthread_mutex_unlock(&handle_lock);
+         return 0;
+      }
+      handle_lru_unlink(slot);
+      handle_free_slot(slot);
+   }
+   slot = handle_free;
+   handle_free = handles[slot].next;
+   handles[slot].fd = fd;
+   handles[slot].refs = 0;
+   handle_lru_push(slot);
+   fh = ((uint64_t) handles[slot].gen << 32) | (slot + 1);
+   pthread_mutex_unlock(&handle_lock);
+
+   return fh;
+}
+
+/* returns slot of handle 'fh' with a reference taken, or -1 if handle is stale */
+static int get_handle(uint64_t fh)
+{
+   int slot;
+
+   slot = (int)(fh & 0xffffffff) - 1;
+   if(slot < 0 || slot >= HANDLE_MAX) {
+      return -1;
+   }
+
+   pthread_mutex_lock(&handle_lock);
+   if(handles[slot].fd < 0 || handles[slot].closing || handles[slot].gen != (uint32_t)(fh >> 32)) {
+      pthread_mutex_unlock(&handle_lock);
+      return -1;
+   }
+   handles[slot].refs++;
+   handle_lru_unlink(slot);
+   handle_lru_push(slot);
+   pthread_mutex_unlock(&handle_lock);
+
+   return slot;
+}
+
+static void put_handle(int slot)
+{
+   pthread_mutex_lock(&handle_lock);
+   handles[slot].refs--;
+   if(handles[slot].closing && 0 == handles[slot].refs) {
+      handle_free_slot(slot);
+   }
+   pthread_mutex_unlock(&handle_lock);
+}
+
+/* client has closed handle 'fh', file is closed once no request uses it */
+static void drop_handle(uint64_t fh)
+{
+   int slot;
+
+   slot = get_handle(fh);
+   if(slot < 0) {
+      return;
+   }
+
+   pthread_mutex_lock(&handle_lock);
+   handle_lru_unlink(slot);
+   handles[slot].closing = TRUE;
+   pthread_mutex_unlock(&handle_lock);
+
+   put_handle(slot);
+}
+
+static void init_fd_cache(void)
+{
+   struct rlimit  rl;
+   int            limit;
+   int            i;
+
+   /* same share of descriptors as handles */
+   limit = FD_CACHE_MAX;
+   if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur / 4 < limit) {
+      limit = rl.rlim_cur / 4;
+   }
+   fd_cache_limit = limit / FD_CACHE_SHARDS;
+
+   for(i = 0; i < FD_CACHE_SHARDS; i++) {
+      pthread_mutex_init(&fd_cache[i].lock, NULL);
+   }
+}
+
+static uint32_t fd_hash(const char *path)
+{
+   uint64_t hash;
+
+   hash = samfs_hash(SAMFS_HASH_INIT, path);
+
+   return (uint32_t)(hash ^ (hash >> 32));
+}
+
+/* returns cached entry of 'path' with a reference taken, or NULL if there is none.
+   entry must be open for 'accmode' or for both reading and writing, any entry
+   matches if 'accmode' is -1.
+ */
+static struct fd_entry_t *fd_cache_hit(const char *path, uint32_t hash, int accmode)
+{
+   struct fd_shard_t *shard;
+   struct fd_entry_t *ent;
+
+   shard = FD_SHARD(hash);
+   pthread_mutex_lock(&shard->lock);
+   for(ent = shard->buckets[FD_BUCKET(hash)]; ent; ent = ent->hnext) {
+      if(ent->hash == hash && strcmp(ent->path, path) == 0) {
+         break;
+      }
+   }
+   if(NULL == ent || (accmode >= 0 && ent->accmode != accmode && ent->accmode != O_RDWR)) {
+      pthread_mutex_unlock(&shard->lock);
+      return NULL;
+   }
+   ent->refs++;
+
+   /* move to head of LRU list */
+   if(ent->prev) {
+      ent->prev->next = ent->next;
+      if(ent->next) {
+         ent->next->prev = ent->prev;
+      }
+      else {
+         shard->lru_tail = ent->prev;
+      }
+      ent->prev = NULL;
+      ent->next = shard->lru_head;
+      shard->lru_head->prev = ent;
+      shard->lru_head = ent;
+   }
+   pthread_mutex_unlock(&shard->lock);
+
+   return ent;
+}
+
+/* removes 'ent' from cache, its fd is closed now or by its last user.
+   caller holds lock of shard.
+ */
+static void fd_cache_drop(struct fd_shard_t *shard, struct fd_entry_t *ent)
+{
+   struct fd_entry_t **pp;
+
+   for(pp = &shard->buckets[FD_BUCKET(ent->hash)]; *pp != ent; pp = &(*pp)->hnext) {
+   }
+   *pp = ent->hnext;
+   if(ent->prev) {
+      ent->prev->next = ent->next;
+   }
+   else {
+      shard->lru_head = ent->next;
+   }
+   if(ent->next) {
+      ent->next->prev = ent->prev;
+   }
+   else {
+      shard->lru_tail = ent->prev;
+   }
+   shard->count--;
+
+   if(ent->refs) {
+      ent->stale = TRUE;
+   }
+   else {
+      close(ent->fd);
+      free(ent);
+   }
+}
+
+/* adds 'ent' to cache with one reference, evicting least recently used idle entries.
+   returns FALSE if shard is full of entries in use (or cache is off).
+ */
+static int fd_cache_add(struct fd_entry_t *ent)
+{
+   struct fd_shard_t *shard;
+   struct fd_entry_t *old;
+
+   shard = FD_SHARD(ent->hash);
+   pthread_mutex_lock(&shard->lock);
+
+   /* another request may have opened same path meanwhile, newest one wins */
+   for(old = shard->buckets[FD_BUCKET(ent->hash)]; old; old = old->hnext) {
+      if(old->hash == ent->hash && strcmp(old->path, ent->path) == 0) {
+         fd_cache_drop(shard, old);
+         break;
+      }
+   }
+   while(shard->count >= fd_cache_limit) {
+      for(old = shard->lru_tail; old && old->refs; old = old->prev) {
+      }
+      if(NULL == old) {
+         pthread_mutex_unlock(&shard->lock);
+         return FALSE;
+      }
+      fd_cache_drop(shard, old);
+   }
+
+   ent->refs = 1;
+   ent->stale = FALSE;
+   ent->hnext = shard->buckets[FD_BUCKET(ent->hash)];
+   shard->buckets[FD_BUCKET(ent->hash)] = ent;
+   ent->prev = NULL;
+   ent->next = shard->lru_head;
+   if(shard->lru_head) {
+      shard->lru_head->prev = ent;
+   }
+   shard->lru_head = ent;
+   if(NULL == shard->lru_tail) {
+      shard->lru_tail = ent;
+   }
+   shard->count++;
+   pthread_mutex_unlock(&shard->lock);
+
+   return TRUE;
+}
+
+/* descriptor of 'path' opened with 'flags' (access mode, O_DIRECTORY), taken from cache
+   or opened and cached. files are opened with access mode request asked for, a write
+   opens them for reading and writing if permitted, so that one entry serves both.
+   '*pent' is set to cache entry or NULL if descriptor is not cached, release with
+   fd_cache_put().
+ */
+static int fd_cache_get(const char *path, int flags, struct fd_entry_t **pent)
+{
+   struct fd_entry_t *ent;
+   uint32_t          hash;
+   int               accmode;
+   int               fd;
+
+   *pent = NULL;
+   if(0 == fd_cache_limit) {
+      return open(path, flags);
+   }
+
+   hash = fd_hash(path);
+   ent = fd_cache_hit(path, hash, flags & O_ACCMODE);
+   if(ent) {
+      STAT_ADD(stat_slot()->fd_hits, 1);
+      *pent = ent;
+      return ent->fd;
+   }
+   STAT_ADD(stat_slot()->fd_misses, 1);
+
+   /* symlinks are not cached, stat of their descriptor would give target */
+   fd = -1;
+   accmode = flags & O_ACCMODE;
+   if(!(flags & O_DIRECTORY) && O_WRONLY == accmode) {
+      fd = open(path, (flags & ~O_ACCMODE) | O_RDWR | O_NOFOLLOW);
+      if(fd >= 0) {
+         accmode = O_RDWR;
+      }
+   }
+   if(-1 == fd) {
+      fd = open(path, flags | O_NOFOLLOW);
+   }
+   if(-1 == fd) {
+      return (errno == ELOOP)? open(path, flags): -1;
+   }
+
+   ent = malloc(sizeof(struct fd_entry_t) + strlen(path) + 1);
+   if(NULL == ent) {
+      return fd;
+   }
+   ent->hash = hash;
+   ent->fd = fd;
+   ent->accmode = accmode;
+   strcpy(ent->path, path);
+   if(!fd_cache_add(ent)) {
+      free(ent);
+      return fd;
+   }
+   *pent = ent;
+
+   return fd;
+}
+
+static void fd_cache_put(int fd, struct fd_entry_t *ent)
+{
+   struct fd_shard_t *shard;
+   int               last;
+
+   if(NULL == ent) {
+      close(fd);
+      return;
+   }
+
+   shard = FD_SHARD(ent->hash);
+   pthread_mutex_lock(&shard->lock);
+   ent->refs--;
+   last = (ent->stale && 0 == ent->refs);
+   pthread_mutex_unlock(&shard->lock);
+
+   if(last) {
+      close(ent->fd);
+      free(ent);
+   }
+}
+
+/* drops cached descriptor of 'path', and of everything below it if 'tree' is TRUE.
+   must be called when path is unlinked or renamed, otherwise later requests would
+   reach old file.
+ */
+static void fd_cache_forget(const char *path, int tree)
+{
+   struct fd_shard_t *shard;
+   struct fd_entry_t *ent;
+   struct fd_entry_t *next;
+   uint32_t          hash;
+   size_t            len;
+   int               i;
+
+   if(!tree) {
+      hash = fd_hash(path);
+      shard = FD_SHARD(hash);
+      pthread_mutex_lock(&shard->lock);
+      for(ent = shard->buckets[FD_BUCKET(hash)]; ent; ent = ent->hnext) {
+         if(ent->hash == hash && strcmp(ent->path, path) == 0) {
+            fd_cache_drop(shard, ent);
+            break;
+         }
+      }
+      pthread_mutex_unlock(&shard->lock);
+      return;
+   }
+
+   len = strlen(path);
+   for(i = 0; i < FD_CACHE_SHARDS; i++) {
+      shard = &fd_cache[i];
+      pthread_mutex_lock(&shard->lock);
+      for(ent = shard->lru_head; ent; ent = next) {
+         next = ent->next;
+         if(strncmp(ent->path, path, len) == 0 && (ent->path[len] == '\0' || ent->path[len] == '/')) {
+            fd_cache_drop(shard, ent);
+         }
+      }
+      pthread_mutex_unlock(&shard->lock);
+   }
+}
+
+/* turns cache off for good and closes idle descriptors. used before fork(), once
+   server runs in several processes a cache can not see changes made by others.
+ */
+static void fd_cache_off(void)
+{
+   struct fd_shard_t *shard;
+   int               i;
+
+   if(0 == fd_cache_limit) {
+      return;
+   }
+
+   fd_cache_limit = 0;
+   for(i = 0; i < FD_CACHE_SHARDS; i++) {
+      shard = &fd_cache[i];
+      pthread_mutex_lock(&shard->lock);
+      while(shard->lru_head) {
+         fd_cache_drop(shard, shard->lru_head);
+      }
+      pthread_mutex_unlock(&shard->lock);
+   }
+}
+
+/* lstat() of 'path', done on its cached descriptor or relative to cached
+   descriptor of its directory to skip path lookup.
+ */
+static int fd_cache_stat(const char *path, struct stat *st)
+{
+   struct fd_entry_t *ent;
+   char              dir[PATH_MAX];
+   const char        *name;
+   int               rv;
+
+   if(0 == fd_cache_limit) {
+      return lstat(path, st);
+   }
+
+   ent = fd_cache_hit(path, fd_hash(path), -1);
+   if(ent) {
+      STAT_ADD(stat_slot()->fd_hits, 1);
+      rv = fstat(ent->fd, st);
+      fd_cache_put(ent->fd, ent);
+      return rv;
+   }
+
+   name = strrchr(path, '/');
+   if(NULL == name || name == path || name[1] == '\0') {
+      STAT_ADD(stat_slot()->fd_misses, 1);
+      return lstat(path, st);
+   }
+   memcpy(dir, path, name - path);
+   dir[name - path] = '\0';
+   ent = fd_cache_hit(dir, fd_hash(dir), -1);
+   if(NULL == ent) {
+      STAT_ADD(stat_slot()->fd_misses, 1);
+      return lstat(path, st);
+   }
+   STAT_ADD(stat_slot()->fd_hits, 1);
+   rv = fstatat(ent->fd, name + 1, st, AT_SYMLINK_NOFOLLOW);
+   fd_cache_put(ent->fd, ent);
+
+   return rv;
+}
+
+/* file descriptor for request on a file. it is taken from client's handle if that is
+   still open, otherwise file is looked up by path in fd cache (opened with 'flags' on
+   miss). '*ref' tells where it came from, release with close_req_file().
+ */
+static int open_req_file(struct req_t *req, int flags, struct file_ref_t *ref)
+{
+   char local_path[PATH_MAX];
+
+   ref->ent = NULL;
+   ref->slot = (req->fh)? get_handle(req->fh): -1;
+   if(ref->slot >= 0) {
+      return handles[ref->slot].fd;
+   }
+
+   if(get_local_path(local_path, req, req->uri) < 0) {
+      return -1;
+   }
+
+   return fd_cache_get(local_path, flags, &ref->ent);
+}
+
+static void close_req_file(int fd, struct file_ref_t *ref)
+{
+   if(ref->slot >= 0) {
+      put_handle(ref->slot);
+   }
+   else {
+      fd_cache_put(fd, ref->ent);
+   }
+}
+
+static int handle_hello(struct conn_t *conn, struct req_t *req)
+{
+   struct hello_t hello;
+   struct rsp_t   rsp;
+
+   /* hello of older clients ends before features */
+   if(req->data_len < offsetof(struct hello_t, features)) {
+      return send_error(conn, req, EPROTO);
+   }
+   memset(&hello, 0, sizeof(hello));
+   memcpy(&hello, req->data, (req->data_len < sizeof(hello))? req->data_len: sizeof(hello));
+   if(hello.version != SAMFS_VERSION) {
+      return send_error(conn, req, EPROTONOSUPPORT);
+   }
+
+   /* accept proposed payload size if we can handle that much */
+   if(hello.max_payload > SAMFS_MAX_PAYLOAD) {
+      hello.max_payload = SAMFS_MAX_PAYLOAD;
+   }
+   if(hello.max_payload < SAMFS_MIN_PAYLOAD) {
+      hello.max_payload = SAMFS_MIN_PAYLOAD;
+   }
+
+   /* bulk data can only be spliced by engines serving connection with blocking calls */
+   hello.features &= SAMFS_FEAT_READDIRPLUS | ((conn->nonblock)? 0: SAMFS_FEAT_BULK_WRITE) | samfs_zip_features();
+
+   memset(&rsp, 0, sizeof(rsp));
+   rsp.status = SUCCESS;
+   rsp.data = (char *) &hello;
+   rsp.data_len = sizeof(hello);
+   rsp.endofdata = TRUE;
+
+   return send_rsp(conn, req, &rsp);
+}
+
+static int handle_getattr(struct conn_t *conn, struct req_t *req)
+{
+   int            rv;
+   char           local_path[PATH_MAX];
+   struct stat    st;
+   struct rsp_t   rsp;
+
+   if(get_local_path(local_path, req, req->uri) < 0) {
+      return send_error(conn, req, errno);
+   }
+
+   memset(&rsp, 0, sizeof(rsp));
+   rv = fd_cache_stat(local_path, &st);
    if(0 == rv) {
       rsp.status = SUCCESS;
+      rsp.data = (char *) &st;
+      rsp.data_len = sizeof(struct stat);
    }
    else {
       rsp.status = FAIL;
@@ -449,275 +1391,2940 @@ static int handle_chmod(int client_fd, struct req_t *req)
    }
    rsp.endofdata = TRUE;
 
-   send_rsp(client_fd, &rsp);
-
-   return 0;
+   return send_rsp(conn, req, &rsp);
 }
 
-static int handle_utime(int client_fd, struct req_t *req)
+static int handle_mkdir(struct conn_t *conn, struct req_t *req)
 {
    int            rv;
-   char           local_path[URI_LEN];
-   struct utimbuf tm;
+   char           local_path[PATH_MAX];
    struct rsp_t   rsp;
 
-   sprintf(local_path, "%s%s%s", SRCPATH, req->url, req->uri);
+   if(get_local_path(local_path, req, req->uri) < 0) {
+      return send_error(conn, req, errno);
+   }
 
-   rv = utime(local_path, &tm);
+   memset(&rsp, 0, sizeof(rsp));
+   rv = mkdir(local_path, req->mode);
    if(0 == rv) {
       rsp.status = SUCCESS;
-      memcpy(&rsp.data, &tm, sizeof(struct utimbuf));
    }
    else {
-      rsp.status = FAIL;
-      rsp.errcode = errno;
+      rsp.status = FAIL;
+      rsp.errcode = errno;
+   }
+   rsp.endofdata = TRUE;
+
+   return send_rsp(conn, req, &rsp);
+}
+
+/* sends directory entries packed in frames of up to SAMFS_MIN_PAYLOAD bytes.
+   an entry is its NUL terminated name, preceded by a dirent_plus_t carrying
+   its attributes if 'plus' is TRUE.
+ */
+static int send_dir_entries(struct conn_t *conn, struct req_t *req, int plus)
+{
+   char           local_path[PATH_MAX];
+   struct rsp_t   rsp;
+   DIR            *dirp;
+   struct dirent  *dent;
+   dirent_plus_t  ent;
+   char           *buf;
+   size_t         used;
+   size_t         len;
+   size_t         ent_len;
+   struct fd_entry_t *fent;
+   int            fd;
+   int            dfd;
+   int            rv;
+
+   if(get_local_path(local_path, req, req->uri) < 0) {
+      return send_error(conn, req, errno);
+   }
+
+   /* stream gets its own descriptor, cached one keeps its offset for other requests */
+   fd = fd_cache_get(local_path, O_RDONLY | O_DIRECTORY, &fent);
+   if(-1 == fd) {
+      return send_error(conn, req, errno);
+   }
+   dfd = openat(fd, ".", O_RDONLY | O_DIRECTORY);
+   fd_cache_put(fd, fent);
+   dirp = (dfd >= 0)? fdopendir(dfd): NULL;
+   if(NULL == dirp) {
+      rv = errno;
+      if(dfd >= 0) {
+         close(dfd);
+      }
+      return send_error(conn, req, rv);
+   }
+
+   buf = malloc(SAMFS_MIN_PAYLOAD);
+   if(NULL == buf) {
+      closedir(dirp);
+      return send_error(conn, req, ENOMEM);
+   }
+
+   memset(&rsp, 0, sizeof(rsp));
+   rsp.status = SUCCESS;
+   rsp.data = buf;
+   used = 0;
+   rv = 0;
+   errno = 0;
+   ent_len = (plus)? sizeof(ent): 0;
+   while((dent = readdir(dirp)) != NULL) {
+      len = strlen(dent->d_name) + 1;
+      if(used + ent_len + len > SAMFS_MIN_PAYLOAD) {
+         /* frame is full, send it and continue with next one */
+         rsp.data_len = used;
+         rsp.endofdata = FALSE;
+         rv = send_rsp(conn, req, &rsp);
+         if(rv < 0) {
+            break;
+         }
+         used = 0;
+      }
+      if(plus) {
+         /* stat relative to open dir, no need to build and resolve full path */
+         memset(&ent, 0, sizeof(ent));
+         ent.errcode = (fstatat(dirfd(dirp), dent->d_name, &ent.st, AT_SYMLINK_NOFOLLOW) == 0)? 0: errno;
+         ent.name_len = len;
+         memcpy(buf + used, &ent, sizeof(ent));
+         used += sizeof(ent);
+      }
+      memcpy(buf + used, dent->d_name, len);
+      used += len;
+      errno = 0;
+   }
+
+   if(rv >= 0) {
+      if(errno) {
+         rsp.status = FAIL;
+         rsp.errcode = errno;
+         used = 0;
+      }
+      rsp.data_len = used;
+      rsp.endofdata = TRUE;
+      rv = send_rsp(conn, req, &rsp);
+   }
+
+   free(buf);
+   closedir(dirp);
+
+   return rv;
+}
+
+static int handle_readdir(struct conn_t *conn, struct req_t *req)
+{
+   return send_dir_entries(conn, req, FALSE);
+}
+
+static int handle_readdirplus(struct conn_t *conn, struct req_t *req)
+{
+   return send_dir_entries(conn, req, TRUE);
+}
+
+static int handle_rmdir(struct conn_t *conn, struct req_t *req)
+{
+   int            rv;
+   char           local_path[PATH_MAX];
+   struct rsp_t   rsp;
+
+   if(get_local_path(local_path, req, req->uri) < 0) {
+      return send_error(conn, req, errno);
+   }
+
+   memset(&rsp, 0, sizeof(rsp));
+   rv = rmdir(local_path);
+   if(0 == rv) {
+      fd_cache_forget(local_path, TRUE);
+      rsp.status = SUCCESS;
+   }
+   else {
+      rsp.status = FAIL;
+      rsp.errcode = errno;
+   }
+   rsp.endofdata = TRUE;
+
+   return send_rsp(conn, req, &rsp);
+}
+
+/* opens file to be kept as handle, write-only files are opened for reading too
+   if permitted, so that bulk writes to them can be verified.
+ */
+static int open_handle_file(const char *local_path, int flags, mode_t mode)
+{
+   int fd;
+
+   if(O_WRONLY == (flags & O_ACCMODE)) {
+      fd = open(local_path, (flags & ~O_ACCMODE) | O_RDWR, mode);
+      if(fd >= 0 || errno != EACCES) {
+         return fd;
+      }
+   }
+
+   return open(local_path, flags, mode);
+}
+
+static int handle_create(struct conn_t *conn, struct req_t *req)
+{
+   int            fd;
+   char           local_path[PATH_MAX];
+   struct rsp_t   rsp;
+
+   if(get_local_path(local_path, req, req->uri) < 0) {
+      return send_error(conn, req, errno);
+   }
+
+   memset(&rsp, 0, sizeof(rsp));
+   fd = open_handle_file(local_path, (req->flags & ~O_ACCMODE) | O_WRONLY | O_CREAT, req->mode);
+   if(-1 == fd) {
+      rsp.status = FAIL;
+      rsp.errcode = errno;
+   }
+   else {
+      chmod(local_path, req->mode);
+      rsp.status = SUCCESS;
+      rsp.size = add_handle(fd);    /* created file stays open for client */
+      if(0 == rsp.size) {
+         close(fd);
+      }
+   }
+   rsp.endofdata = TRUE;
+
+   return send_rsp(conn, req, &rsp);
+}
+
+/* opens file and keeps it open for client, response size carries its handle
+   (0 if table is full, client then goes by path).
+ */
+static int handle_open(struct conn_t *conn, struct req_t *req)
+{
+   int            fd;
+   char           local_path[PATH_MAX];
+   struct rsp_t   rsp;
+
+   if(get_local_path(local_path, req, req->uri) < 0) {
+      return send_error(conn, req, errno);
+   }
+
+   fd = open_handle_file(local_path, req->flags & O_ACCMODE, 0);
+   if(-1 == fd) {
+      return send_error(conn, req, errno);
+   }
+
+   memset(&rsp, 0, sizeof(rsp));
+   rsp.status = SUCCESS;
+   rsp.size = add_handle(fd);
+   if(0 == rsp.size) {
+      close(fd);
+   }
+   rsp.endofdata = TRUE;
+
+   return send_rsp(conn, req, &rsp);
+}
+
+static int handle_release(struct conn_t *conn, struct req_t *req)
+{
+   struct rsp_t   rsp;
+
+   drop_handle(req->fh);
+
+   memset(&rsp, 0, sizeof(rsp));
+   rsp.status = SUCCESS;
+   rsp.endofdata = TRUE;
+
+   return send_rsp(conn, req, &rsp);
+}
+
+/* builds header of a FRAME_RAW frame of response to 'msg' 'id', carrying 'len' bytes
+   of file data. 'last' sets FRAME_EOD.
+ */
+static void file_frame_hdr(struct frame_hdr_t *hdr, struct rsp_hdr_t *rhdr, uint16_t msg, uint64_t id,
+      size_t len, int last)
+{
+   struct iovec iov[2];
+
+   rhdr->status = SUCCESS;
+   rhdr->errcode = 0;
+   rhdr->size = len;
+
+   hdr->magic = SAMFS_MAGIC;
+   hdr->msg = msg;
+   hdr->id = id;
+   hdr->flags = ((last)? FRAME_EOD: 0) | FRAME_RAW;
+   hdr->len = sizeof(struct rsp_hdr_t) + len;
+   hdr->csum = 0;
+
+   iov[0].iov_base = hdr;
+   iov[0].iov_len = sizeof(struct frame_hdr_t);
+   iov[1].iov_base = rhdr;
+   iov[1].iov_len = sizeof(struct rsp_hdr_t);
+   hdr->csum = samfs_csum_iov(iov, 2);
+}
+
+/* sends up to req->size bytes of file 'fd' from request offset as FRAME_RAW frames of at
+   most SAMFS_MAX_PAYLOAD bytes each. data goes from page cache to socket with sendfile()
+   instead of being copied through user space, event driven engines send it once queued
+   responses are out. 'fd' is released with close_req_file() when done.
+ */
+static int send_file_rsp(struct conn_t *conn, struct req_t *req, int fd, struct file_ref_t *ref)
+{
+   struct stat          st;
+   struct frame_hdr_t   hdr;
+   struct rsp_hdr_t     rhdr;
+   struct iovec         iov[2];
+   uint64_t             sent;
+   size_t               len;
+   size_t               frame;
+   size_t               left;
+   off_t                offset;
+   ssize_t              n;
+   int                  rv;
+   uint64_t             start;
+
+   if(fstat(fd, &st) < 0) {
+      rv = errno;
+      close_req_file(fd, ref);
+      return send_error(conn, req, rv);
+   }
+
+   /* lengths go in headers, so clip request to end of file now */
+   len = 0;
+   if(req->offset < st.st_size) {
+      len = st.st_size - req->offset;
+      if(len > req->size) {
+         len = req->size;
+      }
+   }
+
+   rv = 0;
+   sent = 0;
+   offset = req->offset;
+   start = samfs_now_ns();
+   if(conn->nonblock) {
+      /* later frames are queued by serve_conn_events() as data of each one is out */
+      frame = (len < SAMFS_MAX_PAYLOAD)? len: SAMFS_MAX_PAYLOAD;
+      file_frame_hdr(&hdr, &rhdr, req->msg, req->id, frame, frame == len);
+      iov[0].iov_base = &hdr;
+      iov[0].iov_len = sizeof(hdr);
+      iov[1].iov_base = &rhdr;
+      iov[1].iov_len = sizeof(rhdr);
+      if(queue_tx(conn, iov, 2) < 0) {
+         rv = -1;
+      }
+      else if(len) {
+         /* connection owns the file until its data is sent */
+         conn->tx_file_fd = fd;
+         conn->tx_file_ref = *ref;
+         conn->tx_file_off = offset;
+         conn->tx_file_len = frame;
+         conn->tx_file_rest = len - frame;
+         conn->tx_file_msg = req->msg;
+         conn->tx_file_id = req->id;
+         fd = -1;
+      }
+      sent = ((len)? (len + SAMFS_MAX_PAYLOAD - 1) / SAMFS_MAX_PAYLOAD: 1) * (sizeof(hdr) + sizeof(rhdr)) + len;
+   }
+   else {
+      /* frames of response stay together on shared connection */
+      if(conn->shared) {
+         pthread_mutex_lock(&conn->tx_lock);
+      }
+      left = len;
+      do {
+         frame = (left < SAMFS_MAX_PAYLOAD)? left: SAMFS_MAX_PAYLOAD;
+         left -= frame;
+         file_frame_hdr(&hdr, &rhdr, req->msg, req->id, frame, 0 == left);
+
+         /* header waits in socket for data, both go out in same segments */
+         n = send(conn->fd, &hdr, sizeof(hdr), MSG_MORE);
+         if(n == sizeof(hdr)) {
+            n = send(conn->fd, &rhdr, sizeof(rhdr), (frame)? MSG_MORE: 0);
+         }
+         if(n != sizeof(rhdr)) {
+            rv = -1;
+         }
+         sent += sizeof(hdr) + sizeof(rhdr);
+         while(0 == rv && frame) {
+            n = sendfile(conn->fd, fd, &offset, frame);
+            if(n < 0 && errno == EINTR) {
+               continue;
+            }
+            if(n <= 0) {
+               /* file got shorter than promised length, stream can not be completed */
+               rv = -1;
+               break;
+            }
+            frame -= n;
+            sent += n;
+         }
+      } while(0 == rv && left);
+      if(conn->shared) {
+         pthread_mutex_unlock(&conn->tx_lock);
+      }
+   }
+   req->send_ns += samfs_now_ns() - start;
+   if(fd >= 0) {
+      close_req_file(fd, ref);
+   }
+   if(rv < 0) {
+      return -1;
+   }
+
+   STAT_ADD(stat_slot()->bytes_sent, sent);
+   if(conn->client) {
+      STAT_ADD(conn->client->bytes_sent, sent);
+   }
+
+   return 0;
+}
+
+/* accounts 'raw' bytes of data that took 'wire' bytes on the wire and 'cpu' seconds to pack or unpack */
+static void zip_stat(size_t raw, size_t wire, double cpu)
+{
+   struct stat_slot_t *slot;
+
+   slot = stat_slot();
+   STAT_ADD(slot->zip_raw, raw);
+   STAT_ADD(slot->zip_wire, wire);
+   STAT_ADD(slot->zip_cpu_ns, (uint64_t) (cpu * 1e9));
+}
+
+/* codec client takes READ data compressed with, 0 if none or not built in */
+static int req_codec(struct req_t *req)
+{
+   if((req->opts & REQ_LZ4) && (samfs_zip_features() & SAMFS_FEAT_LZ4)) {
+      return FRAME_LZ4;
+   }
+   if((req->opts & REQ_ZSTD) && (samfs_zip_features() & SAMFS_FEAT_ZSTD)) {
+      return FRAME_ZSTD;
+   }
+
+   return 0;
+}
+
+/* reads next frame of response to READ 'req', up to '*rest' bytes of 'fd' at '*offset',
+   into 'buf' and sends it, packed into 'zbuf' with 'codec' if that pays. both buffers
+   hold a frame. '*offset' and '*rest' are advanced, '*rest' is 0 once frame ends response.
+ */
+static int send_read_frame(struct conn_t *conn, struct req_t *req, int fd, off_t *offset, size_t *rest,
+      int codec, char *buf, char *zbuf)
+{
+   struct rsp_t   rsp;
+   size_t         read_size;
+   size_t         n;
+   ssize_t        rv;
+   double         cpu;
+
+   /* read minimum of 'frame payload size' and 'remaining requested size' */
+   read_size = (SAMFS_MAX_PAYLOAD < *rest)? SAMFS_MAX_PAYLOAD: *rest;
+
+   memset(&rsp, 0, sizeof(rsp));
+   rsp.data = buf;
+   rv = pread(fd, buf, read_size, *offset);
+   if(rv < 0) {
+      /* error has occured while reading from file */
+      rsp.status = FAIL;
+      rsp.errcode = errno;
+      rsp.endofdata = TRUE;
+      *rest = 0;
+   }
+   else {
+      *offset += rv;
+      *rest -= rv;
+      rsp.status = SUCCESS;
+      rsp.size = rv;
+      rsp.data_len = rv;
+      if(rv < read_size || 0 == *rest) {
+         /* reached end of file or read requested size of data */
+         rsp.endofdata = TRUE;
+         *rest = 0;
+      }
+      if(codec && rsp.data_len) {
+         cpu = samfs_cpu_sec();
+         n = samfs_zip(codec, buf, rsp.data_len, zbuf);
+         zip_stat(rsp.data_len, (n)? n: rsp.data_len, samfs_cpu_sec() - cpu);
+         if(n) {
+            rsp.data = zbuf;
+            rsp.data_len = n;
+            rsp.zip = codec;
+         }
+      }
+   }
+
+   return send_rsp(conn, req, &rsp);
+}
+
+/* sends file data in frames of at most SAMFS_MAX_PAYLOAD bytes,
+   last frame is marked end of data. large reads of clients taking raw
+   data are streamed with sendfile() instead, unless client takes it
+   compressed, then data of each frame is compressed if that pays.
+   event driven engines queue one frame at a time, next one is read by
+   queue_read_frame() once tx buffer is out, so a huge read is never
+   held in memory whole.
+ */
+static int handle_read(struct conn_t *conn, struct req_t *req)
+{
+   int            rv;
+   int            fd;
+   struct file_ref_t ref;
+   char           *buf;
+   char           *zbuf;
+   size_t         read_size;
+   size_t         rest;
+   off_t          offset;
+   int            codec;
+
+   fd = open_req_file(req, O_RDONLY, &ref);
+   if(-1 == fd) {
+      return send_error(conn, req, errno);
+   }
+
+   codec = req_codec(req);
+   if((req->opts & REQ_RAW_DATA) && req->size >= SENDFILE_MIN && !codec) {
+      return (send_file_rsp(conn, req, fd, &ref) < 0)? -1: 0;
+   }
+
+   read_size = (SAMFS_MAX_PAYLOAD < req->size)? SAMFS_MAX_PAYLOAD: req->size;
+   buf = malloc(read_size? read_size: 1);
+   zbuf = (codec)? malloc(read_size? read_size: 1): NULL;
+   if(NULL == buf || (codec && NULL == zbuf)) {
+      free(buf);
+      free(zbuf);
+      close_req_file(fd, &ref);
+      return send_error(conn, req, ENOMEM);
+   }
+
+   offset = req->offset;
+   rest = req->size;
+   do {
+      rv = send_read_frame(conn, req, fd, &offset, &rest, codec, buf, zbuf);
+      if(rv >= 0 && rest && conn->nonblock) {
+         /* connection owns the file until last frame is queued */
+         conn->tx_file_fd = fd;
+         conn->tx_file_ref = ref;
+         conn->tx_file_off = offset;
+         conn->tx_file_rest = rest;
+         conn->tx_read = TRUE;
+         conn->tx_read_codec = codec;
+         fd = -1;
+         break;
+      }
+   } while(rest && rv >= 0);
+
+   free(buf);
+   free(zbuf);
+   if(fd >= 0) {
+      close_req_file(fd, &ref);
+   }
+
+   return (rv < 0)? -1: 0;
+}
+
+/* queues next frame of buffered read response of non-blocking connection,
+   called once tx buffer is out. returns -1 if connection has to be closed.
+ */
+static int queue_read_frame(struct conn_t *conn)
+{
+   char     *buf;
+   char     *zbuf;
+   size_t   size;
+   int      rv;
+
+   size = (SAMFS_MAX_PAYLOAD < conn->tx_file_rest)? SAMFS_MAX_PAYLOAD: conn->tx_file_rest;
+   buf = malloc(size);
+   zbuf = (conn->tx_read_codec)? malloc(size): NULL;
+   if(NULL == buf || (conn->tx_read_codec && NULL == zbuf)) {
+      free(buf);
+      free(zbuf);
+      return -1;  /* response can not be finished, stream would be out of sync */
+   }
+
+   rv = send_read_frame(conn, &conn->req, conn->tx_file_fd, &conn->tx_file_off, &conn->tx_file_rest,
+         conn->tx_read_codec, buf, zbuf);
+   free(buf);
+   free(zbuf);
+   if(0 == conn->tx_file_rest) {
+      conn->tx_read = FALSE;
+      close_req_file(conn->tx_file_fd, &conn->tx_file_ref);
+   }
+
+   return (rv < 0)? -1: 0;
+}
+
+/* pipes used to splice bulk writes of connection, created on first use */
+static int get_conn_pipe(struct conn_t *conn)
+{
+   int size;
+
+   /* write end of a pipe is never fd 0, so 0 means no pipe yet */
+   if(conn->pipe_fds[1]) {
+      return 0;
+   }
+   if(pipe(conn->pipe_fds) < 0) {
+      conn->pipe_fds[1] = 0;
+      return -1;
+   }
+   if(pipe(conn->tee_fds) < 0) {
+      close(conn->pipe_fds[0]);
+      close(conn->pipe_fds[1]);
+      conn->pipe_fds[1] = 0;
+      return -1;
+   }
+
+   /* bigger pipe moves more data per splice() and holds whole frame, default size is fine if this fails */
+   fcntl(conn->pipe_fds[1], F_SETPIPE_SZ, SAMFS_MAX_PAYLOAD);
+   fcntl(conn->tee_fds[1], F_SETPIPE_SZ, SAMFS_MAX_PAYLOAD);
+   size = fcntl(conn->pipe_fds[1], F_GETPIPE_SZ);
+   conn->pipe_size = (size > 0)? size: 0;
+
+   return 0;
+}
+
+static void release_conn_pipe(struct conn_t *conn)
+{
+   if(conn->pipe_fds[1]) {
+      close(conn->pipe_fds[0]);
+      close(conn->pipe_fds[1]);
+      close(conn->tee_fds[0]);
+      close(conn->tee_fds[1]);
+      conn->pipe_fds[1] = 0;
+   }
+}
+
+/* throws away 'len' bytes of socket of connection, so that stream stays in sync.
+   returns -1 if socket failed.
+ */
+static int skip_input(struct conn_t *conn, size_t len)
+{
+   char     scratch[4096];
+   ssize_t  n;
+
+   while(len) {
+      n = read(conn->fd, scratch, (len < sizeof(scratch))? len: sizeof(scratch));
+      if(n < 0 && errno == EINTR) {
+         continue;
+      }
+      if(n <= 0) {
+         return -1;
+      }
+      len -= n;
+   }
+
+   return 0;
+}
+
+/* moves 'len' bytes (at most conn->pipe_size) from socket of connection into its pipe and
+   continues '*csum' over them. data comes in through tee pipe, tee() appends it to pipe
+   without copying and what is left in tee pipe is read for checksum. so data is checked as
+   it arrives, not in file where other clients may change it meanwhile.
+   returns -1 if socket (or a pipe) failed.
+ */
+static int splice_in(struct conn_t *conn, size_t len, uint32_t *csum)
+{
+   char     buf[16 * 1024];
+   ssize_t  n;
+   ssize_t  m;
+   ssize_t  k;
+
+   while(len) {
+      n = splice(conn->fd, NULL, conn->tee_fds[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+      if(n < 0 && errno == EINTR) {
+         continue;
+      }
+      if(n <= 0) {
+         return -1;
+      }
+      len -= n;
+
+      /* tee pipe is emptied before next splice from socket */
+      while(n) {
+         m = tee(conn->tee_fds[0], conn->pipe_fds[1], n, 0);
+         if(m < 0 && errno == EINTR) {
+            continue;
+         }
+         if(m <= 0) {
+            return -1;
+         }
+         n -= m;
+         while(m) {
+            k = read(conn->tee_fds[0], buf, ((size_t) m < sizeof(buf))? m: sizeof(buf));
+            if(k < 0 && errno == EINTR) {
+               continue;
+            }
+            if(k <= 0) {
+               return -1;
+            }
+            *csum = samfs_csum(*csum, buf, k);
+            m -= k;
+         }
+      }
+   }
+
+   return 0;
+}
+
+/* moves 'len' bytes held in pipe of connection into file 'fd' at 'offset'.
+   once file can not be written (*errcode is set) rest of data is thrown away.
+   returns -1 if pipe failed.
+ */
+static int splice_out(struct conn_t *conn, int fd, off_t offset, size_t len, size_t *written, int *errcode)
+{
+   char     scratch[4096];
+   ssize_t  m;
+
+   while(len) {
+      if(*errcode) {
+         m = read(conn->pipe_fds[0], scratch, (len < sizeof(scratch))? len: sizeof(scratch));
+      }
+      else {
+         m = splice(conn->pipe_fds[0], NULL, fd, &offset, len, SPLICE_F_MOVE);
+      }
+      if(m < 0 && errno == EINTR) {
+         continue;
+      }
+      if(m <= 0) {
+         if(*errcode) {
+            return -1;
+         }
+         *errcode = (m < 0)? errno: EIO;
+         continue;
+      }
+      if(0 == *errcode) {
+         *written += m;
+      }
+      len -= m;
+   }
+
+   return 0;
+}
+
+/* request frame of a bulk write is followed by req->size bytes of data and their samfs_csum().
+   data is spliced from socket through a pipe into the file, never copied to user space but
+   for its checksum. data fitting in pipe (writes of masd up to its default -max_io) waits
+   there until checksum is verified, a corrupt write never reaches file. larger data is
+   written as it comes, a mismatch found at end fails request although range is written.
+ */
+static int handle_bulk_write(struct conn_t *conn, struct req_t *req)
+{
+   struct rsp_t   rsp;
+   int            fd;
+   struct file_ref_t ref;
+   int            errcode;
+   int            held;
+   int            failed;
+   size_t         total_write;
+   size_t         rest;
+   size_t         len;
+   off_t          offset;
+   uint32_t       csum;
+   uint32_t       data_sum;
+
+   if(conn->nonblock) {
+      /* event driven engines do not offer bulk writes */
+      return -1;
+   }
+
+   errcode = 0;
+   fd = open_req_file(req, O_WRONLY, &ref);
+   if(-1 == fd) {
+      errcode = errno;
+   }
+   if(0 == errcode && get_conn_pipe(conn) < 0) {
+      errcode = errno;
+   }
+
+   total_write = 0;
+   data_sum = SAMFS_CSUM_INIT;
+   held = (0 == errcode && req->size <= conn->pipe_size)? TRUE: FALSE;
+   failed = FALSE;
+   if(errcode) {
+      failed = (skip_input(conn, req->size) < 0);
+   }
+   else if(held) {
+      failed = (splice_in(conn, req->size, &data_sum) < 0);
+   }
+   else {
+      offset = req->offset;
+      for(rest = req->size; rest && !failed; rest -= len) {
+         len = (rest < conn->pipe_size)? rest: conn->pipe_size;
+         failed = (splice_in(conn, len, &data_sum) < 0 ||
+               splice_out(conn, fd, offset, len, &total_write, &errcode) < 0);
+         offset += len;
+      }
+   }
+   if(failed || samfs_read_full(conn->fd, &csum, sizeof(csum)) <= 0) {
+      release_conn_pipe(conn); /* may hold part of data */
+      if(fd >= 0) {
+         close_req_file(fd, &ref);
+      }
+      return -1;
+   }
+
+   if(0 == errcode && data_sum != csum) {
+      if(held) {
+         printf("ERROR IN WRITE: CHECKSUM MISMATCH, DATA DROPPED\n");
+         release_conn_pipe(conn); /* drops data */
+      }
+      else {
+         printf("ERROR IN WRITE: CHECKSUM MISMATCH, %zu BYTES AT %lld ALREADY WRITTEN\n",
+               total_write, (long long) req->offset);
+      }
+      errcode = EIO;
+      total_write = 0;
+   }
+   else if(held && splice_out(conn, fd, req->offset, req->size, &total_write, &errcode) < 0) {
+      release_conn_pipe(conn);
+   }
+   if(fd >= 0) {
+      close_req_file(fd, &ref);
+   }
+
+   STAT_ADD(stat_slot()->bytes_rcvd, req->size + sizeof(csum));
+   if(conn->client) {
+      STAT_ADD(conn->client->bytes_rcvd, req->size + sizeof(csum));
+   }
+
+   memset(&rsp, 0, sizeof(rsp));
+   rsp.status = (errcode)? FAIL: SUCCESS;
+   rsp.errcode = errcode;
+   rsp.size = total_write;
+   rsp.endofdata = TRUE;
+
+   return send_rsp(conn, req, &rsp);
+}
+
+/* request data is written at request offset, response carries number of bytes written.
+   compressed data is unpacked first, it must unpack to request size.
+ */
+static int handle_write(struct conn_t *conn, struct req_t *req)
+{
+   int            rv;
+   struct rsp_t   rsp;
+   int            fd;
+   struct file_ref_t ref;
+   size_t         total_write;
+   char           *data;
+   size_t         data_len;
+   char           *zbuf;
+   double         cpu;
+
+   if(req->opts & REQ_BULK) {
+      return handle_bulk_write(conn, req);
+   }
+
+   data = req->data;
+   data_len = req->data_len;
+   zbuf = NULL;
+   if(req->zip) {
+      cpu = samfs_cpu_sec();
+      zbuf = (req->size <= SAMFS_MAX_PAYLOAD)? malloc(req->size? req->size: 1): NULL;
+      if(NULL == zbuf) {
+         return send_error(conn, req, (req->size <= SAMFS_MAX_PAYLOAD)? ENOMEM: EPROTO);
+      }
+      rv = samfs_unzip(req->zip, req->data, req->data_len, zbuf, req->size);
+      if(rv < 0 || (size_t) rv != req->size) {
+         free(zbuf);
+         return send_error(conn, req, EPROTO);
+      }
+      zip_stat(rv, req->data_len, samfs_cpu_sec() - cpu);
+      data = zbuf;
+      data_len = rv;
+   }
+
+   fd = open_req_file(req, O_WRONLY, &ref);
+   if(-1 == fd) {
+      rv = errno;
+      free(zbuf);
+      return send_error(conn, req, rv);
+   }
+
+   memset(&rsp, 0, sizeof(rsp));
+   rsp.status = SUCCESS;
+   total_write = 0;
+   while(total_write < data_len) {
+      rv = pwrite(fd, data + total_write, data_len - total_write, req->offset + total_write);
+      if(rv < 0) {
+         rsp.status = FAIL;
+         rsp.errcode = errno;
+         break;
+      }
+      total_write += rv;
+   }
+   rsp.size = total_write;
+   rsp.endofdata = TRUE;
+
+   close_req_file(fd, &ref);
+   free(zbuf);
+
+   /* send client write status */
+   return send_rsp(conn, req, &rsp);
+}
+
+/* truncates through client's handle or a cached descriptor writable already, a path is
+   never opened for it, open() of a FIFO would block until a reader shows up.
+ */
+static int handle_truncate(struct conn_t *conn, struct req_t *req)
+{
+   int               rv;
+   int               fd;
+   int               err;
+   char              local_path[PATH_MAX];
+   struct file_ref_t ref;
+   struct rsp_t      rsp;
+
+   if(get_local_path(local_path, req, req->uri) < 0) {
+      return send_error(conn, req, errno);
+   }
+
+   memset(&rsp, 0, sizeof(rsp));
+   rv = -1;
+   fd = -1;
+   ref.ent = NULL;
+   ref.slot = (req->fh)? get_handle(req->fh): -1;
+   if(ref.slot >= 0) {
+      fd = handles[ref.slot].fd;
+   }
+   else if(fd_cache_limit) {
+      ref.ent = fd_cache_hit(local_path, fd_hash(local_path), O_WRONLY);
+      fd = (ref.ent)? ref.ent->fd: -1;
+   }
+   if(fd >= 0) {
+      rv = ftruncate(fd, req->offset);
+      err = errno;
+      close_req_file(fd, &ref);
+      errno = err;
+      if(rv < 0 && (errno == EBADF || errno == EINVAL)) {
+         fd = -1;  /* handle is not open for writing (or not a regular file), path decides */
+      }
+   }
+   if(fd < 0) {
+      rv = truncate(local_path, req->offset);
+   }
+   if(0 == rv) {
+      rsp.status = SUCCESS;
+   }
+   else {
+      rsp.status = FAIL;
+      rsp.errcode = errno;
+   }
+   rsp.endofdata = TRUE;
+
+   return send_rsp(conn, req, &rsp);
+}
+
+static int handle_unlink(struct conn_t *conn, struct req_t *req)
+{
+   int            rv;
+   char           local_path[PATH_MAX];
+   struct rsp_t   rsp;
+
+   if(get_local_path(local_path, req, req->uri) < 0) {
+      return send_error(conn, req, errno);
+   }
+
+   memset(&rsp, 0, sizeof(rsp));
+   rv = unlink(local_path);
+   if(0 == rv) {
+      fd_cache_forget(local_path, FALSE);
+      rsp.status = SUCCESS;
+   }
+   else {
+      rsp.status = FAIL;
+      rsp.errcode = errno;
+   }
+   rsp.endofdata = TRUE;
+
+   return send_rsp(conn, req, &rsp);
+}
+
+static int handle_rename(struct conn_t *conn, struct req_t *req)
+{
+   int            rv;
+   char           local_path[PATH_MAX];
+   char           new_path[PATH_MAX];
+   struct rsp_t   rsp;
+
+   if(get_local_path(local_path, req, req->uri) < 0 ||
+      get_local_path(new_path, req, req->npath) < 0) {
+      return send_error(conn, req, errno);
+   }
+
+   memset(&rsp, 0, sizeof(rsp));
+   rv = rename(local_path, new_path);
+   if(0 == rv) {
+      /* replaced target goes too */
+      fd_cache_forget(local_path, TRUE);
+      fd_cache_forget(new_path, TRUE);
+      rsp.status = SUCCESS;
+   }
+   else {
+      rsp.status = FAIL;
+      rsp.errcode = errno;
+   }
+   rsp.endofdata = TRUE;
+
+   return send_rsp(conn, req, &rsp);
+}
+
+static int handle_chmod(struct conn_t *conn, struct req_t *req)
+{
+   int            rv;
+   char           local_path[PATH_MAX];
+   struct rsp_t   rsp;
+
+   if(get_local_path(local_path, req, req->uri) < 0) {
+      return send_error(conn, req, errno);
+   }
+
+   memset(&rsp, 0, sizeof(rsp));
+   rv = chmod(local_path, req->mode);
+   if(0 == rv) {
+      /* cached descriptor keeps access it was opened with, new permissions must apply */
+      fd_cache_forget(local_path, FALSE);
+      rsp.status = SUCCESS;
+   }
+   else {
+      rsp.status = FAIL;
+      rsp.errcode = errno;
+   }
+   rsp.endofdata = TRUE;
+
+   return send_rsp(conn, req, &rsp);
+}
+
+/* request data carries new access/modification times, current time is used if it is empty */
+static int handle_utime(struct conn_t *conn, struct req_t *req)
+{
+   int            rv;
+   char           local_path[PATH_MAX];
+   struct utimbuf tm;
+   struct rsp_t   rsp;
+
+   if(get_local_path(local_path, req, req->uri) < 0) {
+      return send_error(conn, req, errno);
+   }
+
+   memset(&rsp, 0, sizeof(rsp));
+   if(req->data_len == sizeof(struct utimbuf)) {
+      memcpy(&tm, req->data, sizeof(struct utimbuf));
+      rv = utime(local_path, &tm);
+   }
+   else {
+      rv = utime(local_path, NULL);
+   }
+   if(0 == rv) {
+      rsp.status = SUCCESS;
+   }
+   else {
+      rsp.status = FAIL;
+      rsp.errcode = errno;
+   }
+   rsp.endofdata = TRUE;
+
+   return send_rsp(conn, req, &rsp);
+}
+
+static int handle_statfs(struct conn_t *conn, struct req_t *req)
+{
+   int            rv;
+   char           local_path[PATH_MAX];
+   struct statvfs st;
+   struct rsp_t   rsp;
+
+   if(get_local_path(local_path, req, req->uri) < 0) {
+      return send_error(conn, req, errno);
+   }
+
+   memset(&rsp, 0, sizeof(rsp));
+   rv = statvfs(local_path, &st);
+   if(0 == rv) {
+      rsp.status = SUCCESS;
+      rsp.data = (char *) &st;
+      rsp.data_len = sizeof(struct statvfs);
+   }
+   else {
+      rsp.status = FAIL;
+      rsp.errcode = errno;
+   }
+   rsp.endofdata = TRUE;
+
+   return send_rsp(conn, req, &rsp);
+}
+
+/* returns >= 0 if request was served, -1 if connection to client is no longer usable */
+static int dispatch_req(struct conn_t *conn, struct req_t *req)
+{
+   int rv;
+
+   rv = 0;
+   switch(req->msg) {
+      case GETATTR:
+         rv = handle_getattr(conn, req);
+         break;
+      case MKDIR:
+         rv = handle_mkdir(conn, req);
+         break;
+      case READDIR:
+         rv = handle_readdir(conn, req);
+         break;
+      case READDIRPLUS:
+         rv = handle_readdirplus(conn, req);
+         break;
+      case RMDIR:
+         rv = handle_rmdir(conn, req);
+         break;
+      case CREATE:
+         rv = handle_create(conn, req);
+         break;
+      case OPEN:
+         rv = handle_open(conn, req);
+         break;
+      case RELEASE:
+         rv = handle_release(conn, req);
+         break;
+      case READ:
+         rv = handle_read(conn, req);
+         break;
+      case WRITE:
+         rv = handle_write(conn, req);
+         break;
+      case TRUNCATE:
+         rv = handle_truncate(conn, req);
+         break;
+      case UNLINK:
+         rv = handle_unlink(conn, req);
+         break;
+      case RENAME:
+         rv = handle_rename(conn, req);
+         break;
+      case CHMOD:
+         rv = handle_chmod(conn, req);
+         break;
+      case UTIME:
+         rv = handle_utime(conn, req);
+         break;
+      case STATFS:
+         rv = handle_statfs(conn, req);
+         break;
+      case HELLO:
+         rv = handle_hello(conn, req);
+         break;
+      default:
+         /* every request gets a response, even if we do not understand it */
+         rv = send_error(conn, req, ENOSYS);
+         break;
+   }
+
+   return rv;
+}
+
+/* serves request, counts its latency and traces it */
+static int process_req(struct conn_t *conn, struct req_t *req)
+{
+   uint64_t end;
+   int      rv;
+
+   req->start_ns = samfs_now_ns();
+   req->send_ns = 0;
+   req->errcode = 0;
+   rv = dispatch_req(conn, req);
+   end = samfs_now_ns();
+   lat_stat(req, end);
+   trace_req(conn, req, end);
+
+   return rv;
+}
+
+static char *string_rate(uint64_t rate, char *srate)
+{
+   float frate;
+   int level;
+   char suffix[][8] = {"b/s", "kb/s", "mb/s", "gb/s", "", "", "", ""};
+
+   frate = rate * 8; /* convert it to bits */
+   level = 0;
+   while(frate >= 512.0f) {
+      frate = frate / 1024;
+      level++;
+   }  
+
+   sprintf(srate, "%.2f %s", frate, suffix[level]);
+
+   return srate;
+}
+
+/* adds up counters of all slots into 'sum' */
+static void stat_sum(struct stat_slot_t *sum)
+{
+   struct stat_slot_t *slot;
+   int                i;
+   int                m;
+   int                ph;
+   int                b;
+
+   memset(sum, 0, sizeof(struct stat_slot_t));
+   for(i = 0; i < STAT_SLOTS; i++) {
+      slot = &sam_stat->slots[i];
+      sum->bytes_rcvd += STAT_GET(slot->bytes_rcvd);
+      sum->bytes_sent += STAT_GET(slot->bytes_sent);
+      sum->zip_raw += STAT_GET(slot->zip_raw);
+      sum->zip_wire += STAT_GET(slot->zip_wire);
+      sum->zip_cpu_ns += STAT_GET(slot->zip_cpu_ns);
+      sum->fd_hits += STAT_GET(slot->fd_hits);
+      sum->fd_misses += STAT_GET(slot->fd_misses);
+      for(m = 0; m < STAT_MSGS; m++) {
+         if(0 == STAT_GET(slot->ops[m])) {
+            continue;
+         }
+         sum->ops[m] += STAT_GET(slot->ops[m]);
+         for(ph = 0; ph < LAT_PHASES; ph++) {
+            sum->lat_ns[m][ph] += STAT_GET(slot->lat_ns[m][ph]);
+            for(b = 0; b < SAMFS_LAT_BUCKETS; b++) {
+               sum->lat[m][ph][b] += STAT_GET(slot->lat[m][ph][b]);
+            }
+         }
+      }
+   }
+}
+
+/* prints statistics once, as 'name value' lines for scripts */
+static void dump_stats(void)
+{
+   static struct stat_slot_t total;
+   static const double pcts[] = {0.5, 0.99, 0.999};
+   static const char *pct_names[] = {"p50", "p99", "p999"};
+   int m;
+   int ph;
+   int i;
+
+   stat_sum(&total);
+   printf("server_pid %d\n", sam_stat->server_pid);
+   printf("conc_method %s\n", (sam_stat->conc_method < SAM_UNDEFINED)? conc_method_names[sam_stat->conc_method]: "");
+   printf("clients_select %u\n", sam_stat->select_count);
+   printf("clients_pthread %u\n", sam_stat->thread_count);
+   printf("clients_fork %u\n", sam_stat->forked_count);
+   printf("clients_epoll %u\n", sam_stat->epoll_count);
+   printf("clients_pool %u\n", sam_stat->pool_count);
+   printf("clients_uring %u\n", sam_stat->uring_count);
+   printf("bytes_rcvd %llu\n", (unsigned long long) total.bytes_rcvd);
+   printf("bytes_sent %llu\n", (unsigned long long) total.bytes_sent);
+   printf("zip_raw_bytes %llu\n", (unsigned long long) total.zip_raw);
+   printf("zip_wire_bytes %llu\n", (unsigned long long) total.zip_wire);
+   printf("zip_cpu_ns %llu\n", (unsigned long long) total.zip_cpu_ns);
+   printf("fd_cache_hits %llu\n", (unsigned long long) total.fd_hits);
+   printf("fd_cache_misses %llu\n", (unsigned long long) total.fd_misses);
+   for(m = 0; m < STAT_MSGS; m++) {
+      if(0 == total.ops[m]) {
+         continue;
+      }
+      printf("op_%s_count %llu\n", msg_names[m], (unsigned long long) total.ops[m]);
+      for(ph = 0; ph < LAT_PHASES; ph++) {
+         for(i = 0; i < 3; i++) {
+            printf("op_%s_%s_%s_us %llu\n", msg_names[m], phase_names[ph], pct_names[i],
+                  (unsigned long long) samfs_lat_pct(total.lat[m][ph], pcts[i]));
+         }
+      }
+   }
+}
+
+/* writes one latency histogram in prometheus format, bucket bounds are powers of 2 of microseconds */
+static void metrics_hist(FILE *fp, const char *op, const char *phase, const uint32_t *hist, uint64_t sum_ns)
+{
+   uint64_t count;
+   int      b;
+   int      k;
+
+   count = 0;
+   b = 0;
+   for(k = 0; k < SAMFS_LAT_MAX_BITS; k++) {
+      while(b < SAMFS_LAT_BUCKETS && samfs_lat_max(b) < (1ULL << k)) {
+         count += hist[b++];
+      }
+      fprintf(fp, "samd_request_seconds_bucket{op=\"%s\",phase=\"%s\",le=\"%g\"} %llu\n",
+            op, phase, (1ULL << k) / 1e6, (unsigned long long) count);
+   }
+   while(b < SAMFS_LAT_BUCKETS) {
+      count += hist[b++];
+   }
+   fprintf(fp, "samd_request_seconds_bucket{op=\"%s\",phase=\"%s\",le=\"+Inf\"} %llu\n",
+         op, phase, (unsigned long long) count);
+   fprintf(fp, "samd_request_seconds_sum{op=\"%s\",phase=\"%s\"} %.9f\n", op, phase, sum_ns / 1e9);
+   fprintf(fp, "samd_request_seconds_count{op=\"%s\",phase=\"%s\"} %llu\n", op, phase, (unsigned long long) count);
+}
+
+/* writes all statistics in prometheus text exposition format */
+static void metrics_write(FILE *fp)
+{
+   static struct stat_slot_t total;
+   struct client_stat_t *client;
+   char                 ip[INET_ADDRSTRLEN];
+   unsigned int         conns[SAM_UNDEFINED];
+   uint32_t             addr;
+   int                  m;
+   int                  ph;
+   int                  i;
+
+   stat_sum(&total);
+
+   fprintf(fp, "# HELP samd_bytes_received_total Bytes received from clients.\n");
+   fprintf(fp, "# TYPE samd_bytes_received_total counter\n");
+   fprintf(fp, "samd_bytes_received_total %llu\n", (unsigned long long) total.bytes_rcvd);
+   fprintf(fp, "# HELP samd_bytes_sent_total Bytes sent to clients.\n");
+   fprintf(fp, "# TYPE samd_bytes_sent_total counter\n");
+   fprintf(fp, "samd_bytes_sent_total %llu\n", (unsigned long long) total.bytes_sent);
+
+   conns[SAM_SELECT] = sam_stat->select_count;
+   conns[SAM_PTHREAD] = sam_stat->thread_count;
+   conns[SAM_FORK] = sam_stat->forked_count;
+   conns[SAM_EPOLL] = sam_stat->epoll_count;
+   conns[SAM_POOL] = sam_stat->pool_count;
+   conns[SAM_URING] = sam_stat->uring_count;
+   fprintf(fp, "# HELP samd_connections Clients connected, by concurrency method serving them.\n");
+   fprintf(fp, "# TYPE samd_connections gauge\n");
+   for(i = 0; i < SAM_UNDEFINED; i++) {
+      fprintf(fp, "samd_connections{method=\"%s\"} %u\n", conc_method_names[i], conns[i]);
+   }
+
+   fprintf(fp, "# HELP samd_fd_cache_hits_total Path lookups served from descriptor cache.\n");
+   fprintf(fp, "# TYPE samd_fd_cache_hits_total counter\n");
+   fprintf(fp, "samd_fd_cache_hits_total %llu\n", (unsigned long long) total.fd_hits);
+   fprintf(fp, "# HELP samd_fd_cache_misses_total Path lookups that had to open or stat the path.\n");
+   fprintf(fp, "# TYPE samd_fd_cache_misses_total counter\n");
+   fprintf(fp, "samd_fd_cache_misses_total %llu\n", (unsigned long long) total.fd_misses);
+
+   fprintf(fp, "# HELP samd_compression_raw_bytes_total Bytes of data compressed or unpacked.\n");
+   fprintf(fp, "# TYPE samd_compression_raw_bytes_total counter\n");
+   fprintf(fp, "samd_compression_raw_bytes_total %llu\n", (unsigned long long) total.zip_raw);
+   fprintf(fp, "# HELP samd_compression_wire_bytes_total Bytes that data took on the wire.\n");
+   fprintf(fp, "# TYPE samd_compression_wire_bytes_total counter\n");
+   fprintf(fp, "samd_compression_wire_bytes_total %llu\n", (unsigned long long) total.zip_wire);
+   fprintf(fp, "# HELP samd_compression_cpu_seconds_total CPU time spent compressing and unpacking.\n");
+   fprintf(fp, "# TYPE samd_compression_cpu_seconds_total counter\n");
+   fprintf(fp, "samd_compression_cpu_seconds_total %.9f\n", total.zip_cpu_ns / 1e9);
+
+   fprintf(fp, "# HELP samd_requests_total Requests served, by operation.\n");
+   fprintf(fp, "# TYPE samd_requests_total counter\n");
+   for(m = 0; m < STAT_MSGS; m++) {
+      if(total.ops[m]) {
+         fprintf(fp, "samd_requests_total{op=\"%s\"} %llu\n", msg_names[m], (unsigned long long) total.ops[m]);
+      }
+   }
+   fprintf(fp, "# HELP samd_request_seconds Request latency, by operation and phase (queue, fs, send).\n");
+   fprintf(fp, "# TYPE samd_request_seconds histogram\n");
+   for(m = 0; m < STAT_MSGS; m++) {
+      if(0 == total.ops[m]) {
+         continue;
+      }
+      for(ph = 0; ph < LAT_PHASES; ph++) {
+         metrics_hist(fp, msg_names[m], phase_names[ph], total.lat[m][ph], total.lat_ns[m][ph]);
+      }
+   }
+
+   fprintf(fp, "# HELP samd_client_bytes_received_total Bytes received, by client address.\n");
+   fprintf(fp, "# TYPE samd_client_bytes_received_total counter\n");
+   for(i = 0; i < CLIENT_SLOTS; i++) {
+      client = &sam_stat->clients[i];
+      addr = STAT_GET(client->addr);
+      if(addr) {
+         inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+         fprintf(fp, "samd_client_bytes_received_total{client=\"%s\"} %llu\n", ip,
+               (unsigned long long) STAT_GET(client->bytes_rcvd));
+      }
+   }
+   fprintf(fp, "# HELP samd_client_bytes_sent_total Bytes sent, by client address.\n");
+   fprintf(fp, "# TYPE samd_client_bytes_sent_total counter\n");
+   for(i = 0; i < CLIENT_SLOTS; i++) {
+      client = &sam_stat->clients[i];
+      addr = STAT_GET(client->addr);
+      if(addr) {
+         inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+         fprintf(fp, "samd_client_bytes_sent_total{client=\"%s\"} %llu\n", ip,
+               (unsigned long long) STAT_GET(client->bytes_sent));
+      }
+   }
+}
+
+/* listening socket of metrics endpoint. 'addr' is path of a unix socket if it has a '/',
+   else '[ip:]port' of a TCP socket (ip defaults to 127.0.0.1).
+ */
+static int create_metrics_server(const char *addr)
+{
+   struct sockaddr_un   sun;
+   struct sockaddr_in   sin;
+   char                 ip[32];
+   const char           *port;
+   int                  fd;
+   int                  optval;
+   int                  rv;
+
+   if(strchr(addr, '/')) {
+      if(strlen(addr) >= sizeof(sun.sun_path)) {
+         errno = ENAMETOOLONG;
+         return -1;
+      }
+      fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if(fd < 0) {
+         return -1;
+      }
+      memset(&sun, 0, sizeof(sun));
+      sun.sun_family = AF_UNIX;
+      strcpy(sun.sun_path, addr);
+      unlink(addr);  /* left behind by an earlier server */
+      rv = bind(fd, (struct sockaddr *) &sun, sizeof(sun));
+   }
+   else {
+      strcpy(ip, "127.0.0.1");
+      port = strrchr(addr, ':');
+      if(port) {
+         if(port - addr >= sizeof(ip)) {
+            errno = EINVAL;
+            return -1;
+         }
+         memcpy(ip, addr, port - addr);
+         ip[port - addr] = '\0';
+         port++;
+      }
+      else {
+         port = addr;
+      }
+      fd = socket(AF_INET, SOCK_STREAM, 0);
+      if(fd < 0) {
+         return -1;
+      }
+      optval = 1;
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+      memset(&sin, 0, sizeof(sin));
+      sin.sin_family = AF_INET;
+      sin.sin_addr.s_addr = inet_addr(ip);
+      sin.sin_port = htons(atoi(port));
+      rv = bind(fd, (struct sockaddr *) &sin, sizeof(sin));
+   }
+   if(rv < 0 || listen(fd, 16) < 0) {
+      rv = errno;
+      close(fd);
+      errno = rv;
+      return -1;
+   }
+
+   return fd;
+}
+
+/* answers scrapers on 'addr' with one HTTP response each, never returns.
+   counters are only read from shared memory, serving threads are never held up.
+ */
+static void serve_metrics(const char *addr)
+{
+   struct timeval tv;
+   char           buf[1024];
+   char           head[128];
+   char           *body;
+   size_t         body_len;
+   size_t         len;
+   FILE           *fp;
+   int            server_fd;
+   int            fd;
+   ssize_t        n;
+
+   server_fd = create_metrics_server(addr);
+   if(server_fd < 0) {
+      printf("metrics :: Can not listen on '%s': %s\n", addr, strerror(errno));
+      return;
+   }
+
+   while(1) {
+      fd = accept(server_fd, NULL, NULL);
+      if(fd < 0) {
+         continue;
+      }
+      /* a scraper that does not send its request in time is dropped */
+      tv.tv_sec = 2;
+      tv.tv_usec = 0;
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+      len = 0;
+      while(len < sizeof(buf) - 1) {
+         n = read(fd, buf + len, sizeof(buf) - 1 - len);
+         if(n <= 0) {
+            break;
+         }
+         len += n;
+         buf[len] = '\0';
+         if(strstr(buf, "\r\n\r\n") || strstr(buf, "\n\n")) {
+            break;
+         }
+      }
+      buf[len] = '\0';
+
+      body = NULL;
+      body_len = 0;
+      if(strncmp(buf, "GET /metrics", 12) == 0 || strncmp(buf, "GET / ", 6) == 0) {
+         fp = open_memstream(&body, &body_len);
+         if(fp) {
+            metrics_write(fp);
+            fclose(fp);
+         }
+      }
+      if(body) {
+         len = sprintf(head, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+               "Content-Length: %zu\r\n\r\n", body_len);
+         if(samfs_write_full(fd, head, len) > 0) {
+            samfs_write_full(fd, body, body_len);
+         }
+      }
+      else {
+         len = sprintf(head, "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+         samfs_write_full(fd, head, len);
+      }
+      free(body);
+      close(fd);
+   }
+}
+
+static void *metrics_thread(void *data)
+{
+   serve_metrics(data);
+
+   return NULL;
+}
+
+static void print_stats(void)
+{
+   char uprate[16], dnrate[16];
+   char queue[16], fs[16], send[16];
+   static struct stat_slot_t total;
+   static struct stat_slot_t last;
+   uint64_t uplink_rate, dnlink_rate;
+   uint64_t uplink_avg, dnlink_avg;
+   int m;
+
+   stat_sum(&last);
+   uplink_avg = 0;
+   dnlink_avg = 0;
+   while(1) {
+      printf("\x1b[H\x1b[2J"); /* clears screen */
+
+      /* rates are bytes counted since last reading, a second ago */
+      stat_sum(&total);
+      uplink_rate = total.bytes_sent - last.bytes_sent;
+      dnlink_rate = total.bytes_rcvd - last.bytes_rcvd;
+
+      if(uplink_avg)
+         uplink_avg = ((uplink_avg * 2) + uplink_rate) / 3;
+      else
+         uplink_avg = uplink_rate;
+
+      if(dnlink_avg)
+         dnlink_avg = ((dnlink_avg * 2) + dnlink_rate) / 3;
+      else
+         dnlink_avg = dnlink_rate;
+
+      printf("\n");
+      printf("   +--------------------------------------------------------------------------+\n");
+      printf("   |                             Server Dashboard                             |\n");
+      printf("   +--------------------------------------------------------------------------+\n");
+      printf("   | Server Binary : %-27s Server PID : %15d |\n", sam_stat->server_name, sam_stat->server_pid);
+      printf("   | Source Dir    : %-27s Server IP  : %15s |\n", sam_stat->server_dir, sam_stat->server_ip);
+      printf("   +--------------------------------------------------------------------------+\n");
+      printf("   | Concurrency Method Being Used : ");
+      switch(sam_stat->conc_method) {
+         case SAM_SELECT:
+            printf("%-40s |\n", "select");
+            break;
+         case SAM_PTHREAD:
+            printf("%-40s |\n", "pthread");
+            break;
+         case SAM_FORK:
+            printf("%-40s |\n", "fork");
+            break;
+         case SAM_EPOLL:
+            printf("%-40s |\n", "epoll");
+            break;
+         case SAM_POOL:
+            printf("%-40s |\n", "pool");
+            break;
+         case SAM_URING:
+            printf("%-40s |\n", "io_uring");
+            break;
+         default:
+            printf("%-40s |\n", "");
+            break;
+      }
+      printf("   +--------------------------------------------------------------------------+\n");
+      printf("   | Clients Connected Using _                                                |\n");
+      printf("   | select() : %-10u     pthread() : %-10u     fork() : %-10u |\n",
+            sam_stat->select_count, sam_stat->thread_count, sam_stat->forked_count);
+      printf("   | epoll()  : %-10u     pool()    : %-10u     uring(): %-10u |\n",
+            sam_stat->epoll_count, sam_stat->pool_count, sam_stat->uring_count);
+      printf("   |                                                                          |\n");
+      printf("   | Total Connected Clients : %-46u |\n",
+            sam_stat->select_count + sam_stat->thread_count + sam_stat->forked_count + sam_stat->epoll_count +
+            sam_stat->pool_count + sam_stat->uring_count);
+      printf("   +--------------------------------------------------------------------------+\n");
+#if 0
+      printf("   | Total Bytes Received : %11llu       Total Bytes Sent  : %11llu |\n",
+            (unsigned long long) total.bytes_rcvd, (unsigned long long) total.bytes_sent);
+      printf("   | Inst. Downlink Rate  : %11s       Inst. Uplink Rate : %11s |\n", 
+            string_rate(dnlink_rate, dnrate), string_rate(uplink_rate, uprate));
+      printf("   | Avg. Downlink Rate   : %11s       Avg. Uplink Rate  : %11s |\n", 
+            string_rate(dnlink_avg, dnrate), string_rate(uplink_avg, uprate));
+#else
+      printf("   | Total Bytes Received : %11llu        Total Bytes Sent : %11llu |\n",
+            (unsigned long long) total.bytes_rcvd, (unsigned long long) total.bytes_sent);
+      printf("   | Downlink Data Rate   : %11s        Uplink Data Rate : %11s |\n", 
+            string_rate(dnlink_rate, dnrate), string_rate(uplink_rate, uprate));
+#endif
+      printf("   | Compression Ratio    : %11.2f        Compression CPU  : %9.2f s |\n",
+            (total.zip_wire)? (double) total.zip_raw / total.zip_wire: 1.0, total.zip_cpu_ns / 1e9);
+      printf("   +--------------------------------------------------------------------------+\n");
+      printf("   | %-72s |\n", "Request Latency since start, p50/p99/p99.9 (u = us, m = ms, s = sec)");
+      printf("   | %-11s %7s  %-16s %-16s %-16s  |\n", "Request", "Ops/s", "Queue", "File System", "Send");
+      for(m = 0; m < STAT_MSGS; m++) {
+         if(0 == total.ops[m]) {
+            continue;
+         }
+         printf("   | %-11s %7llu  %-16s %-16s %-16s  |\n", msg_names[m],
+               (unsigned long long) (total.ops[m] - last.ops[m]), samfs_lat_pcts(total.lat[m][LAT_QUEUE], queue),
+               samfs_lat_pcts(total.lat[m][LAT_FS], fs), samfs_lat_pcts(total.lat[m][LAT_SEND], send));
+      }
+      printf("   +--------------------------------------------------------------------------+\n");
+      printf("\n");
+      last = total;
+
+      sleep(1); /* update after every one second */
+   }
+}
+
+/* blocking service of a connection, returns when client closes it */
+static void serve_conn(int client_fd)
+{
+   struct conn_t  conn;
+
+   memset(&conn, 0, sizeof(conn));
+   conn.fd = client_fd;
+   conn.client = client_stat(client_fd);
+
+   /* serve requests until client closes the connection */
+   while(read_req(&conn, &conn.req) > 0) {
+      if(process_req(&conn, &conn.req) < 0) {
+         break;
+      }
+   }
+
+   free(conn.req.buf);
+   release_conn_pipe(&conn);
+}
+
+static void *handle_client_thread(void *data)
+{
+   int client_fd;
+
+   client_fd = (int) data;
+
+   STAT_ADD(sam_stat->thread_count, 1);
+
+   serve_conn(client_fd);
+   
+   close(client_fd);
+   if(client_fd < FD_SETSIZE) {
+      FD_CLR(client_fd, &thread_fds);
+   }
+   
+   STAT_SUB(sam_stat->thread_count, 1);
+
+   return NULL;
+}
+
+static int handle_client_fork(int client_fd)
+{
+   int            curr_fd;
+
+   /* processes do not see changes made by each other, nothing can be cached any more */
+   fd_cache_off();
+
+   if(fork() == 0) {
+      /* inside child */
+      handles_off = TRUE;
+      stat_slot_forget();
+      
+      STAT_ADD(sam_stat->forked_count, 1);
+   
+      /* close all other opened fds */
+      for(curr_fd = 0; curr_fd < FD_SETSIZE; curr_fd++) {
+         if(FD_ISSET(curr_fd, &select_fds)) {
+            close(curr_fd);
+         }
+         if(FD_ISSET(curr_fd, &thread_fds)) {
+            close(curr_fd);
+         }
+      }
+      serve_conn(client_fd);
+      close(client_fd);
+      
+      STAT_SUB(sam_stat->forked_count, 1);
+      stat_slot_release(stat_slot());
+      
+      //return 0;
+      usleep(10);
+      exit(0);
+   }
+   else {
+      /* inside parent */
+      close(client_fd);
+   }
+
+   return 0;
+}
+
+/* find next complete request in receive buffer of event driven connection.
+   returns 1 if conn->req is ready to be served, 0 if more bytes are needed
+   ('need' is set to bytes required from start of unserved data), -1 on corrupted stream.
+ */
+static int next_req(struct conn_t *conn, size_t *need)
+{
+   struct frame_hdr_t   hdr;
+   size_t               avail;
+   char                 *payload;
+
+   avail = conn->rx_len - conn->rx_pos;
+   if(avail < sizeof(hdr)) {
+      *need = sizeof(hdr);
+      return 0;
+   }
+
+   memcpy(&hdr, conn->rx_buf + conn->rx_pos, sizeof(hdr));
+   if(!is_valid_hdr(&hdr)) {
+      return -1;
+   }
+   if(avail < sizeof(hdr) + hdr.len) {
+      *need = sizeof(hdr) + hdr.len;
+      return 0;
+   }
+
+   payload = conn->rx_buf + conn->rx_pos + sizeof(hdr);
+   conn->rx_pos += sizeof(hdr) + hdr.len;
+   if(decode_req(&conn->req, &hdr, payload) < 0) {
+      return -1;
+   }
+   conn->req.rcvd_ns = conn->rx_ns;
+   if(conn->client) {
+      STAT_ADD(conn->client->bytes_rcvd, sizeof(hdr) + hdr.len);
+   }
+
+   return 1;
+}
+
+/* make sure 'need' bytes fit in receive buffer from start of unserved data */
+static int reserve_rx(struct conn_t *conn, size_t need)
+{
+   char     *buf;
+
+   if(conn->rx_pos == conn->rx_len) {
+      conn->rx_pos = conn->rx_len = 0;
+   }
+   if(need < SAMFS_MIN_PAYLOAD) {
+      need = SAMFS_MIN_PAYLOAD; /* read in big chunks, several small frames may arrive together */
+   }
+   if(conn->rx_pos + need <= conn->rx_size) {
+      return 0;
+   }
+
+   /* move unserved bytes to start of buffer, grow it if still not enough */
+   if(conn->rx_pos) {
+      memmove(conn->rx_buf, conn->rx_buf + conn->rx_pos, conn->rx_len - conn->rx_pos);
+      conn->rx_len -= conn->rx_pos;
+      conn->rx_pos = 0;
+   }
+   if(need > conn->rx_size) {
+      buf = realloc(conn->rx_buf, need);
+      if(NULL == buf) {
+         return -1;
+      }
+      conn->rx_buf = buf;
+      conn->rx_size = need;
+   }
+
+   return 0;
+}
+
+/* give back memory of large buffers once connection is idle */
+static void trim_conn(struct conn_t *conn)
+{
+   if(conn->rx_pos == conn->rx_len && conn->rx_size > SAMFS_MIN_PAYLOAD) {
+      free(conn->rx_buf);
+      conn->rx_buf = NULL;
+      conn->rx_size = conn->rx_len = conn->rx_pos = 0;
+   }
+   if(conn->tx_pos == conn->tx_len && conn->tx_size > SAMFS_MIN_PAYLOAD) {
+      free(conn->tx_buf);
+      conn->tx_buf = NULL;
+      conn->tx_size = conn->tx_len = conn->tx_pos = 0;
+   }
+}
+
+/* state machine of a non-blocking connection, run whenever its socket becomes ready.
+   sends queued responses, serves every complete request and reads until socket is drained.
+   returns 0 to wait for next event, -1 if connection has to be closed.
+ */
+static int serve_conn_events(struct conn_t *conn)
+{
+   struct frame_hdr_t   hdr;
+   struct rsp_hdr_t     rhdr;
+   struct iovec         iov[2];
+   int                  rv;
+   ssize_t              n;
+   size_t               need;
+   size_t               frame;
+
+   while(1) {
+      /* push out queued responses first, no new requests are taken while client is not reading them */
+      if(conn->tx_pos < conn->tx_len) {
+         n = write(conn->fd, conn->tx_buf + conn->tx_pos, conn->tx_len - conn->tx_pos);
+         if(n < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+               return 0;  /* EPOLLOUT will bring us back */
+            }
+            if(errno == EINTR) {
+               continue;
+            }
+            return -1;
+         }
+         conn->tx_pos += n;
+         continue;
+      }
+
+      /* then file data of streamed read response */
+      if(conn->tx_file_len) {
+         n = sendfile(conn->fd, conn->tx_file_fd, &conn->tx_file_off, conn->tx_file_len);
+         if(n < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+               return 0;
+            }
+            if(errno == EINTR) {
+               continue;
+            }
+            return -1;
+         }
+         if(0 == n) {
+            return -1;  /* file got shorter than promised length */
+         }
+         conn->tx_file_len -= n;
+         if(conn->tx_file_len) {
+            continue;
+         }
+         if(0 == conn->tx_file_rest) {
+            close_req_file(conn->tx_file_fd, &conn->tx_file_ref);
+            continue;
+         }
+
+         /* header of next frame of streamed read response, its data follows it */
+         frame = (conn->tx_file_rest < SAMFS_MAX_PAYLOAD)? conn->tx_file_rest: SAMFS_MAX_PAYLOAD;
+         conn->tx_file_rest -= frame;
+         file_frame_hdr(&hdr, &rhdr, conn->tx_file_msg, conn->tx_file_id, frame, 0 == conn->tx_file_rest);
+         iov[0].iov_base = &hdr;
+         iov[0].iov_len = sizeof(hdr);
+         iov[1].iov_base = &rhdr;
+         iov[1].iov_len = sizeof(rhdr);
+         if(queue_tx(conn, iov, 2) < 0) {
+            return -1;
+         }
+         conn->tx_file_len = frame;
+         continue;
+      }
+
+      /* then next frame of buffered read response, request stays in conn->req till it is done */
+      if(conn->tx_read) {
+         if(queue_read_frame(conn) < 0) {
+            return -1;
+         }
+         continue;
+      }
+
+      /* serve next request which is already received completely */
+      rv = next_req(conn, &need);
+      if(rv < 0) {
+         return -1;
+      }
+      if(rv > 0) {
+         if(process_req(conn, &conn->req) < 0) {
+            return -1;
+         }
+         continue;
+      }
+
+      /* partial frame, read more */
+      if(reserve_rx(conn, need) < 0) {
+         return -1;
+      }
+      n = read(conn->fd, conn->rx_buf + conn->rx_len, conn->rx_size - conn->rx_len);
+      if(0 == n) {
+         return -1;  /* client closed connection */
+      }
+      if(n < 0) {
+         if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            trim_conn(conn);
+            return 0;  /* drained, EPOLLIN will bring us back */
+         }
+         if(errno == EINTR) {
+            continue;
+         }
+         return -1;
+      }
+      conn->rx_len += n;
+      conn->rx_ns = samfs_now_ns();
+   }
+}
+
+static void close_conn_events(struct conn_t *conn)
+{
+   if(conn->tx_file_len || conn->tx_read) {
+      close_req_file(conn->tx_file_fd, &conn->tx_file_ref);
+   }
+   close(conn->fd);
+   free(conn->rx_buf);
+   free(conn->tx_buf);
+   free(conn);
+
+   STAT_SUB(sam_stat->epoll_count, 1);
+}
+
+/* accept all pending connections and add them to 'epoll_fd' */
+static void accept_conn_events(int epoll_fd, int server_fd)
+{
+   int                  client_fd;
+   int                  optval;
+   struct conn_t        *conn;
+   struct epoll_event   ev;
+
+   while(1) {
+      client_fd = accept4(server_fd, NULL, NULL, SOCK_NONBLOCK);
+      if(client_fd < 0) {
+         if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            perror("accept :");
+         }
+         return;
+      }
+
+      optval = 1;
+      setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+
+      conn = calloc(1, sizeof(struct conn_t));
+      if(NULL == conn) {
+         close(client_fd);
+         continue;
+      }
+      conn->fd = client_fd;
+      conn->nonblock = TRUE;
+      conn->client = client_stat(client_fd);
+
+      /* edge triggered, connection state machine runs until socket would block */
+      ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+      ev.data.ptr = conn;
+      if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+         perror("epoll_ctl :");
+         close(client_fd);
+         free(conn);
+         continue;
+      }
+
+      STAT_ADD(sam_stat->epoll_count, 1);
+   }
+}
+
+/* event loop of one epoll engine thread.
+   every thread has its own epoll set and accepts connections on its own,
+   a connection is served by the thread which accepted it.
+ */
+static void *epoll_loop(void *data)
+{
+   int                  server_fd;
+   int                  epoll_fd;
+   int                  n;
+   int                  i;
+   struct epoll_event   ev;
+   struct epoll_event   events[EPOLL_EVENTS];
+   struct conn_t        *conn;
+
+   server_fd = (int)(long) data;
+
+   epoll_fd = epoll_create1(0);
+   if(epoll_fd < 0) {
+      perror("epoll_create1 :");
+      return NULL;
+   }
+
+   /* listening socket is shared by all threads, wake only one of them per new connection */
+   ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+   ev.data.ptr = NULL; /* NULL marks listening socket */
+   if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) < 0) {
+      perror("epoll_ctl :");
+      close(epoll_fd);
+      return NULL;
+   }
+
+   while(1) {
+      n = epoll_wait(epoll_fd, events, EPOLL_EVENTS, -1);
+      if(n < 0) {
+         if(errno == EINTR) {
+            continue;
+         }
+         perror("epoll_wait :");
+         break;
+      }
+      for(i = 0; i < n; i++) {
+         conn = events[i].data.ptr;
+         if(NULL == conn) {
+            accept_conn_events(epoll_fd, server_fd);
+         }
+         else if(serve_conn_events(conn) < 0) {
+            close_conn_events(conn);
+         }
+      }
+   }
+
+   close(epoll_fd);
+
+   return NULL;
+}
+
+/* runs epoll engine with 'nthreads' event loops, never returns */
+static void run_epoll_engine(int server_fd, int nthreads)
+{
+   pthread_t   thread;
+   int         i;
+
+   /* accept is done by whichever thread wakes up first, others must not block in it */
+   fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK);
+
+   for(i = 1; i < nthreads; i++) {
+      if(pthread_create(&thread, NULL, epoll_loop, (void *)(long) server_fd) != 0) {
+         perror("pthread_create :");
+         break;
+      }
+      pthread_detach(thread);
+   }
+   epoll_loop((void *)(long) server_fd);
+}
+
+static int connect_to_client(int server_fd)
+{
+   int                  client_fd;
+   struct sockaddr_in   sock_client;
+   int                  client_len;
+   int                  optval;
+
+   client_len = sizeof(struct sockaddr_in);
+   client_fd = accept(server_fd, (struct sockaddr *)&sock_client, (socklen_t *)&client_len);
+   if(client_fd >= 0) {
+      /* connections are long lived and carry many small responses */
+      optval = 1;
+      setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+   }
+
+   return client_fd;
+}
+
+/* bounded multi-producer multi-consumer queue of pointers, lock free.
+   every cell carries a sequence number telling whether it is ready to be
+   filled or consumed for current lap (dmitry vyukov's design).
+   consumers sleep on 'items' semaphore when queue is empty.
+ */
+static int init_work_queue(struct work_queue_t *q, unsigned long size)
+{
+   unsigned long i;
+
+   q->cells = calloc(size, sizeof(struct work_cell_t));
+   if(NULL == q->cells) {
+      return -1;
+   }
+   for(i = 0; i < size; i++) {
+      q->cells[i].seq = i;
+   }
+   q->mask = size - 1;
+   q->head = 0;
+   q->tail = 0;
+   sem_init(&q->items, 0, 0);
+
+   return 0;
+}
+
+/* returns -1 if queue is full */
+static int push_work(struct work_queue_t *q, void *data)
+{
+   struct work_cell_t   *cell;
+   unsigned long        pos;
+   long                 diff;
+
+   pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+   while(1) {
+      cell = &q->cells[pos & q->mask];
+      diff = (long) __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (long) pos;
+      if(0 == diff) {
+         if(__atomic_compare_exchange_n(&q->head, &pos, pos + 1, TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
+         }
+      }
+      else if(diff < 0) {
+         return -1;  /* cell still holds data of previous lap */
+      }
+      else {
+         pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+      }
+   }
+
+   cell->data = data;
+   __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+   sem_post(&q->items);
+
+   return 0;
+}
+
+/* waits until an item is available */
+static void *pop_work(struct work_queue_t *q)
+{
+   struct work_cell_t   *cell;
+   unsigned long        pos;
+   long                 diff;
+   void                 *data;
+
+   while(sem_wait(&q->items) < 0) {
+      /* interrupted, wait again */
+   }
+
+   pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+   while(1) {
+      cell = &q->cells[pos & q->mask];
+      diff = (long) __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (long) (pos + 1);
+      if(0 == diff) {
+         if(__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
+         }
+      }
+      else {
+         /* another worker took this cell, retry with next one */
+         pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+      }
+   }
+
+   data = cell->data;
+   __atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+
+   return data;
+}
+
+static void close_conn_pool(struct conn_t *conn)
+{
+   release_conn_pipe(conn);
+   pthread_mutex_destroy(&conn->tx_lock);
+   close(conn->fd);
+   free(conn);
+
+   STAT_SUB(sam_stat->pool_count, 1);
+}
+
+/* drop a reference to connection, last one closes it */
+static void put_conn_pool(struct conn_t *conn)
+{
+   if(__atomic_sub_fetch(&conn->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+      close_conn_pool(conn);
+   }
+}
+
+/* make dispatcher queue connection again on its next request */
+static int rearm_conn_pool(struct conn_t *conn)
+{
+   struct epoll_event   ev;
+
+   ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+   ev.data.ptr = conn;
+
+   return epoll_ctl(pool_epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+/* worker of pool engine.
+   takes a connection which has a request waiting and reads that request into its own
+   buffer. connection is then re-armed before request is served, so next request of
+   the same client is picked up by another worker meanwhile and responses go out in
+   order of completion. only bulk writes, whose data follows on socket, are served
+   before connection is re-armed.
+   connection reference held by dispatcher travels with the armed connection, every
+   worker serving a request holds one more. a broken connection is shut down right
+   away and closed once its last worker is done with it.
+ */
+static void *pool_worker(void *data)
+{
+   struct req_t         req;
+   struct conn_t        *conn;
+   int                  rv;
+
+   memset(&req, 0, sizeof(req));
+
+   while(1) {
+      conn = pop_work(&pool_queue);
+
+      rv = read_req(conn, &req);
+      if(rv <= 0) {
+         shutdown(conn->fd, SHUT_RDWR);
+         put_conn_pool(conn);
+         continue;
+      }
+      req.rcvd_ns = conn->rx_ns;  /* it has waited in queue since then */
+
+      if(req.opts & REQ_BULK) {
+         if(process_req(conn, &req) < 0 || rearm_conn_pool(conn) < 0) {
+            shutdown(conn->fd, SHUT_RDWR);
+            put_conn_pool(conn);
+         }
+         continue;
+      }
+
+      __atomic_add_fetch(&conn->refs, 1, __ATOMIC_RELAXED);
+      if(rearm_conn_pool(conn) < 0) {
+         shutdown(conn->fd, SHUT_RDWR);
+         put_conn_pool(conn);
+      }
+      if(process_req(conn, &req) < 0) {
+         shutdown(conn->fd, SHUT_RDWR);
+      }
+      put_conn_pool(conn);
+   }
+
+   return NULL;
+}
+
+/* runs worker pool engine with 'nthreads' workers, never returns.
+   calling thread becomes dispatcher: accepts connections and queues those
+   with a request waiting. every connection is armed one-shot so only one
+   worker at a time reads from it.
+ */
+static void run_pool_engine(int server_fd, int nthreads)
+{
+   pthread_t            thread;
+   pthread_attr_t       attr;
+   struct epoll_event   ev;
+   struct epoll_event   events[EPOLL_EVENTS];
+   struct conn_t        *conn;
+   int                  client_fd;
+   int                  n;
+   int                  i;
+
+   if(init_work_queue(&pool_queue, POOL_QUEUE_SIZE) < 0) {
+      printf("Error allocating work queue.\n");
+      return;
+   }
+
+   pool_epoll_fd = epoll_create1(0);
+   if(pool_epoll_fd < 0) {
+      perror("epoll_create1 :");
+      return;
+   }
+   ev.events = EPOLLIN;
+   ev.data.ptr = NULL; /* NULL marks listening socket */
+   epoll_ctl(pool_epoll_fd, EPOLL_CTL_ADD, server_fd, &ev);
+
+   /* workers mostly block in socket and file i/o, they do not need default sized stacks */
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+   pthread_attr_setstacksize(&attr, POOL_STACK_SIZE);
+   for(i = 0; i < nthreads; i++) {
+      if(pthread_create(&thread, &attr, pool_worker, NULL) != 0) {
+         perror("pthread_create :");
+         break;
+      }
+   }
+
+   while(1) {
+      n = epoll_wait(pool_epoll_fd, events, EPOLL_EVENTS, -1);
+      if(n < 0) {
+         if(errno == EINTR) {
+            continue;
+         }
+         perror("epoll_wait :");
+         break;
+      }
+      for(i = 0; i < n; i++) {
+         conn = events[i].data.ptr;
+         if(conn) {
+            /* request waiting (or connection closed), let a worker find out */
+            conn->rx_ns = samfs_now_ns();
+            while(push_work(&pool_queue, conn) < 0) {
+               sched_yield(); /* all workers busy and queue full */
+            }
+            continue;
+         }
+
+         client_fd = connect_to_client(server_fd);
+         if(client_fd < 0) {
+            perror("accept :");
+            continue;
+         }
+         conn = calloc(1, sizeof(struct conn_t));
+         if(NULL == conn) {
+            close(client_fd);
+            continue;
+         }
+         conn->fd = client_fd;
+         conn->client = client_stat(client_fd);
+         conn->shared = TRUE;
+         conn->refs = 1;
+         pthread_mutex_init(&conn->tx_lock, NULL);
+         ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+         ev.data.ptr = conn;
+         if(epoll_ctl(pool_epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+            perror("epoll_ctl :");
+            pthread_mutex_destroy(&conn->tx_lock);
+            close(client_fd);
+            free(conn);
+            continue;
+         }
+
+         STAT_ADD(sam_stat->pool_count, 1);
+      }
+   }
+}
+
+#ifdef SAM_HAVE_URING
+/* io_uring engine.
+   every engine thread owns one ring and serves connections it has accepted.
+   receives, sends and file reads/writes of all its connections are queued as
+   submission entries and go to the kernel together with one io_uring_enter(),
+   which also waits for their completions. sockets are used through a registered
+   file table and file reads land in registered buffers.
+   other requests are served inline by their handlers, responses are queued in tx buffer.
+ */
+
+/* raw system calls, there is no wrapper in libc */
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+   return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+   return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int ring_fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+   return syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+/* TRUE if kernel of 'ring_fd' supports every operation used by engine */
+static int uring_probe_ops(int ring_fd)
+{
+   static const int        ops[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_READ,
+                                     IORING_OP_READ_FIXED, IORING_OP_WRITE, IORING_OP_TIMEOUT };
+   struct io_uring_probe   *probe;
+   size_t                  size;
+   unsigned                i;
+   int                     rv;
+
+   size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+   probe = calloc(1, size);
+   if(NULL == probe) {
+      return FALSE;
+   }
+   rv = (uring_register(ring_fd, IORING_REGISTER_PROBE, probe, 256) == 0);
+   for(i = 0; rv && i < sizeof(ops) / sizeof(ops[0]); i++) {
+      if(ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+         rv = FALSE;
+      }
+   }
+   free(probe);
+
+   return rv;
+}
+
+/* map rings of 'ring' and register socket table and read buffers with it */
+static int init_uring(struct uring_t *ring, int server_fd)
+{
+   struct io_uring_params  p;
+   struct iovec            iov[URING_BUFS];
+   int                     fds[URING_FILES];
+   size_t                  size;
+   char                    *sq;
+   unsigned                i;
+
+   memset(&p, 0, sizeof(p));
+   ring->fd = uring_setup(URING_ENTRIES, &p);
+   if(ring->fd < 0) {
+      return -1;
+   }
+   if(!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)
+         || !uring_probe_ops(ring->fd)) {
+      /* kernel older than 5.6 or operations disabled */
+      close(ring->fd);
+      errno = ENOSYS;
+      return -1;
+   }
+
+   /* submission and completion rings share one mapping */
+   size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+   if(size < p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe)) {
+      size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+   }
+   sq = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+   if(MAP_FAILED == sq) {
+      close(ring->fd);
+      return -1;
+   }
+   ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+   if(MAP_FAILED == ring->sqes) {
+      munmap(sq, size);
+      close(ring->fd);
+      return -1;
+   }
+   ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+   ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+   ring->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+   ring->sq_entries = p.sq_entries;
+   ring->cq_head = (unsigned *)(sq + p.cq_off.head);
+   ring->cq_tail = (unsigned *)(sq + p.cq_off.tail);
+   ring->cq_mask = *(unsigned *)(sq + p.cq_off.ring_mask);
+   ring->cqes = (struct io_uring_cqe *)(sq + p.cq_off.cqes);
+
+   /* submission entries are always used in ring order */
+   for(i = 0; i < p.sq_entries; i++) {
+      ((unsigned *)(sq + p.sq_off.array))[i] = i;
+   }
+   ring->to_submit = 0;
+   ring->server_fd = server_fd;
+
+   /* sparse table, a slot is filled when a connection is accepted */
+   for(i = 0; i < URING_FILES; i++) {
+      fds[i] = -1;
+   }
+   ring->nfree_slots = 0;
+   ring->fixed_files = (uring_register(ring->fd, IORING_REGISTER_FILES, fds, URING_FILES) == 0);
+   if(ring->fixed_files) {
+      for(i = 0; i < URING_FILES; i++) {
+         ring->free_slots[ring->nfree_slots++] = URING_FILES - 1 - i;
+      }
+   }
+
+   /* registering pins buffers once instead of on every read, without it plain reads are used */
+   ring->nfree_bufs = 0;
+   ring->bufs = mmap(NULL, URING_BUFS * URING_BUF_SIZE, PROT_READ | PROT_WRITE,
+         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if(MAP_FAILED == ring->bufs) {
+      ring->bufs = NULL;
+      return 0;
+   }
+   for(i = 0; i < URING_BUFS; i++) {
+      iov[i].iov_base = ring->bufs + i * URING_BUF_SIZE;
+      iov[i].iov_len = URING_BUF_SIZE;
+      ring->free_bufs[ring->nfree_bufs++] = i;
+   }
+   ring->fixed_bufs = (uring_register(ring->fd, IORING_REGISTER_BUFFERS, iov, URING_BUFS) == 0);
+
+   return 0;
+}
+
+/* next free submission entry, submits queued entries if ring is full */
+static struct io_uring_sqe *uring_get_sqe(struct uring_t *ring, int op, uint64_t user_data)
+{
+   struct io_uring_sqe  *sqe;
+   unsigned             tail;
+   int                  rv;
+
+   tail = *ring->sq_tail;
+   while(tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+      rv = uring_enter(ring->fd, ring->to_submit, 0, 0);
+      if(rv > 0) {
+         ring->to_submit -= rv;
+      }
+   }
+
+   sqe = &ring->sqes[tail & ring->sq_mask];
+   memset(sqe, 0, sizeof(*sqe));
+   sqe->opcode = op;
+   sqe->user_data = user_data;
+   __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+   ring->to_submit++;
+
+   return sqe;
+}
+
+/* entry for operation 'kind' on socket of connection 'uc' */
+static struct io_uring_sqe *uring_conn_sqe(struct uring_t *ring, struct uring_conn_t *uc, int op, int kind)
+{
+   struct io_uring_sqe  *sqe;
+
+   sqe = uring_get_sqe(ring, op, (uintptr_t) uc | kind);
+   if(uc->slot >= 0) {
+      sqe->fd = uc->slot;
+      sqe->flags = IOSQE_FIXED_FILE;
+   }
+   else {
+      sqe->fd = uc->conn.fd;
+   }
+   uc->inflight++;
+
+   return sqe;
+}
+
+static void uring_post_accept(struct uring_t *ring)
+{
+   struct io_uring_sqe  *sqe;
+
+   sqe = uring_get_sqe(ring, IORING_OP_ACCEPT, URING_ACCEPT);
+   sqe->fd = ring->server_fd;
+}
+
+/* accept is posted again once URING_ACCEPT_MS has passed, connections may close meanwhile */
+static void uring_wait_accept(struct uring_t *ring)
+{
+   struct io_uring_sqe  *sqe;
+
+   ring->accept_wait.tv_sec = 0;
+   ring->accept_wait.tv_nsec = URING_ACCEPT_MS * 1000000L;
+   sqe = uring_get_sqe(ring, IORING_OP_TIMEOUT, URING_ACCEPT_WAIT);
+   sqe->fd = -1;
+   sqe->addr = (uintptr_t) &ring->accept_wait;
+   sqe->len = 1;
+}
+
+static void uring_post_recv(struct uring_t *ring, struct uring_conn_t *uc)
+{
+   struct io_uring_sqe  *sqe;
+   struct conn_t        *conn;
+
+   conn = &uc->conn;
+   sqe = uring_conn_sqe(ring, uc, IORING_OP_RECV, URING_RECV);
+   sqe->addr = (uintptr_t)(conn->rx_buf + conn->rx_len);
+   sqe->len = conn->rx_size - conn->rx_len;
+   uc->recv_busy = TRUE;
+}
+
+/* tx buffer must not be touched until send completes */
+static void uring_post_send(struct uring_t *ring, struct uring_conn_t *uc)
+{
+   struct io_uring_sqe  *sqe;
+   struct conn_t        *conn;
+
+   conn = &uc->conn;
+   sqe = uring_conn_sqe(ring, uc, IORING_OP_SEND, URING_SEND);
+   sqe->addr = (uintptr_t)(conn->tx_buf + conn->tx_pos);
+   sqe->len = conn->tx_len - conn->tx_pos;
+   uc->send_busy = TRUE;
+}
+
+/* queue next chunk of file operation of connection */
+static void uring_post_file(struct uring_t *ring, struct uring_conn_t *uc)
+{
+   struct io_uring_sqe  *sqe;
+   struct req_t         *req;
+   size_t               len;
+
+   req = &uc->conn.req;
+   if(READ == uc->file_op) {
+      len = req->size - uc->file_done;
+      if(len > URING_BUF_SIZE) {
+         len = URING_BUF_SIZE;
+      }
+      sqe = uring_get_sqe(ring, (ring->fixed_bufs)? IORING_OP_READ_FIXED: IORING_OP_READ, (uintptr_t) uc | URING_FILE);
+      sqe->addr = (uintptr_t)(ring->bufs + uc->buf * URING_BUF_SIZE);
+      sqe->buf_index = uc->buf;
+   }
+   else {
+      len = req->data_len - uc->file_done;
+      sqe = uring_get_sqe(ring, IORING_OP_WRITE, (uintptr_t) uc | URING_FILE);
+      sqe->addr = (uintptr_t)(req->data + uc->file_done);
+   }
+   sqe->fd = uc->file_fd;
+   sqe->off = req->offset + uc->file_done;
+   sqe->len = len;
+   uc->file_len = len;
+   uc->inflight++;
+}
+
+/* start read or write of file through ring, following requests of connection wait until it is done.
+   returns TRUE if request is taken care of, FALSE if its handler has to serve it, -1 on error.
+ */
+static int uring_start_file(struct uring_t *ring, struct uring_conn_t *uc)
+{
+   struct req_t   *req;
+   int            fd;
+   struct file_ref_t ref;
+   uint64_t       end;
+
+   req = &uc->conn.req;
+   if(!((READ == req->msg && req->size > 0 && ring->nfree_bufs > 0) ||
+        (WRITE == req->msg && req->data_len > 0))) {
+      return FALSE;
+   }
+   /* compressed data is packed and unpacked by handle_read() and handle_write() */
+   if(req->zip || req_codec(req)) {
+      return FALSE;
+   }
+
+   fd = open_req_file(req, (READ == req->msg)? O_RDONLY: O_WRONLY, &ref);
+   if(-1 == fd) {
+      fd = send_error(&uc->conn, req, errno);
+      end = samfs_now_ns();
+      lat_stat(req, end);
+      trace_req(&uc->conn, req, end);
+      return (fd < 0)? -1: TRUE;
+   }
+
+   uc->file_op = req->msg;
+   uc->file_fd = fd;
+   uc->file_ref = ref;
+   uc->file_done = 0;
+   if(READ == req->msg) {
+      uc->buf = ring->free_bufs[--ring->nfree_bufs];
+   }
+   uring_post_file(ring, uc);
+
+   return TRUE;
+}
+
+static void uring_end_file(struct uring_t *ring, struct uring_conn_t *uc)
+{
+   if(uc->file_fd >= 0) {
+      close_req_file(uc->file_fd, &uc->file_ref);
+      uc->file_fd = -1;
+   }
+   if(uc->buf >= 0) {
+      ring->free_bufs[ring->nfree_bufs++] = uc->buf;
+      uc->buf = -1;
+   }
+   uc->file_op = 0;
+}
+
+/* a chunk of file operation has completed, respond like handle_read()/handle_write()
+   and queue next chunk if any. returns -1 if connection is no longer usable.
+ */
+static int uring_step_file(struct uring_t *ring, struct uring_conn_t *uc)
+{
+   struct req_t   *req;
+   struct rsp_t   rsp;
+   int            res;
+   uint64_t       end;
+
+   req = &uc->conn.req;
+   res = uc->file_res;
+   uc->file_ready = FALSE;
+   if(-EINTR == res || -EAGAIN == res) {
+      uring_post_file(ring, uc);
+      return 0;
+   }
+
+   memset(&rsp, 0, sizeof(rsp));
+   if(READ == uc->file_op) {
+      if(res < 0) {
+         rsp.status = FAIL;
+         rsp.errcode = -res;
+         rsp.endofdata = TRUE;
+      }
+      else {
+         uc->file_done += res;
+         rsp.status = SUCCESS;
+         rsp.size = res;
+         rsp.data = ring->bufs + uc->buf * URING_BUF_SIZE;
+         rsp.data_len = res;
+         /* reached end of file or read requested size of data */
+         rsp.endofdata = (res < uc->file_len || uc->file_done == req->size);
+      }
+      if(send_rsp(&uc->conn, req, &rsp) < 0) {
+         return -1;
+      }
+      if(!rsp.endofdata) {
+         uring_post_file(ring, uc);
+         return 0;
+      }
+   }
+   else {
+      if(res > 0) {
+         uc->file_done += res;
+         if(uc->file_done < req->data_len) {
+            uring_post_file(ring, uc);
+            return 0;
+         }
+      }
+      rsp.status = (res < 0)? FAIL: SUCCESS;
+      rsp.errcode = (res < 0)? -res: 0;
+      rsp.size = uc->file_done;
+      rsp.endofdata = TRUE;
+      if(send_rsp(&uc->conn, req, &rsp) < 0) {
+         return -1;
+      }
    }
-   rsp.endofdata = TRUE;
-
-   send_rsp(client_fd, &rsp);
+   end = samfs_now_ns();
+   lat_stat(req, end);
+   trace_req(&uc->conn, req, end);
+   uring_end_file(ring, uc);
 
    return 0;
 }
 
-static int handle_statfs(int client_fd, struct req_t *req)
+/* free connection once kernel has no operation of it in flight */
+static void uring_release_conn(struct uring_t *ring, struct uring_conn_t *uc)
 {
-   int            rv;
-   char           local_path[URI_LEN];
-   struct statvfs st;
-   struct rsp_t   rsp;
+   struct io_uring_files_update  upd;
+   int                           fd;
 
-   sprintf(local_path, "%s%s%s", SRCPATH, req->url, req->uri);
-
-   rv = statvfs(local_path, &st);
-   if(0 == rv) {
-      rsp.status = SUCCESS;
-      memcpy(&rsp.data, &st, sizeof(struct statvfs));
+   uring_end_file(ring, uc);
+   if(uc->conn.tx_read) {
+      close_req_file(uc->conn.tx_file_fd, &uc->conn.tx_file_ref);
    }
-   else {
-      rsp.status = FAIL;
-      rsp.errcode = errno;
+   if(uc->slot >= 0) {
+      fd = -1;
+      upd.offset = uc->slot;
+      upd.resv = 0;
+      upd.fds = (uintptr_t) &fd;
+      uring_register(ring->fd, IORING_REGISTER_FILES_UPDATE, &upd, 1);
+      ring->free_slots[ring->nfree_slots++] = uc->slot;
    }
-   rsp.endofdata = TRUE;
+   close(uc->conn.fd);
+   free(uc->conn.rx_buf);
+   free(uc->conn.tx_buf);
+   free(uc);
 
-   send_rsp(client_fd, &rsp);
-
-   return 0;
+   STAT_SUB(sam_stat->uring_count, 1);
 }
 
-static int process_req(int client_fd, struct req_t *req)
+static void uring_close_conn(struct uring_t *ring, struct uring_conn_t *uc)
 {
-   switch(req->msg) {
-      case GETATTR:
-         handle_getattr(client_fd, req);
-         break;
-      case MKDIR:
-         handle_mkdir(client_fd, req);
-         break;
-      case READDIR:
-         handle_readdir(client_fd, req);
-         break;
-      case RMDIR:
-         handle_rmdir(client_fd, req);
-         break;
-      case CREATE:
-         handle_create(client_fd, req);
-         break;
-      case READ:
-         handle_read(client_fd, req);
-         break;
-      case WRITE:
-         handle_write(client_fd, req);
-         break;
-      case TRUNCATE:
-         handle_truncate(client_fd, req);
-         break;
-      case UNLINK:
-         handle_unlink(client_fd, req);
-         break;
-      case RENAME:
-         handle_rename(client_fd, req);
-         break;
-      case CHMOD:
-         handle_chmod(client_fd, req);
-         break;
-      case UTIME:
-         handle_utime(client_fd, req);
-         break;
-      case STATFS:
-         handle_statfs(client_fd, req);
-         break;
-      default:
-         break;
+   if(!uc->closing) {
+      /* pending receive and send complete right away */
+      uc->closing = TRUE;
+      shutdown(uc->conn.fd, SHUT_RDWR);
+   }
+   if(0 == uc->inflight) {
+      uring_release_conn(ring, uc);
    }
-
-   return 0;
 }
 
-static char *string_rate(int rate, char *srate)
+/* state machine of an io_uring connection, run after each of its completions.
+   serves all complete requests, then queues one send of all their responses and
+   one receive. no new request is taken while a send or file operation is in flight.
+ */
+static void uring_serve(struct uring_t *ring, struct uring_conn_t *uc)
 {
-   float frate;
-   int level;
-   char suffix[][8] = {"b/s", "kb/s", "mb/s", "gb/s", "", "", "", ""};
+   struct conn_t  *conn;
+   size_t         need;
+   int            want_rx;
+   int            rv;
 
-   frate = rate * 8; /* convert it to bits */
-   level = 0;
-   while(frate >= 512.0f) {
-      frate = frate / 1024;
-      level++;
-   }  
+   conn = &uc->conn;
+   if(uc->file_ready && !uc->send_busy && uring_step_file(ring, uc) < 0) {
+      uring_close_conn(ring, uc);
+      return;
+   }
 
-   sprintf(srate, "%.2f %s", frate, suffix[level]);
+   want_rx = FALSE;
+   while(!uc->send_busy && !uc->file_op) {
+      if(conn->tx_read) {
+         /* next frame of buffered read once previous one is sent */
+         if(conn->tx_pos < conn->tx_len) {
+            break;
+         }
+         if(queue_read_frame(conn) < 0) {
+            uring_close_conn(ring, uc);
+            return;
+         }
+         continue;
+      }
+      rv = next_req(conn, &need);
+      if(0 == rv) {
+         want_rx = TRUE;
+         break;
+      }
+      if(rv > 0) {
+         conn->req.start_ns = samfs_now_ns();
+         conn->req.send_ns = 0;
+         conn->req.errcode = 0;
+         rv = uring_start_file(ring, uc);
+         if(FALSE == rv) {
+            conn->req.opts &= ~REQ_RAW_DATA;  /* responses of ring go through tx buffer only */
+            rv = process_req(conn, &conn->req);
+         }
+      }
+      if(rv < 0) {
+         uring_close_conn(ring, uc);
+         return;
+      }
+   }
 
-   return srate;
+   if(!uc->send_busy && conn->tx_pos < conn->tx_len) {
+      uring_post_send(ring, uc);
+   }
+   if(want_rx && !uc->recv_busy) {
+      if(!uc->send_busy) {
+         trim_conn(conn);
+      }
+      if(reserve_rx(conn, need) < 0) {
+         uring_close_conn(ring, uc);
+         return;
+      }
+      uring_post_recv(ring, uc);
+   }
 }
 
-static void print_stats(void)
+static void uring_add_conn(struct uring_t *ring, int client_fd)
 {
-   char uprate[16], dnrate[16];
-
-   while(1) {
-      printf("\x1b[H\x1b[2J"); /* clears screen */
+   struct uring_conn_t           *uc;
+   struct io_uring_files_update  upd;
+   int                           optval;
 
-      if(sam_stat->uplink_avg)
-         sam_stat->uplink_avg = ((sam_stat->uplink_avg * 2) + sam_stat->uplink_rate) / 3;
-      else
-         sam_stat->uplink_avg = sam_stat->uplink_rate;
-
-      if(sam_stat->dnlink_avg)
-         sam_stat->dnlink_avg = ((sam_stat->dnlink_avg * 2) + sam_stat->dnlink_rate) / 3;
-      else
-         sam_stat->dnlink_avg = sam_stat->dnlink_rate;
+   optval = 1;
+   setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
 
-      printf("\n");
-      printf("   +--------------------------------------------------------------------------+\n");
-      printf("   |                             Server Dashboard                             |\n");
-      printf("   +--------------------------------------------------------------------------+\n");
-      printf("   | Server Binary : %-27s Server PID : %15d |\n", sam_stat->server_name, sam_stat->server_pid);
-      printf("   | Source Dir    : %-27s Server IP  : %15s |\n", sam_stat->server_dir, sam_stat->server_ip);
-      printf("   +--------------------------------------------------------------------------+\n");
-      printf("   | Concurrency Method Being Used : ");
-      switch(sam_stat->conc_method) {
-         case SAM_SELECT:
-            printf("%-40s |\n", "select");
-            break;
-         case SAM_PTHREAD:
-            printf("%-40s |\n", "pthread");
-            break;
-         case SAM_FORK:
-            printf("%-40s |\n", "fork");
-            break;
-         default:
-            printf("%-40s |\n", "");
-            break;
+   uc = calloc(1, sizeof(struct uring_conn_t));
+   if(NULL == uc) {
+      close(client_fd);
+      return;
+   }
+   uc->conn.fd = client_fd;
+   uc->conn.nonblock = TRUE;
+   uc->conn.client = client_stat(client_fd);
+   uc->slot = -1;
+   uc->file_fd = -1;
+   uc->buf = -1;
+
+   if(ring->nfree_slots > 0) {
+      upd.offset = ring->free_slots[ring->nfree_slots - 1];
+      upd.resv = 0;
+      upd.fds = (uintptr_t) &client_fd;
+      if(uring_register(ring->fd, IORING_REGISTER_FILES_UPDATE, &upd, 1) == 1) {
+         uc->slot = upd.offset;
+         ring->nfree_slots--;
       }
-      printf("   +--------------------------------------------------------------------------+\n");
-      printf("   | Clients Connected Using _                                                |\n");
-      printf("   | select() : %-10u     pthread() : %-10u     fork() : %-10u |\n",
-            sam_stat->select_count, sam_stat->thread_count, sam_stat->forked_count);
-      printf("   |                                                                          |\n");
-      printf("   | Total Connected Clients : %-46u |\n",
-            sam_stat->select_count + sam_stat->thread_count + sam_stat->forked_count);
-      printf("   +--------------------------------------------------------------------------+\n");
-#if 0
-      printf("   | Total Bytes Received : %11u       Total Bytes Sent  : %11u |\n", sam_stat->bytes_rcvd, sam_stat->bytes_sent);
-      //printf("   | Inst. Downlink Rate  : %11u       Inst. Uplink Rate : %11u |\n", sam_stat->dnlink_rate, sam_stat->uplink_rate);
-      //printf("   | Avg. Downlink Rate   : %11u       Avg. Uplink Rate  : %11u |\n", sam_stat->dnlink_avg, sam_stat->uplink_avg);
-      printf("   | Inst. Downlink Rate  : %11s       Inst. Uplink Rate : %11s |\n", 
-            string_rate(sam_stat->dnlink_rate, dnrate), string_rate(sam_stat->uplink_rate, uprate));
-      printf("   | Avg. Downlink Rate   : %11s       Avg. Uplink Rate  : %11s |\n", 
-            string_rate(sam_stat->dnlink_avg, dnrate), string_rate(sam_stat->uplink_avg, uprate));
-#else
-      printf("   | Total Bytes Received : %11u        Total Bytes Sent : %11u |\n", sam_stat->bytes_rcvd, sam_stat->bytes_sent);
-      printf("   | Downlink Data Rate   : %11s        Uplink Data Rate : %11s |\n", 
-            string_rate(sam_stat->dnlink_rate, dnrate), string_rate(sam_stat->uplink_rate, uprate));
-#endif
-      printf("   +--------------------------------------------------------------------------+\n");
-      printf("\n");
+   }
 
-      sem_wait(&sam_stat->mutex);
-      sam_stat->uplink_rate = 0;
-      sam_stat->dnlink_rate = 0;
-      sem_post(&sam_stat->mutex);
+   STAT_ADD(sam_stat->uring_count, 1);
 
-      sleep(1); /* update after every one second */
-   }
+   uring_serve(ring, uc);
 }
 
-static void *handle_client_thread(void *data)
+static void uring_complete(struct uring_t *ring, uint64_t user_data, int res)
 {
-   int client_fd;
-   struct req_t req;
-
-   client_fd = (int) data;
+   struct uring_conn_t  *uc;
 
-   sem_wait(&sam_stat->mutex);
-   sam_stat->thread_count++;
-   sem_post(&sam_stat->mutex);
+   if(URING_ACCEPT == user_data) {
+      if(res >= 0) {
+         uring_add_conn(ring, res);
+      }
+      else if(res == -EMFILE || res == -ENFILE) {
+         /* reposting at once would fail again in a busy loop */
+         printf("accept : %s\n", strerror(-res));
+         uring_wait_accept(ring);
+         return;
+      }
+      else if(res != -EINTR && res != -EAGAIN && res != -ECONNABORTED) {
+         printf("accept : %s\n", strerror(-res));
+      }
+      uring_post_accept(ring);
+      return;
+   }
+   if(URING_ACCEPT_WAIT == user_data) {
+      /* timer expired (-ETIME), retry accept */
+      uring_post_accept(ring);
+      return;
+   }
 
-   read_req(client_fd, &req);
-   process_req(client_fd, &req);
-   
-   close(client_fd);
-   FD_CLR(client_fd, &thread_fds);
-   
-   sem_wait(&sam_stat->mutex);
-   sam_stat->thread_count--;
-   sem_post(&sam_stat->mutex);
+   uc = (struct uring_conn_t *)(uintptr_t)(user_data & ~(uint64_t) URING_KIND_MASK);
+   uc->inflight--;
+   switch(user_data & URING_KIND_MASK) {
+      case URING_RECV:
+         uc->recv_busy = FALSE;
+         if(res > 0) {
+            uc->conn.rx_len += res;
+            uc->conn.rx_ns = samfs_now_ns();
+         }
+         else if(res != -EINTR && res != -EAGAIN) {
+            uring_close_conn(ring, uc);  /* client closed connection */
+            return;
+         }
+         break;
+      case URING_SEND:
+         uc->send_busy = FALSE;
+         if(res >= 0) {
+            uc->conn.tx_pos += res;
+         }
+         else if(res != -EINTR && res != -EAGAIN) {
+            uring_close_conn(ring, uc);
+            return;
+         }
+         break;
+      case URING_FILE:
+         uc->file_ready = TRUE;
+         uc->file_res = res;
+         break;
+   }
 
-   return NULL;
+   if(uc->closing) {
+      uring_close_conn(ring, uc);
+      return;
+   }
+   uring_serve(ring, uc);
 }
 
-static int handle_client_fork(int client_fd)
+/* event loop of one io_uring engine thread */
+static void *uring_loop(void *data)
 {
-   struct req_t   req;
-   int            curr_fd;
+   struct uring_t       *ring;
+   struct io_uring_cqe  *cqe;
+   unsigned             head;
+   uint64_t             user_data;
+   int                  res;
+   int                  rv;
 
-   if(fork() == 0) {
-      /* inside child */
-      
-      sem_wait(&sam_stat->mutex);
-      sam_stat->forked_count++;
-      sem_post(&sam_stat->mutex);
-   
-      /* close all other opened fds */
-      for(curr_fd = 0; curr_fd < FD_SETSIZE; curr_fd++) {
-         if(FD_ISSET(curr_fd, &select_fds)) {
-            close(curr_fd);
-         }
-         if(FD_ISSET(curr_fd, &thread_fds)) {
-            close(curr_fd);
+   ring = calloc(1, sizeof(struct uring_t));
+   if(NULL == ring || init_uring(ring, (int)(long) data) < 0) {
+      perror("io_uring_setup :");
+      free(ring);
+      return NULL;
+   }
+
+   uring_post_accept(ring);
+   while(1) {
+      /* submit everything queued by previous completions and wait for at least one more */
+      rv = uring_enter(ring->fd, ring->to_submit, 1, IORING_ENTER_GETEVENTS);
+      if(rv < 0) {
+         if(errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+            continue;
          }
+         perror("io_uring_enter :");
+         break;
+      }
+      ring->to_submit -= rv;
+
+      head = *ring->cq_head;
+      while(head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+         cqe = &ring->cqes[head & ring->cq_mask];
+         user_data = cqe->user_data;
+         res = cqe->res;
+         head++;
+         __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+         uring_complete(ring, user_data, res);
       }
-      read_req(client_fd, &req);
-      process_req(client_fd, &req);
-      close(client_fd);
-      
-      sem_wait(&sam_stat->mutex);
-      sam_stat->forked_count--;
-      sem_post(&sam_stat->mutex);
-      
-      //return 0;
-      usleep(10);
-      exit(0);
-   }
-   else {
-      /* inside parent */
-      close(client_fd);
    }
 
-   return 0;
+   return NULL;
 }
+#endif /* SAM_HAVE_URING */
 
-static int connect_to_client(int server_fd)
+/* runs io_uring engine with 'nthreads' rings, never returns unless kernel has no io_uring */
+static void run_uring_engine(int server_fd, int nthreads)
 {
-   int                  client_fd;
-   struct sockaddr_in   sock_client;
-   int                  client_len;
+#ifdef SAM_HAVE_URING
+   pthread_t   thread;
+   int         i;
 
-   client_len = sizeof(struct sockaddr_in);
-   client_fd = accept(server_fd, (struct sockaddr *)&sock_client, (socklen_t *)&client_len);
-
-   return client_fd;
+   for(i = 1; i < nthreads; i++) {
+      if(pthread_create(&thread, NULL, uring_loop, (void *)(long) server_fd) != 0) {
+         perror("pthread_create :");
+         break;
+      }
+      pthread_detach(thread);
+   }
+   uring_loop((void *)(long) server_fd);
+#else
+   printf("io_uring is not supported by this build.\n");
+#endif
 }
 
 static int accept_new_connection(int server_fd)
@@ -731,15 +4338,27 @@ static int accept_new_connection(int server_fd)
    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
 
    client_fd = connect_to_client(server_fd);
+   if(client_fd < 0) {
+      perror("accept :");
+      return -1;
+   }
    switch(sam_stat->conc_method) {
       case SAM_SELECT:
+         if(client_fd >= FD_SETSIZE) {
+            /* connections now stay open, select can not track this one */
+            printf("Too many clients for select, dropping connection.\n");
+            close(client_fd);
+            break;
+         }
          FD_SET(client_fd, &select_fds);
-         sem_wait(&sam_stat->mutex);
-         sam_stat->select_count++;
-         sem_post(&sam_stat->mutex);
+         select_clients[client_fd] = client_stat(client_fd);
+         select_trace_ids[client_fd] = 0;
+         STAT_ADD(sam_stat->select_count, 1);
          break;
       case SAM_PTHREAD:
-         FD_SET(client_fd, &thread_fds);
+         if(client_fd < FD_SETSIZE) {
+            FD_SET(client_fd, &thread_fds);
+         }
          rv = pthread_create(&thread, &attr, handle_client_thread, (void *) client_fd);
          if(rv != 0) {
             perror("pthread_create :");
@@ -811,6 +4430,7 @@ static void *connect_to_shm(char *argv)
          //printf("%s :: Server with pid %d already running.\n", argv, pid);
          /* server pid is used as shm key */
          shmkey = pid; 
+         server_running = (pid != getpid());
       }
       else {
          //printf("%s :: No such server exists with pid %d.\n", argv, pid);
@@ -851,9 +4471,14 @@ int main(int argc, char *argv[])
    int            i;
    char           start_server;
    fd_set         read_fds;
-   struct req_t   req;
+   struct conn_t  conn;
    int            rv;
    int            curr_fd;
+   unsigned int   method;
+   char           *metrics_addr;
+   pthread_t      metrics_tid;
+   char           *trace_path;
+   int            trace_mb;
 
    if(argc == 1) {
       printf("USAGE: %s <server_ip> <source_path>\n", argv[0]);
@@ -871,10 +4496,17 @@ int main(int argc, char *argv[])
 
    /* parse command line arguments */
    start_server = FALSE;
+   metrics_addr = NULL;
+   trace_path = NULL;
+   trace_mb = TRACE_RING_MB;
    for(i = 1; i < argc; i++) {
       if(strcmp(argv[i], "-status") == 0) {
          print_stats();
       }
+      else if(strcmp(argv[i], "-dump") == 0) {
+         dump_stats();
+         return 0;
+      }
       else if(strcmp(argv[i], "-export") == 0) {
          if((i + 2) < argc) {
             start_server = TRUE;
@@ -892,19 +4524,12 @@ int main(int argc, char *argv[])
       }
       else if(strcmp(argv[i], "-cmethod") == 0) {
          if((i + 1) < argc) {
-            if(strcmp(argv[i + 1], "fork") == 0) {
-               printf("Concurrency method updated to '%s'.\n", argv[i + 1]);
-               sam_stat->conc_method = SAM_FORK;
-            }
-            else if(strcmp(argv[i + 1], "pthread") == 0) {
-               printf("Concurrency method updated to '%s'.\n", argv[i + 1]);
-               sam_stat->conc_method = SAM_PTHREAD;
-            }
-            else if(strcmp(argv[i + 1], "select") == 0) {
-               printf("Concurrency method updated to '%s'.\n", argv[i + 1]);
-               sam_stat->conc_method = SAM_SELECT;
+            for(method = 0; method < SAM_UNDEFINED; method++) {
+               if(strcmp(argv[i + 1], conc_method_names[method]) == 0) {
+                  break;
+               }
             }
-            else {
+            if(method == SAM_UNDEFINED) {
                if(argv[i + 1][0] == '-') {
                   printf("%s :: Insufficient arguments: '%s'.\n", argv[0], argv[i]);
                }
@@ -913,6 +4538,14 @@ int main(int argc, char *argv[])
                }
                return 0;
             }
+            if(server_running && (IS_ENGINE(method) || IS_ENGINE(sam_stat->conc_method))) {
+               /* running engine can not hand over its connections, nor take over others */
+               printf("%s :: Concurrency method '%s' can only be changed when starting server.\n", argv[0],
+                     conc_method_names[IS_ENGINE(method)? method: sam_stat->conc_method]);
+               return 0;
+            }
+            printf("Concurrency method updated to '%s'.\n", argv[i + 1]);
+            sam_stat->conc_method = method;
          }
          else {
             printf("%s :: Insufficient arguments: '%s'.\n", argv[0], argv[i]);
@@ -920,6 +4553,46 @@ int main(int argc, char *argv[])
          }
          i += 1; /* -cmethod consumed two arguments, so increment by two */
       }
+      else if(strcmp(argv[i], "-threads") == 0) {
+         if((i + 1) < argc && atoi(argv[i + 1]) > 0) {
+            engine_threads = atoi(argv[i + 1]);
+         }
+         else {
+            printf("%s :: Insufficient arguments: '%s'.\n", argv[0], argv[i]);
+            return 0;
+         }
+         i += 1; /* -threads consumed two arguments, so increment by two */
+      }
+      else if(strcmp(argv[i], "-trace") == 0) {
+         if((i + 1) < argc && argv[i + 1][0] != '-') {
+            trace_path = argv[i + 1];
+         }
+         else {
+            printf("%s :: Insufficient arguments: '%s'.\n", argv[0], argv[i]);
+            return 0;
+         }
+         i += 1; /* -trace consumed two arguments, so increment by two */
+      }
+      else if(strcmp(argv[i], "-trace_size") == 0) {
+         if((i + 1) < argc && atoi(argv[i + 1]) > 0) {
+            trace_mb = atoi(argv[i + 1]);
+         }
+         else {
+            printf("%s :: Insufficient arguments: '%s'.\n", argv[0], argv[i]);
+            return 0;
+         }
+         i += 1; /* -trace_size consumed two arguments, so increment by two */
+      }
+      else if(strcmp(argv[i], "-metrics") == 0) {
+         if((i + 1) < argc && argv[i + 1][0] != '-') {
+            metrics_addr = argv[i + 1];
+         }
+         else {
+            printf("%s :: Insufficient arguments: '%s'.\n", argv[0], argv[i]);
+            return 0;
+         }
+         i += 1; /* -metrics consumed two arguments, so increment by two */
+      }
       else {
          printf("invalid argument: '%s'\n", argv[i]);
          return 0;
@@ -927,6 +4600,10 @@ int main(int argc, char *argv[])
    } /* end of command line args parsing */
 
    if(!start_server) {
+      /* metrics of an already running server can be served by another process */
+      if(metrics_addr) {
+         serve_metrics(metrics_addr);
+      }
       /* don't want to run server? then exit */
       return 0;
    }
@@ -939,6 +4616,11 @@ int main(int argc, char *argv[])
    fprintf(fp, "%d", getpid());
    fclose(fp);
 
+   /* a client may close its connection while we are writing to it,
+      that should only end that connection and not the whole server.
+    */
+   signal(SIGPIPE, SIG_IGN);
+
    /* start server */
    server_fd = create_server(sam_stat->server_ip);
    strcpy(SRCPATH, sam_stat->server_dir);
@@ -948,6 +4630,11 @@ int main(int argc, char *argv[])
       sam_stat->conc_method = SAM_PTHREAD;
    }
 
+   /* select clients are served one request at a time, they share one
+      connection state and its receive buffer.
+    */
+   memset(&conn, 0, sizeof(conn));
+
    /* setup fd set */
    FD_ZERO(&select_fds);
    FD_ZERO(&thread_fds);
@@ -958,19 +4645,54 @@ int main(int argc, char *argv[])
    sam_stat->select_count = 0;
    sam_stat->thread_count = 0;
    sam_stat->forked_count = 0;
-   sam_stat->bytes_rcvd = 0;
-   sam_stat->bytes_sent = 0;
-   sam_stat->uplink_rate = 0;
-   sam_stat->dnlink_rate = 0;
-   sam_stat->uplink_avg = 0;
-   sam_stat->dnlink_avg = 0;
-
-   /* initialize semaphore */
-   sem_init(&sam_stat->mutex, 1, 1);
+   sam_stat->epoll_count = 0;
+   sam_stat->pool_count = 0;
+   sam_stat->uring_count = 0;
+   memset(sam_stat->slots, 0, sizeof(sam_stat->slots));
+   memset(sam_stat->clients, 0, sizeof(sam_stat->clients));
+
+   init_handles();
+   init_fd_cache();
+
+   /* mapped before any worker starts, forked children write through same mapping */
+   if(trace_path) {
+      if(trace_open(trace_path, trace_mb) < 0) {
+         perror("trace :");
+         close(server_fd);
+         return 1;
+      }
+      printf("Tracing requests to %s (%llu records per worker)\n", trace_path, (unsigned long long) trace_ring_recs);
+   }
 
    printf("Server started with pid %d, listening on IP %s and exporting %s ..\n",
          sam_stat->server_pid, sam_stat->server_ip, sam_stat->server_dir);
 
+   if(metrics_addr && pthread_create(&metrics_tid, NULL, metrics_thread, metrics_addr) == 0) {
+      pthread_detach(metrics_tid);
+   }
+
+   /* engines run their own loops and never return */
+   if(engine_threads <= 0) {
+      engine_threads = sysconf(_SC_NPROCESSORS_ONLN);
+   }
+   switch(sam_stat->conc_method) {
+      case SAM_EPOLL:
+         run_epoll_engine(server_fd, engine_threads);
+         break;
+      case SAM_POOL:
+         run_pool_engine(server_fd, engine_threads);
+         break;
+      case SAM_URING:
+         run_uring_engine(server_fd, engine_threads);
+         break;
+      default: break;
+   }
+   if(IS_ENGINE(sam_stat->conc_method)) {
+      /* engine could not be started */
+      close(server_fd);
+      return 1;
+   }
+
    /* server main loop */
    while(1) {
       /* if select fd list not empty, check if any fd has data */
@@ -983,16 +4705,23 @@ int main(int argc, char *argv[])
                   accept_new_connection(server_fd);
                }
                else {
-                  rv = read_req(curr_fd, &req);
+                  /* serve one request, connection stays in select set
+                     until client closes it.
+                   */
+                  conn.fd = curr_fd;
+                  conn.client = select_clients[curr_fd];
+                  conn.trace_id = select_trace_ids[curr_fd];
+                  rv = read_req(&conn, &conn.req);
                   if(rv > 0) {
-                     process_req(curr_fd, &req);
+                     rv = (process_req(&conn, &conn.req) < 0)? -1: rv;
                   }
-                  close(curr_fd);
-                  FD_CLR(curr_fd, &select_fds);
+                  select_trace_ids[curr_fd] = conn.trace_id;
+                  if(rv <= 0) {
+                     close(curr_fd);
+                     FD_CLR(curr_fd, &select_fds);
 
-                  sem_wait(&sam_stat->mutex);
-                  sam_stat->select_count--;
-                  sem_post(&sam_stat->mutex);
+                     STAT_SUB(sam_stat->select_count, 1);
+                  }
                }
             }
          }
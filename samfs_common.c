@@ -0,0 +1,507 @@
+#include <sys/uio.h>       /* writev() */
+#include <pthread.h>
+#include <time.h>          /* clock_gettime() */
+#ifdef SAMFS_LZ4
+#include <lz4.h>
+#endif
+#ifdef SAMFS_ZSTD
+#include <zstd.h>
+#endif
+
+#include "samfs_common.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <nmmintrin.h>     /* _mm_crc32_u8(), _mm_crc32_u64() */
+#define SAM_HAVE_SSE42     /* built for any x86, used only where cpu has it */
+#endif
+
+#define CRC32C_POLY     0x82f63b78  /* castagnoli polynomial, bit reversed */
+
+/* crc32c_table[k][b] is crc of byte 'b' followed by 'k' zero bytes */
+static uint32_t         crc32c_table[8][256];
+static uint32_t         (*crc32c_update)(uint32_t crc, const unsigned char *p, size_t len);
+static pthread_once_t   crc32c_once = PTHREAD_ONCE_INIT;
+
+/* on-the-wire compression of data frames, codecs are built in with SAMFS_LZ4 and SAMFS_ZSTD.
+   compressed data starts with its unpacked length (uint32_t), data that does not
+   shrink by an eighth is sent as it is.
+ */
+#define ZIP_MIN         256         /* smaller data is not worth compressing */
+#define ZIP_PROBE       4096        /* large data is sent as it is if its first bytes do not shrink */
+#define ZIP_ZSTD_LEVEL  3
+
+#ifdef SAMFS_ZSTD
+/* zstd contexts are large, every thread keeps its own */
+struct zstd_ctx_t {
+   ZSTD_CCtx   *cctx;
+   ZSTD_DCtx   *dctx;
+};
+
+static pthread_key_t    zstd_key;
+static pthread_once_t   zstd_once = PTHREAD_ONCE_INIT;
+#endif
+
+/* read exactly 'len' bytes, returns 'len' on success or <= 0 if connection failed */
+int samfs_read_full(int sock_fd, void *buf, size_t len)
+{
+   size_t   done;
+   int      rv;
+
+   done = 0;
+   while(done < len) {
+      rv = read(sock_fd, (char *)buf + done, len - done);
+      if(rv < 0 && errno == EINTR) {
+         continue;
+      }
+      if(rv <= 0) {
+         return rv;
+      }
+      done += rv;
+   }
+
+   return done;
+}
+
+/* write exactly 'len' bytes, returns 'len' on success or <= 0 if connection failed */
+int samfs_write_full(int sock_fd, const void *buf, size_t len)
+{
+   size_t   done;
+   int      rv;
+
+   done = 0;
+   while(done < len) {
+      rv = write(sock_fd, (const char *)buf + done, len - done);
+      if(rv < 0 && errno == EINTR) {
+         continue;
+      }
+      if(rv <= 0) {
+         return rv;
+      }
+      done += rv;
+   }
+
+   return done;
+}
+
+/* write all buffers of 'iov' with as few syscalls as possible.
+   'iov' is modified in place, returns total bytes written or <= 0 if connection failed.
+ */
+int samfs_writev_full(int sock_fd, struct iovec *iov, int iovcnt)
+{
+   size_t   done;
+   int      rv;
+
+   done = 0;
+   while(iovcnt > 0) {
+      rv = writev(sock_fd, iov, iovcnt);
+      if(rv < 0 && errno == EINTR) {
+         continue;
+      }
+      if(rv <= 0) {
+         return rv;
+      }
+      done += rv;
+
+      /* skip fully written buffers, adjust partially written one */
+      while(iovcnt > 0 && (size_t) rv >= iov->iov_len) {
+         rv -= iov->iov_len;
+         iov++;
+         iovcnt--;
+      }
+      if(iovcnt > 0) {
+         iov->iov_base = (char *)iov->iov_base + rv;
+         iov->iov_len -= rv;
+      }
+   }
+
+   return done;
+}
+
+/* crc-32c of 'len' bytes at 'p' by tables, eight bytes at a time */
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+   uint32_t lo;
+   uint32_t hi;
+
+   while(len >= 8) {
+      lo = crc ^ (p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24));
+      hi = p[4] | (p[5] << 8) | (p[6] << 16) | ((uint32_t) p[7] << 24);
+      crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+            crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+            crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+            crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+      p += 8;
+      len -= 8;
+   }
+   while(len--) {
+      crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+   }
+
+   return crc;
+}
+
+#ifdef SAM_HAVE_SSE42
+/* crc-32c of 'len' bytes at 'p' by crc32 instruction of sse4.2 */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+#ifdef __x86_64__
+   uint64_t crc64;
+   uint64_t word;
+
+   while(len && ((uintptr_t) p & 7)) {
+      crc = _mm_crc32_u8(crc, *p++);
+      len--;
+   }
+   crc64 = crc;
+   while(len >= 8) {
+      memcpy(&word, p, sizeof(word));
+      crc64 = _mm_crc32_u64(crc64, word);
+      p += 8;
+      len -= 8;
+   }
+   crc = crc64;
+#endif
+   while(len--) {
+      crc = _mm_crc32_u8(crc, *p++);
+   }
+
+   return crc;
+}
+#endif
+
+/* builds tables and picks fastest way of computing crc-32c on this cpu */
+static void crc32c_init(void)
+{
+   uint32_t crc;
+   int      i;
+   int      k;
+
+   for(i = 0; i < 256; i++) {
+      crc = i;
+      for(k = 0; k < 8; k++) {
+         crc = (crc & 1)? (crc >> 1) ^ CRC32C_POLY: crc >> 1;
+      }
+      crc32c_table[0][i] = crc;
+   }
+   for(i = 0; i < 256; i++) {
+      crc = crc32c_table[0][i];
+      for(k = 1; k < 8; k++) {
+         crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+         crc32c_table[k][i] = crc;
+      }
+   }
+
+   crc32c_update = crc32c_sw;
+#ifdef SAM_HAVE_SSE42
+   __builtin_cpu_init();
+   if(__builtin_cpu_supports("sse4.2")) {
+      crc32c_update = crc32c_hw;
+   }
+#endif
+}
+
+/* checksum carried in every frame header to detect corrupted or out-of-sync data.
+   crc-32c (castagnoli), computed 8 bytes per instruction on cpus having sse4.2,
+   and with slicing-by-8 tables on others. start with SAMFS_CSUM_INIT,
+   'csum' of previous call can be passed to continue over next buffer.
+ */
+uint32_t samfs_csum(uint32_t csum, const void *buf, size_t len)
+{
+   pthread_once(&crc32c_once, crc32c_init);
+
+   return ~crc32c_update(~csum, buf, len);
+}
+
+/* checksum of a frame scattered over 'iov' */
+uint32_t samfs_csum_iov(const struct iovec *iov, int iovcnt)
+{
+   uint32_t csum;
+   int      i;
+
+   csum = SAMFS_CSUM_INIT;
+   for(i = 0; i < iovcnt; i++) {
+      csum = samfs_csum(csum, iov[i].iov_base, iov[i].iov_len);
+   }
+
+   return csum;
+}
+
+#ifdef SAMFS_ZSTD
+static void zstd_ctx_free(void *data)
+{
+   struct zstd_ctx_t *ctx;
+
+   ctx = data;
+   ZSTD_freeCCtx(ctx->cctx);
+   ZSTD_freeDCtx(ctx->dctx);
+   free(ctx);
+}
+
+static void zstd_key_init(void)
+{
+   pthread_key_create(&zstd_key, zstd_ctx_free);
+}
+
+/* zstd contexts of calling thread, NULL if they can not be allocated */
+static struct zstd_ctx_t *zstd_ctx(void)
+{
+   struct zstd_ctx_t *ctx;
+
+   pthread_once(&zstd_once, zstd_key_init);
+   ctx = pthread_getspecific(zstd_key);
+   if(ctx) {
+      return ctx;
+   }
+   ctx = calloc(1, sizeof(struct zstd_ctx_t));
+   if(NULL == ctx) {
+      return NULL;
+   }
+   ctx->cctx = ZSTD_createCCtx();
+   ctx->dctx = ZSTD_createDCtx();
+   if(NULL == ctx->cctx || NULL == ctx->dctx || pthread_setspecific(zstd_key, ctx)) {
+      zstd_ctx_free(ctx);
+      return NULL;
+   }
+
+   return ctx;
+}
+#endif
+
+/* compression codecs built in, as SAMFS_FEAT_* flags */
+uint32_t samfs_zip_features(void)
+{
+   uint32_t features;
+
+   features = 0;
+#ifdef SAMFS_LZ4
+   features |= SAMFS_FEAT_LZ4;
+#endif
+#ifdef SAMFS_ZSTD
+   features |= SAMFS_FEAT_ZSTD;
+#endif
+
+   return features;
+}
+
+/* compress 'len' bytes of 'src' with 'codec' into at most 'cap' bytes at 'dst'.
+   returns compressed length, 0 if it does not fit.
+ */
+static size_t zip_data(int codec, const char *src, size_t len, char *dst, size_t cap)
+{
+   size_t               rv;
+#ifdef SAMFS_ZSTD
+   struct zstd_ctx_t    *ctx;
+#endif
+
+   rv = 0;
+#ifdef SAMFS_LZ4
+   if(FRAME_LZ4 == codec) {
+      rv = LZ4_compress_default(src, dst, len, cap);
+   }
+#endif
+#ifdef SAMFS_ZSTD
+   if(FRAME_ZSTD == codec) {
+      ctx = zstd_ctx();
+      rv = (ctx)? ZSTD_compressCCtx(ctx->cctx, dst, cap, src, len, ZIP_ZSTD_LEVEL): 0;
+      if(ZSTD_isError(rv)) {
+         rv = 0;
+      }
+   }
+#endif
+
+   return rv;
+}
+
+/* tells if 'len' bytes of 'src' look compressible, by compressing their first bytes only.
+   saves compressing whole blocks of media and archives only to send them as they are.
+ */
+int samfs_zip_worth(int codec, const char *src, size_t len)
+{
+   char probe[ZIP_PROBE];
+
+   if(len < 2 * ZIP_PROBE) {
+      return TRUE;
+   }
+
+   return (zip_data(codec, src, ZIP_PROBE, probe, ZIP_PROBE - ZIP_PROBE / 8) > 0)? TRUE: FALSE;
+}
+
+/* compress 'len' bytes of 'src' with 'codec' (FRAME_LZ4 or FRAME_ZSTD) into 'dst',
+   which has room for 'len' bytes. returns length of compressed data, 0 if data
+   should be sent as it is.
+ */
+size_t samfs_zip(int codec, const char *src, size_t len, char *dst)
+{
+   uint32_t raw_len;
+   size_t   n;
+
+   if(len < ZIP_MIN || len > UINT32_MAX || !samfs_zip_worth(codec, src, len)) {
+      return 0;
+   }
+
+   n = zip_data(codec, src, len, dst + sizeof(raw_len), len - len / 8 - sizeof(raw_len));
+   if(0 == n) {
+      return 0;
+   }
+   raw_len = len;
+   memcpy(dst, &raw_len, sizeof(raw_len));
+
+   return sizeof(raw_len) + n;
+}
+
+/* unpack 'len' bytes of data compressed by samfs_zip() into 'dst', which has room for 'cap' bytes.
+   returns unpacked length or -1 if data is corrupted or does not fit.
+ */
+int samfs_unzip(int codec, const char *src, size_t len, char *dst, size_t cap)
+{
+   uint32_t raw_len;
+   long     n;
+#ifdef SAMFS_ZSTD
+   struct zstd_ctx_t *ctx;
+   size_t   rv;
+#endif
+
+   if(len < sizeof(raw_len)) {
+      return -1;
+   }
+   memcpy(&raw_len, src, sizeof(raw_len));
+   if(raw_len > cap || raw_len > INT_MAX) {
+      return -1;
+   }
+   src += sizeof(raw_len);
+   len -= sizeof(raw_len);
+
+   n = -1;
+#ifdef SAMFS_LZ4
+   if(FRAME_LZ4 == codec) {
+      n = LZ4_decompress_safe(src, dst, len, raw_len);
+   }
+#endif
+#ifdef SAMFS_ZSTD
+   if(FRAME_ZSTD == codec) {
+      ctx = zstd_ctx();
+      if(ctx) {
+         rv = ZSTD_decompressDCtx(ctx->dctx, dst, raw_len, src, len);
+         n = (ZSTD_isError(rv))? -1: (long) rv;
+      }
+   }
+#endif
+
+   return (n == raw_len)? (int) raw_len: -1;
+}
+
+/* cpu time used by calling thread, in seconds */
+double samfs_cpu_sec(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* time in nanoseconds, from a clock not affected by date changes */
+uint64_t samfs_now_ns(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* latency histogram bucket of 'ns' nanoseconds */
+int samfs_lat_bucket(uint64_t ns)
+{
+   uint64_t us;
+   int      shift;
+   int      b;
+
+   us = ns / 1000;
+   if(us < SAMFS_LAT_SUB) {
+      return us;
+   }
+   shift = 63 - __builtin_clzll(us) - SAMFS_LAT_SUB_BITS;
+   b = (shift + 1) * SAMFS_LAT_SUB + (us >> shift) - SAMFS_LAT_SUB;
+
+   return (b < SAMFS_LAT_BUCKETS)? b: SAMFS_LAT_BUCKETS - 1;
+}
+
+/* highest microseconds counted in bucket 'b' */
+uint64_t samfs_lat_max(int b)
+{
+   int shift;
+
+   if(b < SAMFS_LAT_SUB) {
+      return b;
+   }
+   shift = b / SAMFS_LAT_SUB - 1;
+
+   return ((uint64_t) (SAMFS_LAT_SUB + b % SAMFS_LAT_SUB + 1) << shift) - 1;
+}
+
+/* microseconds within which fraction 'q' of values counted in histogram 'hist' fall */
+uint64_t samfs_lat_pct(const uint32_t *hist, double q)
+{
+   uint64_t count;
+   uint64_t seen;
+   int      b;
+
+   count = 0;
+   for(b = 0; b < SAMFS_LAT_BUCKETS; b++) {
+      count += hist[b];
+   }
+   seen = 0;
+   for(b = 0; b < SAMFS_LAT_BUCKETS; b++) {
+      seen += hist[b];
+      if(seen && seen >= q * count) {
+         return samfs_lat_max(b);
+      }
+   }
+
+   return 0;
+}
+
+/* compact form of 'us' microseconds, at most 4 characters */
+static char *lat_string(uint64_t us, char *slat)
+{
+   if(us < 1000) {
+      sprintf(slat, "%lluu", (unsigned long long) us);
+   }
+   else if(us < 10000) {
+      sprintf(slat, "%.1fm", us / 1e3);
+   }
+   else if(us < 1000000) {
+      sprintf(slat, "%llum", (unsigned long long) us / 1000);
+   }
+   else if(us < 10000000) {
+      sprintf(slat, "%.1fs", us / 1e6);
+   }
+   else {
+      sprintf(slat, "%llus", (unsigned long long) us / 1000000);
+   }
+
+   return slat;
+}
+
+/* p50/p99/p99.9 of histogram 'hist' for dashboards, 'spct' takes at least 16 bytes */
+char *samfs_lat_pcts(const uint32_t *hist, char *spct)
+{
+   char p50[8], p99[8], p999[8];
+
+   sprintf(spct, "%s/%s/%s", lat_string(samfs_lat_pct(hist, 0.5), p50),
+         lat_string(samfs_lat_pct(hist, 0.99), p99), lat_string(samfs_lat_pct(hist, 0.999), p999));
+
+   return spct;
+}
+
+/* FNV-1a hash of string 'str' continued from 'h', SAMFS_HASH_INIT to start */
+uint64_t samfs_hash(uint64_t h, const char *str)
+{
+   while(*str) {
+      h = (h ^ (unsigned char) *str++) * 1099511628211ULL;
+   }
+
+   return h;
+}
@@ -5,6 +5,9 @@
 #include <errno.h>         /* errno */
 #include <string.h>        /* strdup() */
 #include <stdlib.h>        /* rand() */
+#include <stdint.h>        /* uint32_t */
+#include <stddef.h>        /* offsetof() */
+#include <limits.h>        /* PATH_MAX */
 
 #include <sys/types.h>     /* lstat(), mkdir(), opendir(), closedir(), open(), lseek(), truncate(), utime(), mknod(), utimes(), connect() */
 #include <sys/stat.h>      /* lstat(), mkdir(), open(), chmod(), mknod() */
@@ -18,6 +21,7 @@
 #include <sys/socket.h>    /* connect(), inet_addr()  */
 #include <netinet/in.h>    /* inet_addr() */
 #include <arpa/inet.h>     /* inet_addr(), htons() */
+#include <sys/uio.h>       /* struct iovec */
 
 #define SERVER_PORT  5001
 
@@ -27,9 +31,33 @@
 #define TRUE         1
 #define FALSE        0
 
-#define URL_LEN      80
-#define URI_LEN      160
-#define DATA_SIZE    1024
+#define SAMFS_CSUM_INIT 0        /* initial value of a running samfs_csum() */
+
+#define SAMFS_MAGIC        0x53414d46  /* "SAMF", marks start of every frame */
+#define SAMFS_VERSION      4           /* protocol version, exchanged by HELLO */
+
+#define SAMFS_MIN_PAYLOAD  (64 * 1024)    /* data payload size every peer must accept */
+#define SAMFS_MAX_PAYLOAD  (1024 * 1024)  /* largest data payload carried by one frame */
+#define SAMFS_MAX_FRAME    (SAMFS_MAX_PAYLOAD + 3 * PATH_MAX + 64)  /* payload plus request header and paths */
+
+/* frame flags */
+#define FRAME_EOD          0x0001      /* last frame of a response */
+#define FRAME_RAW          0x0002      /* checksum covers headers only, data is raw file bytes */
+#define FRAME_LZ4          0x0004      /* data is compressed with lz4, see samfs_zip() */
+#define FRAME_ZSTD         0x0008      /* data is compressed with zstd */
+#define FRAME_ZIP          (FRAME_LZ4 | FRAME_ZSTD)
+
+/* request options */
+#define REQ_RAW_DATA       0x0001      /* client accepts FRAME_RAW responses */
+#define REQ_BULK           0x0002      /* WRITE data follows frame as raw bytes and their samfs_csum() */
+#define REQ_LZ4            0x0004      /* client takes READ data compressed with lz4 */
+#define REQ_ZSTD           0x0008      /* client takes READ data compressed with zstd */
+
+/* optional features, negotiated by HELLO */
+#define SAMFS_FEAT_BULK_WRITE 0x0001   /* server takes REQ_BULK writes */
+#define SAMFS_FEAT_READDIRPLUS 0x0002  /* server answers READDIRPLUS */
+#define SAMFS_FEAT_LZ4     0x0004      /* data frames may be compressed with lz4, client proposes one codec */
+#define SAMFS_FEAT_ZSTD    0x0008      /* data frames may be compressed with zstd */
 
 typedef enum msg_type_t {
    UNKNOWN,
@@ -51,32 +79,174 @@ typedef enum msg_type_t {
    CHMOD,
    UTIME,
    STATFS,
+   HELLO,
+   READDIRPLUS,
 } msg_type_t;
 
-/* request packet format */
+/* every message is sent as a frame: this header followed by 'len' bytes of payload.
+   frames are streamed back to back, receiver verifies magic and checksum
+   instead of acknowledging each frame.
+   client may have many requests in flight on a connection, frames of their responses
+   can come in any order and are matched to requests by 'id'.
+ */
+typedef struct frame_hdr_t {
+   uint32_t magic;            /* always SAMFS_MAGIC */
+   uint16_t msg;              /* msg_type_t of request, echoed back in its responses */
+   uint16_t flags;            /* FRAME_* flags */
+   uint32_t len;              /* number of bytes following this header */
+   uint32_t csum;             /* samfs_csum() of header (with csum as 0) and payload */
+   uint64_t id;               /* chosen by client for request, echoed back in its responses */
+} frame_hdr_t;
+
+/* payload of a request frame starts with this header, followed by
+   url, uri and npath strings (each NUL terminated, lengths include NUL)
+   and then request data till the end of frame.
+ */
+typedef struct req_hdr_t {
+   uint32_t mode;
+   int32_t  flags;
+   uint64_t size;
+   int64_t  offset;
+   uint16_t url_len;
+   uint16_t uri_len;
+   uint16_t npath_len;
+   uint16_t opts;             /* REQ_* options */
+   uint64_t fh;               /* server handle of open file, 0 if none */
+} req_hdr_t;
+
+/* payload of a response frame starts with this header, followed by response data */
+typedef struct rsp_hdr_t {
+   int32_t  status;
+   int32_t  errcode;
+   uint64_t size;
+} rsp_hdr_t;
+
+/* data of HELLO request and response, sent once on every new connection.
+   client proposes, server answers with what it accepts.
+ */
+typedef struct hello_t {
+   uint32_t version;          /* SAMFS_VERSION */
+   uint32_t max_payload;      /* largest data payload per frame, at least SAMFS_MIN_PAYLOAD */
+   uint32_t features;         /* SAMFS_FEAT_* flags, absent in hello of older peers */
+} hello_t;
+
+/* entry of READDIRPLUS response data, followed by its NUL terminated name.
+   entries are packed back to back without padding.
+ */
+typedef struct dirent_plus_t {
+   int32_t     errcode;       /* errno of lstat() of entry, 'st' is valid if 0 */
+   uint16_t    name_len;      /* length of name including NUL */
+   uint16_t    reserved;
+   struct stat st;
+} dirent_plus_t;
+
+/* decoded request */
 typedef struct req_t {
-   int      magic;            /* magic number, used by send/recv for integrity check */
+   uint64_t id;               /* frame id of request, responses carry it back */
    int      msg;              /* request message (of type msg_type_t) */
-   char     url[URL_LEN];     /* server dir name mounted on client */
-   char     uri[URI_LEN];     /* full name/path of file/dir wrt client mount-point */
+   char     *url;             /* server dir name mounted on client */
+   char     *uri;             /* full name/path of file/dir wrt client mount-point */
+   char     *npath;           /* new name/path of file/dir, used by rename */
    mode_t   mode;             /* mode of file operations, used by mkdir */
    int      flags;            /* flags for creating new file, used by create  */
-   int      truncate_len;     /* used by truncate */
    size_t   size;             /* used by read/write */
-   off_t    offset;           /* used by read/write */
-   char     endofdata;        /* used by write, set to 1 if this is last data packet */
-   char     data[DATA_SIZE];  /* used by write */
+   off_t    offset;           /* used by read/write, new length for truncate */
+   int      opts;             /* REQ_* options */
+   uint64_t fh;               /* handle returned by open/create, used by read/write/release */
+   char     *data;            /* used by write, utime and hello */
+   size_t   data_len;         /* length of data */
+   int      zip;              /* FRAME_LZ4 or FRAME_ZSTD if data is compressed, 'size' is its length unpacked */
+   char     *buf;             /* receive buffer backing pointers above, reused across requests */
+   size_t   buf_size;         /* allocated size of buf */
+   uint64_t rcvd_ns;          /* server side, monotonic time request was received */
+   uint64_t start_ns;         /* server side, time its serving started */
+   uint64_t send_ns;          /* server side, time spent sending its responses */
+   int      errcode;          /* server side, errno of its failure response, 0 if none */
 } req_t;
 
-/* response packet format */
+/* decoded response */
 typedef struct rsp_t {
-   int      magic;            /* magic number, used by send/recv for integrity check */
    int      status;           /* status of the request, 0 if success, -1 on failure */
    int      errcode;          /* stores errno in case of failure */
    size_t   size;             /* used by read/write */
-   char     endofdata;        /* set to 1 if this is last data packet */
-   char     data[DATA_SIZE];  /* output data of requested command */
+   char     endofdata;        /* set to 1 if this is last frame of response */
+   char     *data;            /* output data of requested command */
+   size_t   data_len;         /* length of data */
+   size_t   data_cap;         /* receiver side, space available at data */
+   int      zip;              /* sender side, FRAME_LZ4 or FRAME_ZSTD if data is compressed */
 } rsp_t;
 
+/* latency histograms are log-linear over microseconds, like HDR histograms: values below
+   SAMFS_LAT_SUB have a bucket each, every further power of 2 is split in SAMFS_LAT_SUB buckets.
+   a value is off by at most 1/SAMFS_LAT_SUB of it, up to 2^SAMFS_LAT_MAX_BITS us (about a minute).
+ */
+#define SAMFS_LAT_SUB_BITS 3
+#define SAMFS_LAT_SUB      (1 << SAMFS_LAT_SUB_BITS)
+#define SAMFS_LAT_MAX_BITS 26
+#define SAMFS_LAT_BUCKETS  ((SAMFS_LAT_MAX_BITS - SAMFS_LAT_SUB_BITS + 1) * SAMFS_LAT_SUB)
+
+#define SAMFS_HASH_INIT    14695981039346656037ULL   /* initial value of a running samfs_hash() */
+
+#define SAMFS_TRACE_MAGIC  0x53414d54  /* "SAMT", starts request trace file */
+#define SAMFS_TRACE_VERSION 1
+
+/* request trace written by 'samd -trace' and replayed by samreplay. file is this header,
+   then 'rings' ring heads and then 'rings' arrays of 'ring_recs' records. every serving
+   thread (or forked child) of samd writes a ring of its own, newest records overwrite oldest.
+ */
+typedef struct trace_hdr_t {
+   uint32_t magic;            /* SAMFS_TRACE_MAGIC */
+   uint32_t version;          /* SAMFS_TRACE_VERSION */
+   uint32_t rec_size;         /* sizeof(trace_rec_t) */
+   uint32_t rings;
+   uint64_t ring_recs;        /* records of each ring, power of 2 */
+   uint64_t start_ns;         /* monotonic time trace was started */
+   uint64_t start_real_ns;    /* wall clock time at start_ns */
+   uint64_t reserved[3];
+} trace_hdr_t;
+
+/* head of a ring, in a cache line of its own */
+typedef struct trace_ring_t {
+   uint64_t head;             /* records ever claimed in ring, record i is at i % ring_recs */
+   uint64_t reserved[7];
+} trace_ring_t;
+
+/* one served request. paths are not kept, only their hashes: replay maps them to names of its own */
+typedef struct trace_rec_t {
+   uint64_t seq;              /* 1 + index of record in its ring, 0 while it is being written */
+   uint64_t conn;             /* connection request came on, unique within trace */
+   uint64_t rcvd_ns;          /* monotonic time request was received */
+   uint64_t dur_ns;           /* from received till served */
+   uint64_t path;             /* samfs_hash() of url and uri */
+   uint64_t npath;            /* samfs_hash() of url and npath, 0 if none */
+   int64_t  offset;
+   uint64_t size;
+   uint32_t queue_ns;         /* part of dur_ns request waited to be served, at most UINT32_MAX */
+   uint32_t mode;
+   int32_t  flags;
+   int32_t  errcode;          /* errno of failure response, 0 if served */
+   uint16_t msg;              /* msg_type_t */
+   uint16_t opts;             /* REQ_* options */
+   uint32_t reserved;
+} trace_rec_t;
+
+/* helpers shared by client and server, see samfs_common.c */
+int      samfs_read_full(int sock_fd, void *buf, size_t len);
+int      samfs_write_full(int sock_fd, const void *buf, size_t len);
+int      samfs_writev_full(int sock_fd, struct iovec *iov, int iovcnt);
+uint32_t samfs_csum(uint32_t csum, const void *buf, size_t len);
+uint32_t samfs_csum_iov(const struct iovec *iov, int iovcnt);
+uint32_t samfs_zip_features(void);
+int      samfs_zip_worth(int codec, const char *src, size_t len);
+size_t   samfs_zip(int codec, const char *src, size_t len, char *dst);
+int      samfs_unzip(int codec, const char *src, size_t len, char *dst, size_t cap);
+double   samfs_cpu_sec(void);
+uint64_t samfs_now_ns(void);
+int      samfs_lat_bucket(uint64_t ns);
+uint64_t samfs_lat_max(int b);
+uint64_t samfs_lat_pct(const uint32_t *hist, double q);
+char     *samfs_lat_pcts(const uint32_t *hist, char *spct);
+uint64_t samfs_hash(uint64_t h, const char *str);
+
 #endif
 
@@ -0,0 +1,772 @@
+/* samreplay: replays a request trace recorded by 'samd -trace' against a running samd.
+
+   traced requests are sent again in order they were received, over as many connections
+   as traced (at most '-conns'), at original pace or sped up by '-speed'. trace keeps
+   hashes of paths only, so every traced path becomes a name of its own in directory
+   '-url' of exported dir. paths used before trace started are created there first,
+   files as long as their furthest traced read, so that requests find what they found
+   when they were traced.
+ */
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>      /* mmap() */
+#include <time.h>          /* clock_nanosleep() */
+#include <netinet/tcp.h>   /* TCP_NODELAY */
+
+#include "samfs_common.h"
+
+#define REPLAY_CONNS      16          /* default max connections, '-conns' */
+#define REPLAY_URL        "/samreplay" /* default dir of replayed paths, '-url' */
+#define REPLAY_MSGS       (READDIRPLUS + 1)
+#define FH_SLOTS          4096        /* power of 2, handles of files opened by replay */
+
+/* what a traced path has been used as */
+#define PATH_FILE         0x0001
+#define PATH_DIR          0x0002
+
+/* names of requests, by msg_type_t */
+static const char *msg_names[REPLAY_MSGS] = {
+   "unknown",
+   "getattr",
+   "access",
+   "mkdir",
+   "opendir",
+   "readdir",
+   "releasedir",
+   "rmdir",
+   "create",
+   "open",
+   "read",
+   "write",
+   "truncate",
+   "release",
+   "unlink",
+   "rename",
+   "chmod",
+   "utime",
+   "statfs",
+   "hello",
+   "readdirplus",
+};
+
+/* traced path, known by its hash only */
+struct path_t {
+   uint64_t       hash;                /* 0 if entry is free */
+   int            kind;                /* PATH_* flags */
+   int            made;                /* TRUE if setup creates it, -1 if replay does, 0 if not seen yet */
+   uint64_t       extent;              /* furthest byte read from it */
+};
+
+/* connection of replay, serves traced connections mapped to it in their order */
+struct lane_t {
+   pthread_t         tid;
+   int               fd;
+   struct trace_rec_t **recs;          /* its records, in order they were received */
+   size_t            nrecs;
+   size_t            recs_cap;
+   char              *buf;             /* receive buffer */
+   uint64_t          done;             /* requests replayed */
+   uint64_t          mismatches;       /* those whose errno differs from trace */
+   uint32_t          lat[REPLAY_MSGS][SAMFS_LAT_BUCKETS];  /* replayed latency */
+   uint32_t          lag[SAMFS_LAT_BUCKETS];   /* how late requests went out */
+};
+
+static char             SERVER_IP[16] = "127.0.0.1";
+static char             SERVER_URL[PATH_MAX] = REPLAY_URL;
+static double           speed = 1.0;         /* 0 sends requests as fast as server takes them */
+static uint32_t         max_payload;         /* agreed with server by HELLO */
+static char             *write_data;         /* data of replayed writes */
+
+static struct trace_rec_t *recs;             /* records of trace, in order they were received */
+static size_t           nrecs;
+static struct path_t    *paths;              /* hash table of traced paths */
+static size_t           paths_size;          /* power of 2 */
+
+static struct {
+   uint64_t path;
+   uint64_t fh;
+} fh_table[FH_SLOTS];                        /* handle of each open path, direct mapped */
+static pthread_mutex_t  fh_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t         replay_start_ns;     /* when first record is replayed */
+static uint64_t         trace_start_ns;      /* when first record was received */
+
+/* copies valid records of all rings out of trace file 'path'. file may still be written
+   by samd, records being written while they are copied are left out.
+ */
+static int load_trace(const char *path)
+{
+   struct stat          st;
+   struct trace_hdr_t   *hdr;
+   struct trace_ring_t  *rings;
+   struct trace_rec_t   *ring_recs;
+   struct trace_rec_t   *rec;
+   uint64_t             head;
+   uint64_t             seq;
+   uint64_t             i;
+   char                 *map;
+   uint32_t             r;
+   int                  fd;
+
+   fd = open(path, O_RDONLY);
+   if(fd < 0 || fstat(fd, &st) < 0) {
+      perror(path);
+      return FAIL;
+   }
+   map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   if(MAP_FAILED == map) {
+      perror("mmap");
+      return FAIL;
+   }
+
+   hdr = (struct trace_hdr_t *) map;
+   if(st.st_size < sizeof(*hdr) || __atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != SAMFS_TRACE_MAGIC ||
+         hdr->version != SAMFS_TRACE_VERSION || hdr->rec_size != sizeof(struct trace_rec_t) ||
+         st.st_size < sizeof(*hdr) + hdr->rings * (sizeof(struct trace_ring_t) + hdr->ring_recs * hdr->rec_size)) {
+      printf("%s is not a request trace of this version\n", path);
+      munmap(map, st.st_size);
+      return FAIL;
+   }
+   rings = (struct trace_ring_t *) (map + sizeof(*hdr));
+   ring_recs = (struct trace_rec_t *) (rings + hdr->rings);
+
+   recs = malloc(sizeof(struct trace_rec_t) * hdr->rings * hdr->ring_recs);
+   if(NULL == recs) {
+      munmap(map, st.st_size);
+      return FAIL;
+   }
+   nrecs = 0;
+   for(r = 0; r < hdr->rings; r++) {
+      head = __atomic_load_n(&rings[r].head, __ATOMIC_ACQUIRE);
+      i = (head > hdr->ring_recs)? head - hdr->ring_recs: 0;
+      for(; i < head; i++) {
+         rec = &ring_recs[r * hdr->ring_recs + (i & (hdr->ring_recs - 1))];
+         seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+         recs[nrecs] = *rec;
+         __atomic_thread_fence(__ATOMIC_ACQUIRE);
+         if(seq != i + 1 || __atomic_load_n(&rec->seq, __ATOMIC_RELAXED) != seq) {
+            continue;
+         }
+         /* replay says hello on connections of its own */
+         if(HELLO == recs[nrecs].msg || recs[nrecs].msg <= UNKNOWN || recs[nrecs].msg >= REPLAY_MSGS) {
+            continue;
+         }
+         nrecs++;
+      }
+   }
+   munmap(map, st.st_size);
+
+   return SUCCESS;
+}
+
+static int cmp_rec(const void *a, const void *b)
+{
+   const struct trace_rec_t *ra = a;
+   const struct trace_rec_t *rb = b;
+
+   return (ra->rcvd_ns > rb->rcvd_ns) - (ra->rcvd_ns < rb->rcvd_ns);
+}
+
+/* entry of path 'hash', taken if it is new */
+static struct path_t *path_find(uint64_t hash)
+{
+   size_t i;
+
+   i = hash & (paths_size - 1);
+   while(paths[i].hash && paths[i].hash != hash) {
+      i = (i + 1) & (paths_size - 1);
+   }
+   paths[i].hash = hash;
+
+   return &paths[i];
+}
+
+/* finds out what each traced path is, and which of them must exist before replay:
+   those whose first traced request neither created them nor found them missing.
+ */
+static int scan_paths(void)
+{
+   struct trace_rec_t   *rec;
+   struct path_t        *p;
+   size_t               i;
+
+   paths_size = 1024;
+   while(paths_size < 4 * nrecs) {
+      paths_size *= 2;
+   }
+   paths = calloc(paths_size, sizeof(struct path_t));
+   if(NULL == paths) {
+      return FAIL;
+   }
+
+   for(i = 0; i < nrecs; i++) {
+      rec = &recs[i];
+      if(STATFS == rec->msg) {
+         continue;
+      }
+      p = path_find(rec->path);
+      if(0 == p->made) {
+         /* first request of path */
+         p->made = (MKDIR == rec->msg || CREATE == rec->msg || ENOENT == rec->errcode)? -1: TRUE;
+      }
+      switch(rec->msg) {
+         case MKDIR:
+         case OPENDIR:
+         case READDIR:
+         case READDIRPLUS:
+         case RELEASEDIR:
+         case RMDIR:
+            p->kind |= PATH_DIR;
+            break;
+         case READ:
+            if(rec->offset + rec->size > p->extent) {
+               p->extent = rec->offset + rec->size;
+            }
+            /* fall through */
+         case CREATE:
+         case OPEN:
+         case WRITE:
+         case TRUNCATE:
+         case RELEASE:
+            p->kind |= PATH_FILE;
+            break;
+         default: break;
+      }
+      if(RENAME == rec->msg && rec->npath) {
+         p = path_find(rec->npath);
+         if(0 == p->made) {
+            p->made = -1;  /* rename creates it */
+         }
+      }
+   }
+
+   return SUCCESS;
+}
+
+/* name replay gives to path 'hash' */
+static char *path_name(uint64_t hash, char *name)
+{
+   sprintf(name, "/%016llx", (unsigned long long) hash);
+
+   return name;
+}
+
+static int send_req(int sock_fd, int msg, const char *uri, const char *npath, uint32_t mode, int flags,
+      uint64_t size, int64_t offset, uint64_t fh, const char *data, size_t data_len)
+{
+   struct frame_hdr_t   hdr;
+   struct req_hdr_t     rhdr;
+   struct iovec         iov[6];
+
+   memset(&rhdr, 0, sizeof(rhdr));
+   rhdr.mode = mode;
+   rhdr.flags = flags;
+   rhdr.size = size;
+   rhdr.offset = offset;
+   rhdr.url_len = strlen(SERVER_URL) + 1;
+   rhdr.uri_len = strlen(uri) + 1;
+   rhdr.npath_len = (npath)? strlen(npath) + 1: 0;
+   rhdr.fh = fh;
+
+   hdr.magic = SAMFS_MAGIC;
+   hdr.msg = msg;
+   hdr.flags = 0;
+   hdr.id = 1;    /* one request in flight on each connection */
+   hdr.len = sizeof(rhdr) + rhdr.url_len + rhdr.uri_len + rhdr.npath_len + data_len;
+   hdr.csum = 0;
+
+   iov[0].iov_base = &hdr;
+   iov[0].iov_len = sizeof(hdr);
+   iov[1].iov_base = &rhdr;
+   iov[1].iov_len = sizeof(rhdr);
+   iov[2].iov_base = SERVER_URL;
+   iov[2].iov_len = rhdr.url_len;
+   iov[3].iov_base = (char *) uri;
+   iov[3].iov_len = rhdr.uri_len;
+   iov[4].iov_base = (char *) npath;
+   iov[4].iov_len = rhdr.npath_len;
+   iov[5].iov_base = (char *) data;
+   iov[5].iov_len = data_len;
+   hdr.csum = samfs_csum_iov(iov, 6);
+
+   return (samfs_writev_full(sock_fd, iov, 6) <= 0)? -1: 0;
+}
+
+/* reads frames of response till its last one into 'buf' (SAMFS_MAX_FRAME bytes).
+   'errcode' is set to errno of a failed response, 0 otherwise, 'size' to size of first frame.
+ */
+static int read_rsp(int sock_fd, char *buf, int *errcode, uint64_t *size)
+{
+   struct frame_hdr_t   hdr;
+   struct rsp_hdr_t     rhdr;
+   int                  first;
+
+   *errcode = 0;
+   *size = 0;
+   first = TRUE;
+   do {
+      if(samfs_read_full(sock_fd, &hdr, sizeof(hdr)) <= 0) {
+         return -1;
+      }
+      if(hdr.magic != SAMFS_MAGIC || hdr.len < sizeof(rhdr) || hdr.len > SAMFS_MAX_FRAME) {
+         printf("invalid response frame\n");
+         return -1;
+      }
+      /* data is thrown away, checksum is not worth verifying */
+      if(samfs_read_full(sock_fd, buf, hdr.len) <= 0) {
+         return -1;
+      }
+      memcpy(&rhdr, buf, sizeof(rhdr));
+      if(SUCCESS != rhdr.status) {
+         *errcode = rhdr.errcode;
+      }
+      if(first) {
+         *size = rhdr.size;
+         first = FALSE;
+      }
+   } while(!(hdr.flags & FRAME_EOD));
+
+   return 0;
+}
+
+/* sends a request and waits for its response, returns errno of response or -1 if connection failed */
+static int call(int sock_fd, char *buf, int msg, const char *uri, const char *npath, uint32_t mode, int flags,
+      uint64_t size, int64_t offset, uint64_t fh, const char *data, size_t data_len, uint64_t *rsp_size)
+{
+   uint64_t dummy;
+   int      errcode;
+
+   if(send_req(sock_fd, msg, uri, npath, mode, flags, size, offset, fh, data, data_len) < 0 ||
+         read_rsp(sock_fd, buf, &errcode, (rsp_size)? rsp_size: &dummy) < 0) {
+      return -1;
+   }
+
+   return errcode;
+}
+
+/* connects to server and says hello */
+static int connect_to_server(char *buf)
+{
+   struct sockaddr_in   sock;
+   struct hello_t       hello;
+   uint64_t             size;
+   int                  sock_fd;
+   int                  optval;
+
+   sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+   if(sock_fd < 0) {
+      perror("socket");
+      return -1;
+   }
+   optval = 1;
+   setsockopt(sock_fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+
+   memset(&sock, 0, sizeof(sock));
+   sock.sin_family = AF_INET;
+   sock.sin_addr.s_addr = inet_addr(SERVER_IP);
+   sock.sin_port = htons(SERVER_PORT);
+   if(connect(sock_fd, (struct sockaddr *) &sock, sizeof(sock)) < 0) {
+      perror("connect");
+      close(sock_fd);
+      return -1;
+   }
+
+   hello.version = SAMFS_VERSION;
+   hello.max_payload = SAMFS_MAX_PAYLOAD;
+   hello.features = 0;
+   if(call(sock_fd, buf, HELLO, "", NULL, 0, 0, 0, 0, 0, (char *) &hello, sizeof(hello), &size) != 0) {
+      printf("server refused hello\n");
+      close(sock_fd);
+      return -1;
+   }
+   memcpy(&hello, buf + sizeof(struct rsp_hdr_t), sizeof(hello));
+   max_payload = (hello.max_payload < SAMFS_MAX_PAYLOAD)? hello.max_payload: SAMFS_MAX_PAYLOAD;
+
+   return sock_fd;
+}
+
+/* creates replay dir and paths that existed before trace started */
+static int setup_paths(void)
+{
+   struct path_t  *p;
+   char           name[32];
+   char           *buf;
+   uint64_t       fh;
+   size_t         made;
+   size_t         i;
+   int            sock_fd;
+   int            rv;
+
+   buf = malloc(SAMFS_MAX_FRAME);
+   if(NULL == buf) {
+      return FAIL;
+   }
+   sock_fd = connect_to_server(buf);
+   if(sock_fd < 0) {
+      free(buf);
+      return FAIL;
+   }
+
+   rv = call(sock_fd, buf, MKDIR, "", NULL, 0755, 0, 0, 0, 0, NULL, 0, NULL);
+   if(rv != 0 && rv != EEXIST) {
+      printf("can not create %s on server: %s\n", SERVER_URL, strerror((rv < 0)? ECONNRESET: rv));
+      goto out;
+   }
+
+   made = 0;
+   for(i = 0; i < paths_size; i++) {
+      p = &paths[i];
+      if(0 == p->hash || TRUE != p->made) {
+         continue;
+      }
+      path_name(p->hash, name);
+      if(p->kind & PATH_DIR) {
+         rv = call(sock_fd, buf, MKDIR, name, NULL, 0755, 0, 0, 0, 0, NULL, 0, NULL);
+      }
+      else {
+         /* files are sparse, reads of them find zeros */
+         rv = call(sock_fd, buf, CREATE, name, NULL, 0644, O_TRUNC, 0, 0, 0, NULL, 0, &fh);
+         if(0 == rv) {
+            rv = call(sock_fd, buf, RELEASE, name, NULL, 0, 0, 0, 0, fh, NULL, 0, NULL);
+         }
+         if(0 == rv && p->extent) {
+            rv = call(sock_fd, buf, TRUNCATE, name, NULL, 0, 0, 0, p->extent, 0, NULL, 0, NULL);
+         }
+      }
+      if(rv < 0) {
+         printf("lost connection to server\n");
+         goto out;
+      }
+      made++;
+   }
+   printf("created %zu paths in %s\n", made, SERVER_URL);
+   rv = 0;
+
+out:
+   close(sock_fd);
+   free(buf);
+
+   return (0 == rv)? SUCCESS: FAIL;
+}
+
+/* handle replay got for path 'path' by open or create, 0 if none. 'take' forgets it */
+static uint64_t fh_get(uint64_t path, int take)
+{
+   uint64_t fh;
+   int      i;
+
+   i = path & (FH_SLOTS - 1);
+   fh = 0;
+   pthread_mutex_lock(&fh_lock);
+   if(fh_table[i].path == path) {
+      fh = fh_table[i].fh;
+      if(take) {
+         fh_table[i].path = 0;
+      }
+   }
+   pthread_mutex_unlock(&fh_lock);
+
+   return fh;
+}
+
+/* remembers handle 'fh' of path 'path', one it displaces is left for server to evict */
+static void fh_put(uint64_t path, uint64_t fh)
+{
+   int i;
+
+   i = path & (FH_SLOTS - 1);
+   pthread_mutex_lock(&fh_lock);
+   fh_table[i].path = path;
+   fh_table[i].fh = fh;
+   pthread_mutex_unlock(&fh_lock);
+}
+
+/* replays traced request 'rec' on connection of 'lane', returns errno of response or -1 */
+static int replay_rec(struct lane_t *lane, struct trace_rec_t *rec)
+{
+   char     name[32];
+   char     nname[32];
+   uint64_t fh;
+   uint64_t size;
+   size_t   len;
+   int      rv;
+
+   path_name(rec->path, name);
+   switch(rec->msg) {
+      case CREATE:
+      case OPEN:
+         rv = call(lane->fd, lane->buf, rec->msg, name, NULL, rec->mode, rec->flags, 0, 0, 0, NULL, 0, &fh);
+         if(0 == rv && fh) {
+            fh_put(rec->path, fh);
+         }
+         break;
+      case READ:
+         rv = call(lane->fd, lane->buf, READ, name, NULL, 0, 0, rec->size, rec->offset, fh_get(rec->path, FALSE),
+               NULL, 0, &size);
+         break;
+      case WRITE:
+         len = (rec->size < max_payload)? rec->size: max_payload;
+         rv = call(lane->fd, lane->buf, WRITE, name, NULL, 0, 0, len, rec->offset, fh_get(rec->path, FALSE),
+               write_data, len, &size);
+         break;
+      case RELEASE:
+         rv = call(lane->fd, lane->buf, RELEASE, name, NULL, 0, 0, 0, 0, fh_get(rec->path, TRUE), NULL, 0, NULL);
+         break;
+      case RENAME:
+         rv = call(lane->fd, lane->buf, RENAME, name, path_name(rec->npath, nname), 0, 0, 0, 0, 0, NULL, 0, NULL);
+         break;
+      case STATFS:
+         rv = call(lane->fd, lane->buf, STATFS, "", NULL, 0, 0, 0, 0, 0, NULL, 0, NULL);
+         break;
+      default:
+         /* utime sets times to now, traced times are not kept */
+         rv = call(lane->fd, lane->buf, rec->msg, name, NULL, rec->mode, rec->flags, rec->size, rec->offset, 0,
+               NULL, 0, NULL);
+         break;
+   }
+
+   return rv;
+}
+
+static void *lane_main(void *data)
+{
+   struct lane_t        *lane;
+   struct trace_rec_t   *rec;
+   struct timespec      ts;
+   uint64_t             due;
+   uint64_t             start;
+   size_t               i;
+   int                  rv;
+
+   lane = data;
+   for(i = 0; i < lane->nrecs; i++) {
+      rec = lane->recs[i];
+
+      /* request goes out as long after first one as it was received, divided by speed */
+      due = replay_start_ns;
+      if(speed > 0) {
+         due += (rec->rcvd_ns - trace_start_ns) / speed;
+         ts.tv_sec = due / 1000000000ULL;
+         ts.tv_nsec = due % 1000000000ULL;
+         while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+      }
+      start = samfs_now_ns();
+      lane->lag[samfs_lat_bucket((start > due)? start - due: 0)]++;
+
+      rv = replay_rec(lane, rec);
+      if(rv < 0) {
+         printf("lost connection to server\n");
+         break;
+      }
+      lane->lat[rec->msg][samfs_lat_bucket(samfs_now_ns() - start)]++;
+      lane->done++;
+      if(rv != rec->errcode) {
+         lane->mismatches++;
+      }
+   }
+
+   return NULL;
+}
+
+/* spreads records over 'nlanes' lanes, each traced connection goes to one lane */
+static int assign_lanes(struct lane_t *lanes, int nlanes)
+{
+   struct {
+      uint64_t conn;
+      int      lane;
+   } *conns;
+   struct lane_t  *lane;
+   size_t         conns_size;
+   size_t         h;
+   size_t         i;
+   int            next;
+
+   conns_size = 1024;
+   while(conns_size < 2 * nrecs) {
+      conns_size *= 2;
+   }
+   conns = calloc(conns_size, sizeof(*conns));
+   if(NULL == conns) {
+      return FAIL;
+   }
+
+   next = 0;
+   for(i = 0; i < nrecs; i++) {
+      h = (recs[i].conn * 0x9e3779b97f4a7c15ULL) & (conns_size - 1);
+      while(conns[h].conn && conns[h].conn != recs[i].conn) {
+         h = (h + 1) & (conns_size - 1);
+      }
+      if(0 == conns[h].conn) {
+         conns[h].conn = recs[i].conn;
+         conns[h].lane = next++ % nlanes;
+      }
+
+      lane = &lanes[conns[h].lane];
+      if(lane->nrecs == lane->recs_cap) {
+         lane->recs_cap = (lane->recs_cap)? lane->recs_cap * 2: 1024;
+         lane->recs = realloc(lane->recs, lane->recs_cap * sizeof(struct trace_rec_t *));
+         if(NULL == lane->recs) {
+            free(conns);
+            return FAIL;
+         }
+      }
+      lane->recs[lane->nrecs++] = &recs[i];
+   }
+   free(conns);
+
+   return SUCCESS;
+}
+
+/* prints traced and replayed latency of each kind of request */
+static void print_report(struct lane_t *lanes, int nlanes, uint64_t elapsed_ns)
+{
+   static uint32_t   traced[REPLAY_MSGS][SAMFS_LAT_BUCKETS];
+   static uint32_t   replayed[REPLAY_MSGS][SAMFS_LAT_BUCKETS];
+   static uint32_t   lag[SAMFS_LAT_BUCKETS];
+   uint64_t          count[REPLAY_MSGS];
+   uint64_t          done;
+   uint64_t          mismatches;
+   char              spct[16], rpct[16];
+   size_t            i;
+   int               m;
+   int               b;
+   int               l;
+
+   memset(count, 0, sizeof(count));
+   for(i = 0; i < nrecs; i++) {
+      traced[recs[i].msg][samfs_lat_bucket(recs[i].dur_ns)]++;
+   }
+   done = 0;
+   mismatches = 0;
+   for(l = 0; l < nlanes; l++) {
+      done += lanes[l].done;
+      mismatches += lanes[l].mismatches;
+      for(b = 0; b < SAMFS_LAT_BUCKETS; b++) {
+         lag[b] += lanes[l].lag[b];
+         for(m = 0; m < REPLAY_MSGS; m++) {
+            replayed[m][b] += lanes[l].lat[m][b];
+            count[m] += lanes[l].lat[m][b];
+         }
+      }
+   }
+
+   printf("replayed %llu of %zu requests in %.2f s (%.0f requests/s)\n", (unsigned long long) done, nrecs,
+         elapsed_ns / 1e9, (elapsed_ns)? done * 1e9 / elapsed_ns: 0.0);
+   printf("%llu responses differ from traced ones\n", (unsigned long long) mismatches);
+   if(speed > 0) {
+      /* requests of a connection go one at a time, those traced overlapping are sent late */
+      printf("requests went out late by p50/p99/p99.9 %s\n", samfs_lat_pcts(lag, spct));
+   }
+   printf("\n%-11s %9s  %-16s %-16s (p50/p99/p99.9, u = us, m = ms, s = sec)\n", "Request", "Count", "Traced", "Replayed");
+   for(m = 0; m < REPLAY_MSGS; m++) {
+      if(0 == count[m]) {
+         continue;
+      }
+      printf("%-11s %9llu  %-16s %-16s\n", msg_names[m], (unsigned long long) count[m],
+            samfs_lat_pcts(traced[m], spct), samfs_lat_pcts(replayed[m], rpct));
+   }
+}
+
+int main(int argc, char *argv[])
+{
+   struct lane_t  *lanes;
+   const char     *trace_path;
+   uint64_t       conns;
+   uint64_t       elapsed;
+   size_t         i;
+   int            nlanes;
+   int            l;
+
+   nlanes = REPLAY_CONNS;
+   trace_path = NULL;
+   for(i = 1; i < argc; i++) {
+      if(strcmp(argv[i], "-server") == 0 && i + 1 < argc && inet_addr(argv[i + 1]) != INADDR_NONE) {
+         snprintf(SERVER_IP, sizeof(SERVER_IP), "%s", argv[++i]);
+      }
+      else if(strcmp(argv[i], "-url") == 0 && i + 1 < argc && argv[i + 1][0] == '/' && argv[i + 1][1]) {
+         snprintf(SERVER_URL, sizeof(SERVER_URL), "%s", argv[++i]);
+      }
+      else if(strcmp(argv[i], "-speed") == 0 && i + 1 < argc && atof(argv[i + 1]) >= 0) {
+         speed = atof(argv[++i]);
+      }
+      else if(strcmp(argv[i], "-conns") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+         nlanes = atoi(argv[++i]);
+      }
+      else if(argv[i][0] != '-' && NULL == trace_path) {
+         trace_path = argv[i];
+      }
+      else {
+         printf("invalid argument '%s'\n", argv[i]);
+         goto invalid_arg;
+      }
+   }
+   if(NULL == trace_path) {
+      goto invalid_arg;
+   }
+
+   signal(SIGPIPE, SIG_IGN);
+
+   if(load_trace(trace_path) < 0) {
+      return 1;
+   }
+   if(0 == nrecs) {
+      printf("no requests in %s\n", trace_path);
+      return 0;
+   }
+   qsort(recs, nrecs, sizeof(struct trace_rec_t), cmp_rec);
+   printf("%zu requests over %.2f s in trace\n", nrecs, (recs[nrecs - 1].rcvd_ns - recs[0].rcvd_ns) / 1e9);
+
+   write_data = calloc(1, SAMFS_MAX_PAYLOAD);
+   lanes = calloc(nlanes, sizeof(struct lane_t));
+   if(NULL == write_data || NULL == lanes || scan_paths() < 0 || assign_lanes(lanes, nlanes) < 0) {
+      printf("out of memory\n");
+      return 1;
+   }
+   if(setup_paths() < 0) {
+      return 1;
+   }
+
+   /* connections are set up before replay starts, their setup is not part of trace */
+   conns = 0;
+   for(l = 0; l < nlanes; l++) {
+      lanes[l].fd = -1;
+      if(0 == lanes[l].nrecs) {
+         continue;
+      }
+      lanes[l].buf = malloc(SAMFS_MAX_FRAME);
+      if(NULL == lanes[l].buf) {
+         return 1;
+      }
+      lanes[l].fd = connect_to_server(lanes[l].buf);
+      if(lanes[l].fd < 0) {
+         return 1;
+      }
+      conns++;
+   }
+
+   trace_start_ns = recs[0].rcvd_ns;
+   replay_start_ns = samfs_now_ns();
+   for(l = 0; l < nlanes; l++) {
+      if(lanes[l].fd >= 0 && pthread_create(&lanes[l].tid, NULL, lane_main, &lanes[l]) != 0) {
+         perror("pthread_create");
+         return 1;
+      }
+   }
+   for(l = 0; l < nlanes; l++) {
+      if(lanes[l].fd >= 0) {
+         pthread_join(lanes[l].tid, NULL);
+         close(lanes[l].fd);
+      }
+   }
+   elapsed = samfs_now_ns() - replay_start_ns;
+
+   printf("%llu connections, speed %g\n", (unsigned long long) conns, speed);
+   print_report(lanes, nlanes, elapsed);
+
+   return 0;
+
+invalid_arg:
+   printf("USAGE: %s [-server <ip>] [-url <dir>] [-speed <x>] [-conns <n>] <trace_file>\n", argv[0]);
+   return 0;
+}